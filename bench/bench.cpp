@@ -0,0 +1,958 @@
+#include "timer.h"
+#include "utils.h"
+#include "ray.h"
+#include "shape.h"
+#include "material.h"
+#include "setting.h"
+#include "camera.h"
+#include "scene_examples.h"
+#include "path_tracer.h"
+#include "wavefront.h"
+#include "renderer.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <filesystem>
+
+// Random spheres and triangles spread through a unit-ish cube, shot at with rays from outside.
+void randomScene(ShapeList &world, MaterialList &materials, int count, ThreadLocal &tl)
+{
+    Material *mat = materials.add<Lambertian>(col3(.5, .5, .5));
+    float size = glm::pow(float(count), 1.0f / 3.0f);
+    float radius = 0.3f;
+    for (int i = 0; i < count; i++)
+    {
+        point3 p = tl.randVec3(-size, size);
+        if (i % 2 == 0)
+        {
+            world.add<Sphere>(p, radius, mat);
+        }
+        else
+        {
+            world.add<NaiveTriangle>(p, p + tl.randVec3(-1, 1), p + tl.randVec3(-1, 1), mat);
+        }
+    }
+}
+
+std::vector<Ray> randomRays(int count, float sceneSize, ThreadLocal &tl)
+{
+    std::vector<Ray> rays(count);
+    for (auto &r : rays)
+    {
+        point3 origin = tl.randUnitVector() * sceneSize * 3.0f;
+        point3 target = tl.randVec3(-sceneSize, sceneSize);
+        r = Ray(origin, target - origin);
+    }
+    return rays;
+}
+
+template <typename HitFn>
+double raysPerSecond(const std::vector<Ray> &rays, int &hits, HitFn &&hitFn)
+{
+    HitRecord rec;
+    hits = 0;
+    TimeIt timer;
+    for (auto &r : rays)
+    {
+        if (hitFn(r, rec)) hits++;
+    }
+    float us = glm::max(timer.now(), 1.0f);
+    return rays.size() / (us / 1e6);
+}
+
+// small triangles with every tenth one a long thin diagonal sliver, the bad case for object split bvhs
+void benchSpatialSplits(int count)
+{
+    ThreadLocal tl;
+    tl.init(1);
+    ShapeList world;
+    MaterialList materials;
+    Material *mat = materials.add<Lambertian>(col3(.5, .5, .5));
+    float size = glm::pow(float(count), 1.0f / 3.0f);
+    for (int i = 0; i < count; i++)
+    {
+        point3 p = tl.randVec3(-size, size);
+        if (i % 10 == 0)
+        {
+            // a long sliver running diagonally through a good part of the scene
+            vec3 along = glm::normalize(vec3(1, 1, 1) + tl.randVec3(-0.2f, 0.2f)) * size * 0.4f;
+            world.add<NaiveTriangle>(p - along, p + along, p + tl.randVec3(-0.1f, 0.1f), mat);
+        }
+        else
+        {
+            world.add<NaiveTriangle>(p, p + tl.randVec3(-0.5f, 0.5f), p + tl.randVec3(-0.5f, 0.5f), mat);
+        }
+    }
+    std::vector<Ray> rays = randomRays(20000, size, tl);
+
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.bvhLayout = BVHLayout::Binary;
+    const char *builderNames[] = {"SAH", "LBVH", "SBVH"};
+    for (BVHBuilder builder : {BVHBuilder::SAH, BVHBuilder::SBVH})
+    {
+        setting.bvhBuilder = builder;
+        TimeIt timer;
+        world.build(setting);
+        float buildMs = timer.now() / 1000;
+
+        TraversalStats stats;
+        int hits;
+        raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec, &stats); });
+        double rate = raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec); });
+        size_t maxReferences = size_t(count * (1.0f + setting.sbvhSplitBudget));
+        if (world.bvh.primIndices.size() > maxReferences)
+        {
+            fprintf(stderr, "split budget exceeded: %zu references, %zu allowed\n", world.bvh.primIndices.size(), maxReferences);
+        }
+
+        printf("%10d %8s %10.2f %12zu %10zu %14.2f %14.2f %14.0f %8d\n", count, builderNames[int(builder)], buildMs,
+               world.bvh.primIndices.size(), world.bvh.nodes.size(),
+               double(stats.nodeVisits) / rays.size(), double(stats.primTests) / rays.size(), rate, hits);
+    }
+}
+
+// node memory of every layout against how fast it is traversed, the quantized layouts trade a little
+// precision in the boxes for about half the memory
+void benchNodeMemory(int count, int numThreads)
+{
+    ThreadLocal tl;
+    tl.init(1);
+    ShapeList world;
+    MaterialList materials;
+    randomScene(world, materials, count, tl);
+    float sceneSize = glm::pow(float(count), 1.0f / 3.0f);
+    std::vector<Ray> rays = randomRays(200000, sceneSize, tl);
+
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.numThreads = numThreads;
+    const char *layoutNames[] = {"binary", "wide4", "wide8", "wide4q", "wide8q"};
+    for (BVHLayout layout : {BVHLayout::Binary, BVHLayout::Wide4, BVHLayout::Wide4Quantized, BVHLayout::Wide8, BVHLayout::Wide8Quantized})
+    {
+        setting.bvhLayout = layout;
+        world.build(setting);
+
+        TraversalStats stats;
+        int hits;
+        raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec, &stats); });
+        double rate = raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec); });
+
+        size_t bytes = world.nodeMemory();
+        printf("%10d %8s %12.1f %12.1f %14.2f %14.2f %14.0f %8d\n", count, layoutNames[int(layout)], bytes / 1024.0, double(bytes) / count,
+               double(stats.nodeVisits) / rays.size(), double(stats.primTests) / rays.size(), rate, hits);
+    }
+}
+
+// A bumpy sheet of triangles as separate NaiveTriangles against one indexed TriangleMesh. Bytes per triangle count the
+// shapes, the flat arrays and the bvh, without the heap overhead of allocating every NaiveTriangle on its own.
+void benchMesh(int count, int numThreads)
+{
+    ThreadLocal tl;
+    tl.init(1);
+    MaterialList materials;
+    Material *mat = materials.add<Lambertian>(col3(.5, .5, .5));
+    int quads = glm::max(1, int(glm::sqrt(count / 2.0f)));
+    float size = glm::pow(float(count), 1.0f / 3.0f);
+    std::vector<point3> positions;
+    for (int j = 0; j <= quads; j++)
+    {
+        for (int i = 0; i <= quads; i++)
+        {
+            positions.push_back(point3((float(i) / quads - 0.5f) * 2 * size, tl.randFloat(-0.5f, 0.5f), (float(j) / quads - 0.5f) * 2 * size));
+        }
+    }
+    std::vector<uint32_t> indices;
+    for (int j = 0; j < quads; j++)
+    {
+        for (int i = 0; i < quads; i++)
+        {
+            uint32_t corner = uint32_t(j * (quads + 1) + i);
+            uint32_t quad[6] = {corner, corner + quads + 1, corner + 1, corner + 1, corner + quads + 1, corner + quads + 2};
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    size_t triangles = indices.size() / 3;
+    std::vector<Ray> rays = randomRays(200000, size, tl);
+
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.numThreads = numThreads;
+    ShapeList naive;
+    for (size_t t = 0; t < triangles; t++)
+    {
+        naive.add<NaiveTriangle>(positions[indices[3 * t]], positions[indices[3 * t + 1]], positions[indices[3 * t + 2]], mat);
+    }
+    naive.build(setting);
+    // the flat arrays hold 9 floats, a normal, a material and a reference per triangle
+    size_t naiveBytes = triangles * (sizeof(NaiveTriangle) + sizeof(Shape*) + 9 * sizeof(float) + sizeof(vec3) + sizeof(Material*) +
+                                     sizeof(uint32_t) + sizeof(uint32_t)) + naive.nodeMemory();
+    int naiveHits;
+    double naiveRate = raysPerSecond(rays, naiveHits, [&](const Ray &r, HitRecord &rec) { return naive.hit(r, 0.0001, INFINITY, rec); });
+
+    ShapeList world;
+    TriangleMesh *mesh = world.add<TriangleMesh>(std::move(positions), std::move(indices), mat);
+    world.build(setting);
+    int meshHits;
+    double meshRate = raysPerSecond(rays, meshHits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec); });
+
+    printf("%10zu %16.1f %16.1f %16.0f %16.0f %8d %8d\n", triangles, double(naiveBytes) / triangles, double(mesh->memory()) / triangles,
+           naiveRate, meshRate, naiveHits, meshHits);
+}
+
+// same sized spheres spread evenly, the case grids are made for
+void benchGrid(int count, int numThreads)
+{
+    ThreadLocal tl;
+    tl.init(1);
+    ShapeList world;
+    MaterialList materials;
+    Material *mat = materials.add<Lambertian>(col3(.5, .5, .5));
+    float size = glm::pow(float(count), 1.0f / 3.0f);
+    for (int i = 0; i < count; i++)
+    {
+        world.add<Sphere>(tl.randVec3(-size, size), 0.3f, mat);
+    }
+    std::vector<Ray> rays = randomRays(200000, size, tl);
+
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.numThreads = numThreads;
+    setting.bvhLayout = BVHLayout::Wide8Quantized;
+    struct Variant { const char *name; Accelerator accelerator; BVHBuilder builder; };
+    Variant variants[] = {
+        {"SAH wide8q", Accelerator::BVH, BVHBuilder::SAH},
+        {"LBVH wide8q", Accelerator::BVH, BVHBuilder::LBVH},
+        {"grid", Accelerator::Grid, BVHBuilder::SAH},
+        {"2 level grid", Accelerator::TwoLevelGrid, BVHBuilder::SAH},
+    };
+    for (const Variant &variant : variants)
+    {
+        world.accelerator = variant.accelerator;
+        setting.bvhBuilder = variant.builder;
+        TimeIt timer;
+        world.build(setting);
+        float buildMs = timer.now() / 1000;
+
+        TraversalStats stats;
+        int hits;
+        raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec, &stats); });
+        double rate = raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec); });
+
+        printf("%10d %14s %10.2f %14.2f %14.2f %14.0f %8d\n", count, variant.name, buildMs,
+               double(stats.nodeVisits) / rays.size(), double(stats.primTests) / rays.size(), rate, hits);
+    }
+}
+
+// shadow ray like queries between two points inside the scene, answered with the closest hit against the any hit path
+void benchOcclusion(int count, int numThreads)
+{
+    ThreadLocal tl;
+    tl.init(1);
+    ShapeList world;
+    MaterialList materials;
+    randomScene(world, materials, count, tl);
+    float size = glm::pow(float(count), 1.0f / 3.0f);
+    // t runs from 0 to 1 between the two points
+    std::vector<Ray> rays(200000);
+    for (auto &r : rays)
+    {
+        point3 from = tl.randVec3(-size, size);
+        r = Ray(from, tl.randVec3(-size, size) - from);
+    }
+
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.numThreads = numThreads;
+    struct Variant { const char *name; Accelerator accelerator; BVHLayout layout; };
+    Variant variants[] = {
+        {"binary", Accelerator::BVH, BVHLayout::Binary},
+        {"wide8q", Accelerator::BVH, BVHLayout::Wide8Quantized},
+        {"grid", Accelerator::Grid, BVHLayout::Binary},
+    };
+    for (const Variant &variant : variants)
+    {
+        world.accelerator = variant.accelerator;
+        setting.bvhLayout = variant.layout;
+        world.build(setting);
+
+        TraversalStats hitStats, occludedStats;
+        int hits, occluded;
+        raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, 1, rec, &hitStats); });
+        raysPerSecond(rays, occluded, [&](const Ray &r, HitRecord &) { return world.occluded(r, 0.0001, 1, &occludedStats); });
+        double hitRate = raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, 1, rec); });
+        double occludedRate = raysPerSecond(rays, occluded, [&](const Ray &r, HitRecord &) { return world.occluded(r, 0.0001, 1); });
+        if (hits != occluded)
+        {
+            fprintf(stderr, "occlusion mismatch: hit %d, occluded %d\n", hits, occluded);
+        }
+
+        printf("%10d %8s %14.2f %14.2f %16.0f %16.0f %9.1fx\n", count, variant.name, double(hitStats.nodeVisits) / rays.size(),
+               double(occludedStats.nodeVisits) / rays.size(), hitRate, occludedRate, occludedRate / hitRate);
+    }
+}
+
+// Spheres or triangles only, closest hit rays/s with the leaf kernels forced down to every simd level the cpu has. Bvh
+// leaves hold up to 8 shapes, grid cells are handed over as batches too.
+void benchLeafKernel(int count, bool triangles, int numThreads)
+{
+    ThreadLocal tl;
+    tl.init(1);
+    ShapeList world;
+    MaterialList materials;
+    Material *mat = materials.add<Lambertian>(col3(.5, .5, .5));
+    float size = glm::pow(float(count), 1.0f / 3.0f);
+    for (int i = 0; i < count; i++)
+    {
+        point3 p = tl.randVec3(-size, size);
+        if (triangles)
+        {
+            world.add<NaiveTriangle>(p, p + tl.randVec3(-1, 1), p + tl.randVec3(-1, 1), mat);
+        }
+        else
+        {
+            world.add<Sphere>(p, tl.randFloat(0.1f, 0.6f), mat);
+        }
+    }
+    std::vector<Ray> rays = randomRays(200000, size, tl);
+
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.numThreads = numThreads;
+    struct Variant { const char *name; Accelerator accelerator; BVHLayout layout; };
+    Variant variants[] = {
+        {"binary", Accelerator::BVH, BVHLayout::Binary},
+        {"wide8q", Accelerator::BVH, BVHLayout::Wide8Quantized},
+        {"grid", Accelerator::Grid, BVHLayout::Binary},
+    };
+    const char *levelNames[] = {"scalar", "sse", "avx2", "avx512"};
+    SimdLevel cpuLevel = cpuSimdLevel();
+    for (const Variant &variant : variants)
+    {
+        world.accelerator = variant.accelerator;
+        setting.bvhLayout = variant.layout;
+        world.build(setting);
+
+        double scalarRate = 0;
+        for (int level = 0; level <= int(cpuLevel); level++)
+        {
+            cpuSimdLevel() = SimdLevel(level);
+            int hits;
+            double rate = raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec); });
+            if (level == 0) scalarRate = rate;
+            printf("%10d %10s %8s %8s %14.0f %8d %8.2fx\n", count, triangles ? "triangles" : "spheres", variant.name, levelNames[level], rate,
+                   hits, rate / scalarRate);
+        }
+        cpuSimdLevel() = cpuLevel;
+    }
+}
+
+// Primary rays of a 512x512 image, traced one by one and as packets of neighbouring pixels. Packets use the binary
+// bvh, the scalar wide8q line is the fastest single ray path for comparison. The mixed scene is randomScene(), the
+// triangle one has nothing else, which times the packet triangle test on its own.
+template <int W>
+double packetRaysPerSecond(ShapeList &world, const std::vector<Ray> &rays, int imageSize, int &hits)
+{
+    constexpr int blockWidth = W >= 8 ? 4 : 2;
+    constexpr int blockHeight = W / blockWidth;
+    hits = 0;
+    TimeIt timer;
+    for (int j = 0; j < imageSize; j += blockHeight)
+    {
+        for (int i = 0; i < imageSize; i += blockWidth)
+        {
+            Ray block[W];
+            for (int lane = 0; lane < W; lane++)
+            {
+                block[lane] = rays[(j + lane / blockWidth) * imageSize + i + lane % blockWidth];
+            }
+            HitRecord recs[W];
+            int mask = world.hitPacket(RayPacket<W>(block), (1 << W) - 1, 0.0001, INFINITY, recs);
+            for (; mask; mask &= mask - 1) hits++;
+        }
+    }
+    float us = glm::max(timer.now(), 1.0f);
+    return rays.size() / (us / 1e6);
+}
+
+void benchPackets(int count, bool triangles, int numThreads)
+{
+    ThreadLocal tl;
+    tl.init(1);
+    ShapeList world;
+    MaterialList materials;
+    float size = glm::pow(float(count), 1.0f / 3.0f);
+    if (triangles)
+    {
+        Material *mat = materials.add<Lambertian>(col3(.5, .5, .5));
+        for (int i = 0; i < count; i++)
+        {
+            point3 p = tl.randVec3(-size, size);
+            world.add<NaiveTriangle>(p, p + tl.randVec3(-1, 1), p + tl.randVec3(-1, 1), mat);
+        }
+    }
+    else
+    {
+        randomScene(world, materials, count, tl);
+    }
+
+    const int imageSize = 512;
+    Camera cam(point3(size * 0.5f, size * 0.3f, size * 2.5f), point3(0), vec3(0, 1, 0), 1.0f, 40.0f);
+    std::vector<Ray> rays(imageSize * imageSize);
+    for (int j = 0; j < imageSize; j++)
+    {
+        for (int i = 0; i < imageSize; i++)
+        {
+            rays[j * imageSize + i] = cam.getRay((i + 0.5f) / imageSize, (j + 0.5f) / imageSize);
+        }
+    }
+
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.numThreads = numThreads;
+    setting.bvhLayout = BVHLayout::Wide8Quantized;
+    world.build(setting);
+    int wideHits;
+    double wideRate = raysPerSecond(rays, wideHits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec); });
+
+    setting.bvhLayout = BVHLayout::Binary;
+    world.build(setting);
+    int hits[4];
+    double rates[4];
+    rates[0] = raysPerSecond(rays, hits[0], [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec); });
+    rates[1] = packetRaysPerSecond<4>(world, rays, imageSize, hits[1]);
+    rates[2] = packetRaysPerSecond<8>(world, rays, imageSize, hits[2]);
+    rates[3] = packetRaysPerSecond<16>(world, rays, imageSize, hits[3]);
+    for (int i = 1; i < 4; i++)
+    {
+        if (glm::abs(hits[i] - hits[0]) > 4) fprintf(stderr, "packet mismatch: scalar %d hits, packet %d hits\n", hits[0], hits[i]);
+    }
+
+    printf("%10d %10s %14.0f %14.0f %14.0f %14.0f %14.0f %8.1fx\n", count, triangles ? "triangles" : "mixed", wideRate, rates[0], rates[1],
+           rates[2], rates[3], rates[3] / rates[0]);
+}
+
+// the recursion rayColor() used to be, without russian roulette, as the reference for the mean
+col3 recursiveColor(const Ray &r, ShapeList &world, Settings &setting, int depth, ThreadLocal &tl)
+{
+    if (depth <= 0) return col3(0, 0, 0);
+    HitRecord rec;
+    if (!world.hit(r, 0.0001, INFINITY, rec)) return setting.background;
+    Ray scattered;
+    col3 attenuation;
+    col3 emitted = rec.material->emitted(rec.u, rec.v, rec.p);
+    if (!rec.material->scatter(r, rec, attenuation, scattered, tl)) return emitted;
+    return emitted + attenuation * recursiveColor(scattered, world, setting, depth - 1, tl);
+}
+
+// Full paths on the random spheres scene: the old recursion, the path loop without and with russian roulette and the
+// wavefront integrator at a few batch sizes. The mean pixel value should match between them up to noise.
+void benchWavefront(int imageSize)
+{
+    ShapeList world;
+    MaterialList materials;
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.samplesPerPixel = 4;
+    point3 from, at;
+    random_spheres_example(world, materials, setting, from, at);
+    world.build(setting);
+    LightList lights;
+    lights.build(world);
+    Camera cam(from, at, vec3(0, 1, 0), 1.0f, 20.0f);
+    double paths = double(imageSize) * imageSize * setting.samplesPerPixel;
+
+    auto mean = [](const std::vector<col3> &sums, double paths)
+    {
+        col3 total(0, 0, 0);
+        for (const col3 &sum : sums) total += sum;
+        return (total.x + total.y + total.z) / (3.0 * paths);
+    };
+
+    std::vector<col3> sums(size_t(imageSize) * imageSize, col3(0, 0, 0));
+    ThreadLocal tl;
+    tl.init(1);
+    TimeIt timer;
+    auto tracePixels = [&](const char *name, auto &&color)
+    {
+        std::fill(sums.begin(), sums.end(), col3(0, 0, 0));
+        timer.from();
+        for (int j = 0; j < imageSize; j++)
+        {
+            for (int i = 0; i < imageSize; i++)
+            {
+                for (int s = 0; s < setting.samplesPerPixel; s++)
+                {
+                    float u = float(i + tl.randFloat()) / (imageSize - 1);
+                    float v = float(j + tl.randFloat()) / (imageSize - 1);
+                    sums[j * imageSize + i] += color(cam.getRay(u, v));
+                }
+            }
+        }
+        float us = glm::max(timer.now(), 1.0f);
+        printf("%10d %12s %16.0f %10.4f\n", imageSize, name, paths / (us / 1e6), mean(sums, paths));
+    };
+    tracePixels("recursive", [&](const Ray &r) { return recursiveColor(r, world, setting, setting.maxDepth, tl); });
+    int rouletteDepth = setting.rouletteDepth;
+    setting.rouletteDepth = setting.maxDepth + 1;
+    tracePixels("path", [&](const Ray &r) { return rayColor(r, world, lights, setting, tl); });
+    setting.rouletteDepth = rouletteDepth;
+    tracePixels("roulette", [&](const Ray &r) { return rayColor(r, world, lights, setting, tl); });
+
+    // the intersect stage one ray at a time, then in packets of 8
+    float us;
+    for (int packetSize : {1, 8})
+    {
+        for (int batchSize : {1 << 10, 1 << 14, 1 << 18})
+        {
+            std::fill(sums.begin(), sums.end(), col3(0, 0, 0));
+            setting.wavefrontBatchSize = batchSize;
+            setting.packetSize = packetSize;
+            WavefrontIntegrator integrator;
+            timer.from();
+            integrator.render(Tile{0, 0, imageSize, imageSize}, imageSize, imageSize, setting, cam, world, lights, sums.data(), tl);
+            us = glm::max(timer.now(), 1.0f);
+            char name[32];
+            snprintf(name, sizeof(name), "%d x%d", batchSize, packetSize);
+            printf("%10d %12s %16.0f %10.4f\n", imageSize, name, paths / (us / 1e6), mean(sums, paths));
+        }
+    }
+}
+
+// The small light of my_example_scene with and without light sampling at a few sample counts, error against a
+// reference rendered with many samples and light sampling. At equal samples the error should be far lower with it.
+void benchLightSampling(int imageSize)
+{
+    ShapeList world;
+    MaterialList materials;
+    Settings setting;
+    setting.bvhCacheDir = "";
+    point3 from, at;
+    my_example_scene(world, materials, setting, from, at);
+    world.build(setting);
+    LightList lights;
+    lights.build(world);
+    Camera cam(from, at, vec3(0, 1, 0), 1.0f, setting.fov);
+    ThreadLocal tl;
+    tl.init(1);
+
+    auto renderImage = [&](int samples, std::vector<col3> &image)
+    {
+        image.assign(size_t(imageSize) * imageSize, col3(0, 0, 0));
+        for (int j = 0; j < imageSize; j++)
+        {
+            for (int i = 0; i < imageSize; i++)
+            {
+                for (int s = 0; s < samples; s++)
+                {
+                    float u = float(i + tl.randFloat()) / (imageSize - 1);
+                    float v = float(j + tl.randFloat()) / (imageSize - 1);
+                    image[j * imageSize + i] += rayColor(cam.getRay(u, v), world, lights, setting, tl) / float(samples);
+                }
+            }
+        }
+    };
+    std::vector<col3> reference, image;
+    renderImage(1024, reference);
+    for (int samples : {4, 16, 64})
+    {
+        for (bool lightSampling : {false, true})
+        {
+            setting.lightSampling = lightSampling;
+            TimeIt timer;
+            renderImage(samples, image);
+            float us = glm::max(timer.now(), 1.0f);
+            double error = 0;
+            for (size_t p = 0; p < image.size(); p++)
+            {
+                col3 d = image[p] - reference[p];
+                error += glm::dot(d, d) / 3;
+            }
+            printf("%10d %8d %8s %16.0f %12.5f\n", imageSize, samples, lightSampling ? "on" : "off",
+                   double(imageSize) * imageSize * samples / (us / 1e6), glm::sqrt(error / image.size()));
+        }
+        setting.lightSampling = true;
+    }
+}
+
+// Many small lights of uneven power spread over a floor that grows with their count, the camera looking at its middle.
+// Light samples picked uniformly mostly land on lights too far away to matter once there are many, the light tree
+// should keep the error at equal samples about flat as the count grows.
+void benchLightTree(int lightCount, int imageSize)
+{
+    ShapeList world;
+    MaterialList materials;
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.maxDepth = 3;
+    setting.background = col3(0, 0, 0);
+    ThreadLocal tl;
+    tl.init(1);
+
+    float size = 2 * glm::sqrt(float(lightCount));
+    Material *floor = materials.add<Lambertian>(col3(.7, .7, .7));
+    world.add<NaiveTriangle>(point3(-size, 0, -size), point3(size, 0, -size), point3(size, 0, size), floor);
+    world.add<NaiveTriangle>(point3(-size, 0, -size), point3(size, 0, size), point3(-size, 0, size), floor);
+    Material *dim = materials.add<Diffuse>(col3(20, 20, 20));
+    Material *bright = materials.add<Diffuse>(col3(200, 160, 120));
+    for (int i = 0; i < lightCount; i++)
+    {
+        Material *mat = i % 8 == 0 ? bright : dim;
+        point3 p(tl.randFloat(-size, size), tl.randFloat(0.2f, 1.0f), tl.randFloat(-size, size));
+        if (i % 2 == 0)
+        {
+            world.add<Sphere>(p, 0.05f, mat);
+        }
+        else
+        {
+            world.add<NaiveTriangle>(p, p + tl.randVec3(-0.1f, 0.1f), p + tl.randVec3(-0.1f, 0.1f), mat);
+        }
+    }
+    world.build(setting);
+    Camera cam(point3(0, 8, 8), point3(0, 0, 0), vec3(0, 1, 0), 1.0f, 60.0f);
+
+    // rays through the pixel centers, so the tiny lights the camera sees don't add noise of their own
+    LightList lights;
+    auto renderImage = [&](int samples, std::vector<col3> &image)
+    {
+        image.assign(size_t(imageSize) * imageSize, col3(0, 0, 0));
+        for (int j = 0; j < imageSize; j++)
+        {
+            for (int i = 0; i < imageSize; i++)
+            {
+                for (int s = 0; s < samples; s++)
+                {
+                    float u = (i + 0.5f) / (imageSize - 1);
+                    float v = (j + 0.5f) / (imageSize - 1);
+                    image[j * imageSize + i] += rayColor(cam.getRay(u, v), world, lights, setting, tl) / float(samples);
+                }
+            }
+        }
+    };
+    std::vector<col3> reference, image;
+    lights.build(world, true);
+    renderImage(1024, reference);
+    for (bool tree : {false, true})
+    {
+        TimeIt timer;
+        lights.build(world, tree);
+        float buildMs = timer.now() / 1000;
+        timer.from();
+        renderImage(16, image);
+        float us = glm::max(timer.now(), 1.0f);
+        double error = 0;
+        for (size_t p = 0; p < image.size(); p++)
+        {
+            col3 d = image[p] - reference[p];
+            error += glm::dot(d, d) / 3;
+        }
+        printf("%10d %10s %10.2f %16.0f %12.5f\n", lightCount, tree ? "tree" : "uniform", buildMs,
+               double(imageSize) * imageSize * 16 / (us / 1e6), glm::sqrt(error / image.size()));
+    }
+}
+
+// builds the same scene twice with the on disk cache, the second build should only map the file
+void benchCache(int count, int numThreads)
+{
+    std::filesystem::path dir = std::filesystem::temp_directory_path() / "raytracer_bench_cache";
+    std::filesystem::remove_all(dir);
+
+    Settings setting;
+    setting.numThreads = numThreads;
+    setting.bvhCacheDir = dir.string();
+    MaterialList materials;
+    ThreadLocal tl;
+    float sceneSize = glm::pow(float(count), 1.0f / 3.0f);
+
+    ShapeList cold, cached;
+    tl.init(1);
+    randomScene(cold, materials, count, tl);
+    tl.init(1);
+    randomScene(cached, materials, count, tl);
+
+    TimeIt timer;
+    cold.build(setting);
+    float coldMs = timer.now() / 1000;
+    timer.from();
+    cached.build(setting);
+    float cachedMs = timer.now() / 1000;
+
+    std::vector<Ray> rays = randomRays(100000, sceneSize, tl);
+    int coldHits, cachedHits;
+    double coldRays = raysPerSecond(rays, coldHits, [&](const Ray &r, HitRecord &rec) { return cold.hit(r, 0.0001, INFINITY, rec); });
+    double cachedRays = raysPerSecond(rays, cachedHits, [&](const Ray &r, HitRecord &rec) { return cached.hit(r, 0.0001, INFINITY, rec); });
+    if (coldHits != cachedHits)
+    {
+        fprintf(stderr, "hit count mismatch: built %d, cached %d\n", coldHits, cachedHits);
+    }
+    printf("%10d %14.2f %14.2f %16.0f %16.0f\n", count, coldMs, cachedMs, coldRays, cachedRays);
+
+    // another layout misses the cache and rebuilds while the trees still point into the file loaded before
+    setting.bvhLayout = setting.bvhLayout == BVHLayout::Wide4 ? BVHLayout::Binary : BVHLayout::Wide4;
+    cached.build(setting);
+    int rebuiltHits;
+    raysPerSecond(rays, rebuiltHits, [&](const Ray &r, HitRecord &rec) { return cached.hit(r, 0.0001, INFINITY, rec); });
+    if (rebuiltHits != coldHits) fprintf(stderr, "hit count mismatch: built %d, rebuilt %d\n", coldHits, rebuiltHits);
+
+    // a header whose arrays run past the end of the file has to be rejected, not read
+    for (auto &entry : std::filesystem::directory_iterator(dir))
+    {
+        std::fstream file(entry.path(), std::ios::in | std::ios::out | std::ios::binary);
+        BVHCacheHeader header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        header.primCount = header.fileSize;
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    ShapeList damaged;
+    tl.init(1);
+    randomScene(damaged, materials, count, tl);
+    damaged.build(setting);
+    int damagedHits;
+    raysPerSecond(rays, damagedHits, [&](const Ray &r, HitRecord &rec) { return damaged.hit(r, 0.0001, INFINITY, rec); });
+    if (damagedHits != coldHits) fprintf(stderr, "hit count mismatch: built %d, damaged cache %d\n", coldHits, damagedHits);
+
+    std::filesystem::remove_all(dir);
+}
+
+// moves every sphere a little per frame and compares refitting the tree against rebuilding it
+void benchRefit(int count, int numThreads)
+{
+    // two identical scenes, one is refit and the other one rebuilt every frame
+    ThreadLocal tl;
+    ShapeList refitWorld, rebuildWorld;
+    MaterialList materials;
+    tl.init(1);
+    randomScene(refitWorld, materials, count, tl);
+    tl.init(1);
+    randomScene(rebuildWorld, materials, count, tl);
+
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.numThreads = numThreads;
+    refitWorld.build(setting);
+    rebuildWorld.build(setting);
+    float sceneSize = glm::pow(float(count), 1.0f / 3.0f);
+    std::vector<Ray> rays = randomRays(100000, sceneSize, tl);
+
+    for (int frame = 0; frame < 8; frame++)
+    {
+        for (size_t i = 0; i < refitWorld.shapes.size(); i++)
+        {
+            if (Sphere *sphere = dynamic_cast<Sphere*>(refitWorld.shapes[i]))
+            {
+                vec3 offset = tl.randVec3(-0.3f, 0.3f);
+                sphere->cen += offset;
+                static_cast<Sphere*>(rebuildWorld.shapes[i])->cen += offset;
+            }
+        }
+
+        TimeIt timer;
+        bool rebuilt = refitWorld.refit(setting);
+        float refitMs = timer.now() / 1000;
+        timer.from();
+        rebuildWorld.build(setting);
+        float rebuildMs = timer.now() / 1000;
+
+        int hits;
+        double refitRays = raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return refitWorld.hit(r, 0.0001, INFINITY, rec); });
+        double rebuildRays = raysPerSecond(rays, hits, [&](const Ray &r, HitRecord &rec) { return rebuildWorld.hit(r, 0.0001, INFINITY, rec); });
+
+        printf("%10d %6d %10.2f %12.2f %16.0f %16.0f %s\n", count, frame, refitMs, rebuildMs, refitRays, rebuildRays, rebuilt ? "(rebuilt)" : "");
+    }
+}
+
+// Renders my_example_scene with a time budget and no sample limit, reports how long the job really took, the passes
+// every pixel got and the fewest and most samples any pixel reached. Overshooting the budget by more than about a
+// tile means the workers don't look at the deadline often enough.
+void benchTimeBudget(float budgetMs, int numThreads)
+{
+    ShapeList world;
+    MaterialList materials;
+    Settings setting;
+    setting.bvhCacheDir = "";
+    setting.numThreads = numThreads;
+    point3 from, at;
+    my_example_scene(world, materials, setting, from, at);
+    world.build(setting);
+    LightList lights;
+    lights.build(world);
+    Camera cam(from, at, vec3(0, 1, 0), 1.0f, setting.fov);
+
+    RenderJob job(128, 128, setting, cam, world, lights);
+    TimeIt timer;
+    job.run(1 << 20, budgetMs);
+    job.wait();
+    float ms = timer.now() / 1000;
+    std::vector<int> counts = job.sampleCounts();
+    auto range = std::minmax_element(counts.begin(), counts.end());
+    printf("%10.0f %10.2f %8d %8d %8d\n", budgetMs, ms, job.passes(), *range.first, *range.second);
+}
+
+// Cost of handing numThreads small tasks to threads and waiting for them, once with threads created and joined every
+// time like render() used to, once with the parked workers of the pool.
+void benchThreadPool(int numThreads)
+{
+    std::atomic<int> sink{0};
+    auto task = [&](int n) { sink.fetch_add(n, std::memory_order_relaxed); };
+    int rounds = 2000;
+
+    TimeIt timer;
+    for (int r = 0; r < rounds; r++)
+    {
+        std::vector<std::thread> threads;
+        for (int n = 0; n < numThreads; n++) threads.emplace_back(task, n);
+        for (auto &thread : threads) thread.join();
+    }
+    float spawnUs = timer.now() / rounds;
+
+    timer.from();
+    for (int r = 0; r < rounds; r++)
+    {
+        ThreadPool::global().run(numThreads, task);
+    }
+    float poolUs = timer.now() / rounds;
+    printf("%10d %14.2f %14.2f\n", numThreads, spawnUs, poolUs);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<int> sizes = {100, 1000, 10000, 100000};
+    if (argc > 1)
+    {
+        sizes = {std::atoi(argv[1])};
+    }
+    int numThreads = glm::max(1, int(std::thread::hardware_concurrency()));
+
+    printf("%10s %10s %8s %12s %16s %16s %10s\n", "shapes", "builder", "layout", "build ms", "linear rays/s", "bvh rays/s", "speedup");
+    for (int count : sizes)
+    {
+        ThreadLocal tl;
+        tl.init(1);
+        ShapeList world;
+        MaterialList materials;
+        randomScene(world, materials, count, tl);
+
+        float sceneSize = glm::pow(float(count), 1.0f / 3.0f);
+        // keep the linear path to roughly the same number of shape tests for every scene size
+        int linearRays = glm::max(100, int(2e7 / count));
+        std::vector<Ray> rays = randomRays(glm::max(linearRays, 200000), sceneSize, tl);
+        std::vector<Ray> linearSubset(rays.begin(), rays.begin() + linearRays);
+
+        int linearHits;
+        double linear = raysPerSecond(linearSubset, linearHits, [&](const Ray &r, HitRecord &rec) { return world.hitLinear(r, 0.0001, INFINITY, rec); });
+
+        const char *builderNames[] = {"SAH", "LBVH", "SBVH"};
+        const char *layoutNames[] = {"binary", "wide4", "wide8", "wide4q", "wide8q"};
+        Settings setting;
+        setting.bvhCacheDir = "";
+        setting.numThreads = numThreads;
+        for (BVHBuilder builder : {BVHBuilder::SAH, BVHBuilder::LBVH, BVHBuilder::SBVH})
+        {
+            for (BVHLayout layout : {BVHLayout::Binary, BVHLayout::Wide4, BVHLayout::Wide8, BVHLayout::Wide4Quantized, BVHLayout::Wide8Quantized})
+            {
+                setting.bvhBuilder = builder;
+                setting.bvhLayout = layout;
+                TimeIt timer;
+                world.build(setting);
+                float buildMs = timer.now() / 1000;
+
+                int bvhHits, bvhSubsetHits;
+                raysPerSecond(linearSubset, bvhSubsetHits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec); });
+                double bvh = raysPerSecond(rays, bvhHits, [&](const Ray &r, HitRecord &rec) { return world.hit(r, 0.0001, INFINITY, rec); });
+
+                if (linearHits != bvhSubsetHits)
+                {
+                    fprintf(stderr, "hit count mismatch: linear %d, %s %s %d\n", linearHits, builderNames[int(builder)], layoutNames[int(layout)], bvhSubsetHits);
+                }
+
+                printf("%10d %10s %8s %12.2f %16.0f %16.0f %9.1fx\n", count, builderNames[int(builder)], layoutNames[int(layout)], buildMs, linear, bvh, bvh / linear);
+            }
+        }
+    }
+
+    printf("\n%10s %8s %10s %12s %10s %14s %14s %14s %8s\n", "triangles", "builder", "build ms", "references", "nodes", "nodes/ray", "tests/ray", "rays/s", "hits");
+    for (int count : sizes)
+    {
+        benchSpatialSplits(count);
+    }
+
+    printf("\n%10s %8s %12s %12s %14s %14s %14s %8s\n", "shapes", "layout", "node KiB", "bytes/shape", "nodes/ray", "tests/ray", "rays/s", "hits");
+    for (int count : sizes)
+    {
+        benchNodeMemory(count, numThreads);
+    }
+
+    printf("\n%10s %16s %16s %16s %16s %8s %8s\n", "triangles", "naive bytes/tri", "mesh bytes/tri", "naive rays/s", "mesh rays/s",
+           "hits", "hits");
+    for (int count : sizes)
+    {
+        benchMesh(count, numThreads);
+    }
+
+    printf("\n%10s %14s %10s %14s %14s %14s %8s\n", "spheres", "accelerator", "build ms", "nodes/ray", "tests/ray", "rays/s", "hits");
+    for (int count : sizes)
+    {
+        benchGrid(count, numThreads);
+    }
+
+    printf("\n%10s %8s %14s %14s %16s %16s %10s\n", "shapes", "accel", "hit nodes/ray", "any nodes/ray", "hit rays/s", "occluded rays/s", "speedup");
+    for (int count : sizes)
+    {
+        benchOcclusion(count, numThreads);
+    }
+
+    printf("\n%10s %10s %8s %8s %14s %8s %9s\n", "shapes", "type", "accel", "kernel", "rays/s", "hits", "speedup");
+    for (int count : sizes)
+    {
+        benchLeafKernel(count, false, numThreads);
+        benchLeafKernel(count, true, numThreads);
+    }
+
+    printf("\n%10s %10s %14s %14s %14s %14s %14s %9s\n", "shapes", "type", "wide8q rays/s", "binary rays/s", "packet4 rays/s",
+           "packet8 rays/s", "packet16 rays/s", "speedup");
+    for (int count : sizes)
+    {
+        benchPackets(count, false, numThreads);
+        benchPackets(count, true, numThreads);
+    }
+
+    printf("\n%10s %12s %16s %10s\n", "image", "batch", "paths/s", "mean");
+    benchWavefront(256);
+
+    printf("\n%10s %8s %8s %16s %12s\n", "image", "samples", "lights", "paths/s", "rmse");
+    benchLightSampling(64);
+
+    printf("\n%10s %10s %10s %16s %12s\n", "lights", "selection", "build ms", "paths/s", "rmse");
+    for (int lightCount : {10, 100, 1000, 10000})
+    {
+        benchLightTree(lightCount, 32);
+    }
+
+    printf("\n%10s %10s %8s %8s %8s\n", "budget ms", "taken ms", "passes", "min spp", "max spp");
+    for (float budgetMs : {50.0f, 200.0f})
+    {
+        benchTimeBudget(budgetMs, numThreads);
+    }
+
+    printf("\n%10s %14s %14s\n", "tasks", "spawn us", "pool us");
+    for (int tasks : {numThreads, 4 * numThreads})
+    {
+        benchThreadPool(tasks);
+    }
+
+    printf("\n%10s %14s %14s %16s %16s\n", "shapes", "build+save ms", "cache load ms", "built rays/s", "cached rays/s");
+    for (int count : sizes)
+    {
+        benchCache(count, numThreads);
+    }
+
+    printf("\n%10s %6s %10s %12s %16s %16s\n", "shapes", "frame", "refit ms", "rebuild ms", "refit rays/s", "rebuild rays/s");
+    for (int count : sizes)
+    {
+        benchRefit(count, numThreads);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include "ray.h"
+
+#include <cmath>
+
+struct AABB
+{
+    point3 min{INFINITY};
+    point3 max{-INFINITY};
+
+    AABB() = default;
+    AABB(const point3 &min, const point3 &max) : min(min), max(max) {}
+
+    inline void grow(const point3 &p)
+    {
+        min = glm::min(min, p);
+        max = glm::max(max, p);
+    }
+    inline void grow(const AABB &b)
+    {
+        min = glm::min(min, b.min);
+        max = glm::max(max, b.max);
+    }
+    inline bool empty() const
+    {
+        return min.x > max.x || min.y > max.y || min.z > max.z;
+    }
+    // empty() when the boxes don't overlap
+    inline AABB intersection(const AABB &b) const
+    {
+        return AABB(glm::max(min, b.min), glm::min(max, b.max));
+    }
+    inline point3 centroid() const
+    {
+        return (min + max) * 0.5f;
+    }
+    inline vec3 extent() const
+    {
+        return max - min;
+    }
+    inline float area() const
+    {
+        if (empty()) return 0;
+        vec3 e = extent();
+        return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+    }
+    inline int longestAxis() const
+    {
+        vec3 e = extent();
+        if (e.x > e.y && e.x > e.z) return 0;
+        return e.y > e.z ? 1 : 2;
+    }
+
+    // slab test, returns the entry distance or INFINITY on a miss
+    inline float intersect(const Ray &r, const vec3 &invDir, float t_min, float t_max) const
+    {
+        float tExit;
+        return intersect(r, invDir, t_min, t_max, tExit);
+    }
+    // same, also giving the distance where the ray leaves the box
+    inline float intersect(const Ray &r, const vec3 &invDir, float t_min, float t_max, float &tExit) const
+    {
+        vec3 t0 = (min - r.origin) * invDir;
+        vec3 t1 = (max - r.origin) * invDir;
+        vec3 tSmall = glm::min(t0, t1);
+        vec3 tBig = glm::max(t0, t1);
+        float tEnter = glm::max(glm::max(tSmall.x, tSmall.y), glm::max(tSmall.z, t_min));
+        tExit = glm::min(glm::min(tBig.x, tBig.y), glm::min(tBig.z, t_max));
+        return tEnter <= tExit ? tEnter : INFINITY;
+    }
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef ACCUMULATION_H
+#define ACCUMULATION_H
+
+#include "vector.h"
+#include "utils.h"
+#include "setting.h"
+
+#include <vector>
+
+// Per pixel sums of every sample traced so far, the color in xyz and the sample count in w, so more samples can be
+// added to any pixel at any time and each pixel is averaged over its own count. resolve() turns it into display
+// pixels as a separate pass.
+class AccumulationBuffer
+{
+public:
+    // clears
+    void resize(int width, int height)
+    {
+        this->width = glm::max(width, 0);
+        this->height = glm::max(height, 0);
+        pixels.assign(size_t(this->width) * this->height, vec4(0));
+    }
+    void clear()
+    {
+        std::fill(pixels.begin(), pixels.end(), vec4(0));
+    }
+    // adds samples samples summing to sum to pixel (i, j)
+    void add(int i, int j, const col3 &sum, int samples)
+    {
+        pixels[size_t(j) * width + i] += vec4(sum, float(samples));
+    }
+    const vec4 &at(int i, int j) const { return pixels[size_t(j) * width + i]; }
+    int samples(int i, int j) const { return int(at(i, j).w); }
+
+    int width = 0, height = 0;
+    std::vector<vec4> pixels;
+};
+
+// Display color of an accumulated pixel: the average scaled by exposure, mapped to [0, 1] by the tonemap curve and
+// gamma encoded. Pixels without samples are black.
+inline uint32_t resolvePixel(const vec4 &sum, const Settings &setting)
+{
+    col3 c = sum.w > 0 ? col3(sum) * (setting.exposure / sum.w) : col3(0, 0, 0);
+    switch (setting.tonemap)
+    {
+        case Tonemap::Reinhard:
+            c = c / (1.0f + c);
+            break;
+        case Tonemap::ACES:
+            // Narkowicz's fit of the ACES filmic curve
+            c = (c * (2.51f * c + 0.03f)) / (c * (2.43f * c + 0.59f) + 0.14f);
+            break;
+        default:
+            break;
+    }
+    c = glm::clamp(c, 0.0f, 1.0f);
+    c = setting.gamma == 2.0f ? glm::sqrt(c) : glm::pow(c, col3(1.0f / setting.gamma));
+    return color(c);
+}
+
+// the resolve pass, buffer.width x buffer.height pixels into out
+inline void resolve(const AccumulationBuffer &buffer, const Settings &setting, uint32_t *out)
+{
+    for (size_t p = 0; p < buffer.pixels.size(); p++)
+    {
+        out[p] = resolvePixel(buffer.pixels[p], setting);
+    }
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include <vector>
+#include <cstddef>
+#include <utility>
+
+// Vector like storage that can also point at memory owned by something else (e.g. a mapped file) without
+// copying it. Borrowed memory is copied into own storage as soon as the size has to change.
+template <typename T>
+class Array
+{
+public:
+    Array() = default;
+    Array(const Array &other) { *this = other; }
+    Array(Array &&other) noexcept { *this = std::move(other); }
+    Array &operator=(const Array &other)
+    {
+        if (this != &other)
+        {
+            storage.assign(other.begin(), other.end());
+            borrowed = false;
+            sync();
+        }
+        return *this;
+    }
+    Array &operator=(Array &&other) noexcept
+    {
+        storage = std::move(other.storage);
+        first = other.first;
+        count = other.count;
+        borrowed = other.borrowed;
+        other.borrowed = false;
+        other.sync();
+        return *this;
+    }
+    Array &operator=(std::vector<T> &&vec)
+    {
+        storage = std::move(vec);
+        borrowed = false;
+        sync();
+        return *this;
+    }
+
+    void borrow(T *data, size_t size)
+    {
+        storage.clear();
+        storage.shrink_to_fit();
+        first = data;
+        count = size;
+        borrowed = true;
+    }
+    bool isBorrowed() const { return borrowed; }
+
+    inline T &operator[](size_t i) { return first[i]; }
+    inline const T &operator[](size_t i) const { return first[i]; }
+    inline T *data() { return first; }
+    inline const T *data() const { return first; }
+    inline T *begin() { return first; }
+    inline T *end() { return first + count; }
+    inline const T *begin() const { return first; }
+    inline const T *end() const { return first + count; }
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+    inline T &back() { return first[count - 1]; }
+
+    void push_back(const T &value)
+    {
+        own();
+        storage.push_back(value);
+        sync();
+    }
+    template <typename... Args>
+    T &emplace_back(Args&&... args)
+    {
+        own();
+        storage.emplace_back(std::forward<Args>(args)...);
+        sync();
+        return storage.back();
+    }
+    void resize(size_t size)
+    {
+        own();
+        storage.resize(size);
+        sync();
+    }
+    void reserve(size_t size)
+    {
+        own();
+        storage.reserve(size);
+        sync();
+    }
+    void clear()
+    {
+        storage.clear();
+        borrowed = false;
+        sync();
+    }
+
+private:
+    void own()
+    {
+        if (borrowed)
+        {
+            storage.assign(first, first + count);
+            borrowed = false;
+        }
+    }
+    void sync()
+    {
+        first = storage.data();
+        count = storage.size();
+    }
+
+    std::vector<T> storage;
+    T *first = nullptr;
+    size_t count = 0;
+    bool borrowed = false;
+};
+
+#endif
@@ -0,0 +1,802 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "aabb.h"
+#include "array.h"
+#include "morton.h"
+#include "parallel.h"
+#include "packet.h"
+
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <type_traits>
+
+enum class BVHBuilder
+{
+    SAH,  // binned surface area heuristic, slower build but faster traversal
+    LBVH, // morton code sorted linear bvh, fast parallel build
+    SBVH, // sah with spatial splits, primitives may be referenced from several leaves
+};
+
+// optional counters filled in by traverse(), used to compare trees
+struct TraversalStats
+{
+    uint64_t nodeVisits = 0;
+    uint64_t primTests = 0;
+};
+
+// Hands a leaf to the intersect callback of traverse(). Callbacks taking (primIndex, t_max) get one primitive at a
+// time, callbacks taking (const uint32_t *primIndices, count, t_max) get the whole leaf, e.g. to test it with simd,
+// and return true if anything was hit.
+template <bool AnyHit, typename Intersect>
+inline bool intersectLeaf(Intersect &intersect, const uint32_t *prims, uint32_t count, float &t_max)
+{
+    if constexpr (std::is_invocable_v<Intersect&, const uint32_t*, uint32_t, float&>)
+    {
+        return intersect(prims, count, t_max);
+    }
+    else
+    {
+        bool hitAnything = false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (intersect(prims[i], t_max))
+            {
+                if (AnyHit) return true;
+                hitAnything = true;
+            }
+        }
+        return hitAnything;
+    }
+}
+
+struct BVHNode
+{
+    AABB bounds;
+    uint32_t leftFirst; // index of the left child (right child follows it), or the first primitive of a leaf
+    uint32_t count;     // number of primitives, 0 for interior nodes
+
+    inline bool isLeaf() const { return count > 0; }
+};
+
+// Binary bounding volume hierarchy over primitive bounding boxes.
+// The tree only stores indices, intersection with the actual primitives is done by the caller in traverse().
+class BVH
+{
+public:
+    static constexpr int BINS = 16;
+    static constexpr int MAX_DEPTH = 64;
+    static constexpr uint32_t MAX_LEAF_SIZE = 8;
+    static constexpr float TRAVERSAL_COST = 1.0f;
+    static constexpr uint32_t LBVH_LEAF_SIZE = 4;
+    static constexpr size_t LBVH_WIDE_CODE_THRESHOLD = 1 << 18;
+    static constexpr float SBVH_ALPHA = 1e-5f;
+
+    // writes the parts of primitive prim inside box on either side of the plane at pos along axis
+    using SplitFn = std::function<void(uint32_t prim, int axis, float pos, const AABB &box, AABB &left, AABB &right)>;
+
+    // binned surface area heuristic build
+    void build(const std::vector<AABB> &primBounds)
+    {
+        nodes.clear();
+        primIndices.resize(primBounds.size());
+        for (uint32_t i = 0; i < primIndices.size(); i++)
+        {
+            primIndices[i] = i;
+        }
+        if (primBounds.empty())
+        {
+            return;
+        }
+
+        std::vector<point3> centroids(primBounds.size());
+        for (size_t i = 0; i < primBounds.size(); i++)
+        {
+            centroids[i] = primBounds[i].centroid();
+        }
+
+        nodes.reserve(primBounds.size() * 2);
+        nodes.push_back(BVHNode{{}, 0, uint32_t(primBounds.size())});
+        updateBounds(0, primBounds);
+        subdivide(0, 0, primBounds, centroids);
+    }
+
+    // Linear bvh: primitives are sorted along a morton curve and the tree is emitted top down by splitting
+    // every range at the highest differing morton bit. Sorting and emitting both run on numThreads.
+    void buildLBVH(const std::vector<AABB> &primBounds, int numThreads)
+    {
+        nodes.clear();
+        primIndices.clear();
+        size_t primCount = primBounds.size();
+        if (primCount == 0)
+        {
+            return;
+        }
+
+        AABB centroidBounds;
+        for (auto &box : primBounds)
+        {
+            centroidBounds.grow(box.centroid());
+        }
+        vec3 extent = centroidBounds.extent();
+        vec3 invExtent = vec3(extent.x > 0 ? 1 / extent.x : 0, extent.y > 0 ? 1 / extent.y : 0, extent.z > 0 ? 1 / extent.z : 0);
+
+        // 30 bit codes sort in half the passes, 63 bit codes keep large scenes from collapsing into equal codes
+        bool wideCodes = primCount > LBVH_WIDE_CODE_THRESHOLD;
+        std::vector<uint64_t> codes(primCount);
+        std::vector<uint32_t> sortedPrims(primCount);
+        parallelForRange(numThreads, primCount, [&](size_t begin, size_t end, int)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                vec3 p = (primBounds[i].centroid() - centroidBounds.min) * invExtent;
+                codes[i] = wideCodes ? morton63(p) : morton30(p);
+                sortedPrims[i] = uint32_t(i);
+            }
+        });
+        radixSort(codes, sortedPrims, wideCodes ? 63 : 30, numThreads);
+        primIndices = std::move(sortedPrims);
+
+        nodes.resize(primCount * 2);
+        std::atomic<uint32_t> nodeCount{1};
+
+        // split the top of the tree on this thread until there are enough independent subtrees for every thread
+        struct Task { uint32_t node, first, count; int depth; };
+        std::deque<Task> tasks;
+        std::vector<Task> subtrees;
+        std::vector<uint32_t> topNodes;
+        tasks.push_back({0, 0, uint32_t(primCount), 0});
+        while (!tasks.empty() && tasks.size() + subtrees.size() < size_t(numThreads) * 8)
+        {
+            Task task = tasks.front();
+            tasks.pop_front();
+            if (task.count <= LBVH_LEAF_SIZE || task.depth >= MAX_DEPTH - 1)
+            {
+                subtrees.push_back(task);
+                continue;
+            }
+            uint32_t split = findMortonSplit(codes, task.first, task.first + task.count - 1);
+            uint32_t leftChild = nodeCount.fetch_add(2);
+            nodes[task.node].leftFirst = leftChild;
+            nodes[task.node].count = 0;
+            topNodes.push_back(task.node);
+            tasks.push_back({leftChild, task.first, split + 1 - task.first, task.depth + 1});
+            tasks.push_back({leftChild + 1, split + 1, task.first + task.count - split - 1, task.depth + 1});
+        }
+
+        subtrees.insert(subtrees.end(), tasks.begin(), tasks.end());
+        std::atomic<size_t> nextSubtree{0};
+        parallelFor(numThreads, [&](int)
+        {
+            size_t i;
+            while ((i = nextSubtree.fetch_add(1)) < subtrees.size())
+            {
+                Task &task = subtrees[i];
+                emitLBVH(task.node, task.first, task.count, task.depth, codes, primBounds, nodeCount);
+            }
+        });
+
+        // children were appended after their parents, so walking backwards sees them first
+        for (auto it = topNodes.rbegin(); it != topNodes.rend(); it++)
+        {
+            BVHNode &node = nodes[*it];
+            node.bounds = nodes[node.leftFirst].bounds;
+            node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+        }
+        nodes.resize(nodeCount);
+    }
+
+    // Split bvh (Stich et al. 2009): next to the binned object split every node also tries binned spatial splits,
+    // which clip the primitives straddling the plane and reference them from both children. Spatial splits are only
+    // tried where the object split children overlap and while the reference count stays within
+    // (1 + splitBudget) * primitive count.
+    void buildSBVH(const std::vector<AABB> &primBounds, const SplitFn &split, float splitBudget)
+    {
+        nodes.clear();
+        primIndices.clear();
+        if (primBounds.empty())
+        {
+            return;
+        }
+
+        SBVHState state{split};
+        std::vector<Reference> refs(primBounds.size());
+        AABB rootBounds;
+        for (uint32_t i = 0; i < primBounds.size(); i++)
+        {
+            refs[i] = {primBounds[i], i};
+            rootBounds.grow(primBounds[i]);
+        }
+        state.rootArea = rootBounds.area();
+        state.referenceCount = primBounds.size();
+        state.maxReferences = size_t(primBounds.size() * (1.0f + splitBudget));
+
+        nodes.reserve(state.maxReferences * 2);
+        primIndices.reserve(state.maxReferences);
+        nodes.push_back(BVHNode{rootBounds, 0, 0});
+        subdivideSBVH(0, refs, 0, state);
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // Closest hit traversal. intersect(primIndex, t_max) is called for every primitive in a visited leaf (or once per
+    // leaf, see intersectLeaf()), it should return true and shrink t_max when the primitive is hit closer than t_max.
+    // With AnyHit the traversal returns as soon as intersect() returns true once. Any hit doesn't care which blocker it
+    // finds and t_max never shrinks, so when the ray goes through both children it enters the one it spends the longer
+    // stretch inside first, that is where it most likely hits something, and skips the distance test when popping.
+    template <bool AnyHit = false, typename Intersect>
+    bool traverse(const Ray &r, float t_min, float &t_max, Intersect &&intersect, TraversalStats *stats = nullptr) const
+    {
+        if (nodes.empty()) return false;
+
+        vec3 invDir = 1.0f / r.direction;
+        if (nodes[0].bounds.intersect(r, invDir, t_min, t_max) == INFINITY) return false;
+
+        struct StackEntry { uint32_t node; float dist; };
+        StackEntry stack[MAX_DEPTH];
+        int stackPtr = 0;
+        uint32_t nodeIndex = 0;
+        bool hitAnything = false;
+
+        while (true)
+        {
+            const BVHNode &node = nodes[nodeIndex];
+            if (stats) stats->nodeVisits++;
+            if (node.isLeaf())
+            {
+                if (stats) stats->primTests += node.count;
+                if (intersectLeaf<AnyHit>(intersect, &primIndices[node.leftFirst], node.count, t_max))
+                {
+                    if (AnyHit) return true;
+                    hitAnything = true;
+                }
+            }
+            else
+            {
+                uint32_t nearChild = node.leftFirst;
+                uint32_t farChild = node.leftFirst + 1;
+                float nearExit, farExit;
+                float nearDist = nodes[nearChild].bounds.intersect(r, invDir, t_min, t_max, nearExit);
+                float farDist = nodes[farChild].bounds.intersect(r, invDir, t_min, t_max, farExit);
+                bool swapChildren = farDist < nearDist;
+                if (AnyHit && nearDist != INFINITY && farDist != INFINITY)
+                {
+                    swapChildren = farExit - farDist > nearExit - nearDist;
+                }
+                if (swapChildren)
+                {
+                    std::swap(nearChild, farChild);
+                    std::swap(nearDist, farDist);
+                }
+                if (nearDist != INFINITY)
+                {
+                    if (farDist != INFINITY)
+                    {
+                        stack[stackPtr++] = {farChild, farDist};
+                    }
+                    nodeIndex = nearChild;
+                    continue;
+                }
+            }
+
+            // pop the next node that can still hold something closer than the current hit
+            bool found = false;
+            while (stackPtr > 0)
+            {
+                StackEntry &entry = stack[--stackPtr];
+                if (AnyHit || entry.dist <= t_max)
+                {
+                    nodeIndex = entry.node;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) break;
+        }
+
+        return hitAnything;
+    }
+
+    // Packet version of traverse(). Every node is tested against all lanes at once and visited while any lane still hits
+    // it, intersect(primIndex, mask, t_max) gets the lanes that reached the leaf and shrinks their t_max.
+    template <int W, typename Intersect>
+    void traversePacket(const RayPacket<W> &packet, const vmask<W> &active, const vfloat<W> &t_min, vfloat<W> &t_max, Intersect &&intersect,
+                        TraversalStats *stats = nullptr) const
+    {
+        int activeBits = active.bits();
+        if (nodes.empty() || activeBits == 0) return;
+
+        // the children are visited in the order of the first active ray, the others are close to it in coherent packets
+        int lead = 0;
+        while (!((activeBits >> lead) & 1)) lead++;
+        vec3 leadDir = packet.ray(lead).direction;
+
+        uint32_t stack[MAX_DEPTH];
+        int stackPtr = 0;
+        uint32_t nodeIndex = 0;
+        while (true)
+        {
+            const BVHNode &node = nodes[nodeIndex];
+            vmask<W> mask = active & intersectPacket(node.bounds, packet, t_min, t_max);
+            if (mask.bits() != 0)
+            {
+                if (stats) stats->nodeVisits++;
+                if (node.isLeaf())
+                {
+                    if (stats) stats->primTests += node.count;
+                    for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++)
+                    {
+                        intersect(primIndices[i], mask, t_max);
+                    }
+                }
+                else
+                {
+                    // near child along the axis the two children are furthest apart on
+                    vec3 apart = nodes[node.leftFirst + 1].bounds.centroid() - nodes[node.leftFirst].bounds.centroid();
+                    int axis = AABB(vec3(0), glm::abs(apart)).longestAxis();
+                    bool leftNear = apart[axis] * leadDir[axis] >= 0;
+                    stack[stackPtr++] = leftNear ? node.leftFirst + 1 : node.leftFirst;
+                    nodeIndex = leftNear ? node.leftFirst : node.leftFirst + 1;
+                    continue;
+                }
+            }
+            if (stackPtr == 0) break;
+            nodeIndex = stack[--stackPtr];
+        }
+    }
+
+    // Updates the bounds of every node bottom up for primitives that moved, the topology is kept as is.
+    // Subtrees below the top of the tree are refit in parallel, the few nodes above them afterwards.
+    void refit(const std::vector<AABB> &primBounds, int numThreads)
+    {
+        if (nodes.empty()) return;
+
+        std::vector<uint32_t> topNodes;
+        std::vector<uint32_t> subtrees = {0};
+        while (subtrees.size() < size_t(numThreads) * 8)
+        {
+            std::vector<uint32_t> next;
+            for (uint32_t i : subtrees)
+            {
+                if (nodes[i].isLeaf())
+                {
+                    next.push_back(i);
+                    continue;
+                }
+                topNodes.push_back(i);
+                next.push_back(nodes[i].leftFirst);
+                next.push_back(nodes[i].leftFirst + 1);
+            }
+            if (next.size() == subtrees.size()) break;
+            subtrees.swap(next);
+        }
+
+        std::atomic<size_t> nextSubtree{0};
+        parallelFor(numThreads, [&](int)
+        {
+            size_t i;
+            while ((i = nextSubtree.fetch_add(1)) < subtrees.size())
+            {
+                refitNode(subtrees[i], primBounds);
+            }
+        });
+
+        for (auto it = topNodes.rbegin(); it != topNodes.rend(); it++)
+        {
+            BVHNode &node = nodes[*it];
+            node.bounds = nodes[node.leftFirst].bounds;
+            node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+        }
+    }
+
+    // expected cost of a ray traversing the tree, used to compare builds
+    float sahCost() const
+    {
+        if (nodes.empty()) return 0;
+        float cost = 0;
+        for (auto &node : nodes)
+        {
+            cost += node.isLeaf() ? node.bounds.area() * node.count : node.bounds.area() * TRAVERSAL_COST;
+        }
+        return cost / nodes[0].bounds.area();
+    }
+
+    Array<BVHNode> nodes;
+    Array<uint32_t> primIndices;
+
+private:
+    struct Bin
+    {
+        AABB bounds;
+        uint32_t count = 0;
+    };
+
+    struct Reference
+    {
+        AABB bounds;
+        uint32_t prim;
+    };
+
+    struct SBVHState
+    {
+        const SplitFn &split;
+        float rootArea = 0;
+        size_t referenceCount = 0;
+        size_t maxReferences = 0;
+    };
+
+    void makeLeaf(uint32_t nodeIndex, const std::vector<Reference> &refs)
+    {
+        nodes[nodeIndex].leftFirst = uint32_t(primIndices.size());
+        nodes[nodeIndex].count = uint32_t(refs.size());
+        for (auto &ref : refs)
+        {
+            primIndices.push_back(ref.prim);
+        }
+    }
+
+    void subdivideSBVH(uint32_t nodeIndex, std::vector<Reference> &refs, int depth, SBVHState &state)
+    {
+        AABB nodeBounds = nodes[nodeIndex].bounds;
+        uint32_t count = uint32_t(refs.size());
+        if (count <= 1 || depth >= MAX_DEPTH - 1)
+        {
+            makeLeaf(nodeIndex, refs);
+            return;
+        }
+
+        // object split, binned over reference centroids
+        AABB centroidBounds;
+        for (auto &ref : refs)
+        {
+            centroidBounds.grow(ref.bounds.centroid());
+        }
+        float objectCost = INFINITY;
+        int objectAxis = 0;
+        float objectPos = 0;
+        AABB objectLeft, objectRight;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float boundsMin = centroidBounds.min[axis];
+            float boundsMax = centroidBounds.max[axis];
+            if (boundsMin == boundsMax) continue;
+
+            Bin bins[BINS];
+            float scale = BINS / (boundsMax - boundsMin);
+            for (auto &ref : refs)
+            {
+                int binIndex = glm::min(BINS - 1, int((ref.bounds.centroid()[axis] - boundsMin) * scale));
+                bins[binIndex].count++;
+                bins[binIndex].bounds.grow(ref.bounds);
+            }
+            float binWidth = (boundsMax - boundsMin) / BINS;
+            evaluateBins(bins, bins, bins, boundsMin, binWidth, axis, objectCost, objectAxis, objectPos, objectLeft, objectRight);
+        }
+
+        // spatial split, binned over the node bounds with every reference chopped into the bins it spans
+        float spatialCost = INFINITY;
+        int spatialAxis = 0;
+        float spatialPos = 0;
+        AABB overlap = objectLeft.intersection(objectRight);
+        bool trySpatial = state.referenceCount < state.maxReferences && !overlap.empty() && overlap.area() > SBVH_ALPHA * state.rootArea;
+        for (int axis = 0; trySpatial && axis < 3; axis++)
+        {
+            float boundsMin = nodeBounds.min[axis];
+            float boundsMax = nodeBounds.max[axis];
+            if (boundsMin == boundsMax) continue;
+
+            Bin bins[BINS], enters[BINS], exits[BINS];
+            float binWidth = (boundsMax - boundsMin) / BINS;
+            float scale = 1 / binWidth;
+            for (auto &ref : refs)
+            {
+                int first = glm::clamp(int((ref.bounds.min[axis] - boundsMin) * scale), 0, BINS - 1);
+                int last = glm::clamp(int((ref.bounds.max[axis] - boundsMin) * scale), first, BINS - 1);
+                AABB box = ref.bounds;
+                for (int b = first; b < last; b++)
+                {
+                    AABB left, right;
+                    state.split(ref.prim, axis, boundsMin + binWidth * (b + 1), box, left, right);
+                    bins[b].bounds.grow(left);
+                    box = right;
+                }
+                bins[last].bounds.grow(box);
+                enters[first].count++;
+                exits[last].count++;
+            }
+            AABB unusedLeft, unusedRight;
+            evaluateBins(bins, enters, exits, boundsMin, binWidth, axis, spatialCost, spatialAxis, spatialPos, unusedLeft, unusedRight);
+        }
+
+        float area = nodeBounds.area();
+        float leafCost = count * area;
+        float bestCost = TRAVERSAL_COST * area + glm::min(objectCost, spatialCost);
+        if ((bestCost >= leafCost && count <= MAX_LEAF_SIZE) || (objectCost == INFINITY && spatialCost == INFINITY))
+        {
+            makeLeaf(nodeIndex, refs);
+            return;
+        }
+
+        std::vector<Reference> leftRefs, rightRefs;
+        bool spatial = spatialCost < objectCost;
+        if (spatial)
+        {
+            for (auto &ref : refs)
+            {
+                if (ref.bounds.max[spatialAxis] <= spatialPos)
+                {
+                    leftRefs.push_back(ref);
+                }
+                else if (ref.bounds.min[spatialAxis] >= spatialPos)
+                {
+                    rightRefs.push_back(ref);
+                }
+                else
+                {
+                    AABB left, right;
+                    state.split(ref.prim, spatialAxis, spatialPos, ref.bounds, left, right);
+                    if (!left.empty()) leftRefs.push_back({left, ref.prim});
+                    if (!right.empty()) rightRefs.push_back({right, ref.prim});
+                }
+            }
+            // the budget is checked against the references the split really made, one split can straddle many
+            size_t referenceCount = state.referenceCount - count + leftRefs.size() + rightRefs.size();
+            if (referenceCount <= state.maxReferences)
+            {
+                state.referenceCount = referenceCount;
+            }
+            else
+            {
+                spatial = false;
+                leftRefs.clear();
+                rightRefs.clear();
+                if (objectCost == INFINITY)
+                {
+                    makeLeaf(nodeIndex, refs);
+                    return;
+                }
+            }
+        }
+        if (!spatial)
+        {
+            for (auto &ref : refs)
+            {
+                (ref.bounds.centroid()[objectAxis] < objectPos ? leftRefs : rightRefs).push_back(ref);
+            }
+        }
+        if (leftRefs.empty() || rightRefs.empty())
+        {
+            makeLeaf(nodeIndex, refs);
+            return;
+        }
+        refs.clear();
+        refs.shrink_to_fit();
+
+        uint32_t leftChild = uint32_t(nodes.size());
+        nodes.push_back(BVHNode{{}, 0, 0});
+        nodes.push_back(BVHNode{{}, 0, 0});
+        nodes[nodeIndex].leftFirst = leftChild;
+        nodes[nodeIndex].count = 0;
+        for (auto &ref : leftRefs) nodes[leftChild].bounds.grow(ref.bounds);
+        for (auto &ref : rightRefs) nodes[leftChild + 1].bounds.grow(ref.bounds);
+        subdivideSBVH(leftChild, leftRefs, depth + 1, state);
+        subdivideSBVH(leftChild + 1, rightRefs, depth + 1, state);
+    }
+
+    // Sweeps the bins from both sides and keeps the cheapest plane. For object splits enter and exit are the bins
+    // themselves, for spatial splits they count the references starting and ending in every bin.
+    static void evaluateBins(const Bin *bins, const Bin *enter, const Bin *exit, float boundsMin, float binWidth, int axis,
+                             float &bestCost, int &bestAxis, float &bestPos, AABB &bestLeft, AABB &bestRight)
+    {
+        AABB leftBoxes[BINS - 1], rightBoxes[BINS - 1];
+        uint32_t leftCount[BINS - 1], rightCount[BINS - 1];
+        AABB leftBox, rightBox;
+        uint32_t leftSum = 0, rightSum = 0;
+        for (int i = 0; i < BINS - 1; i++)
+        {
+            leftSum += enter[i].count;
+            leftCount[i] = leftSum;
+            leftBox.grow(bins[i].bounds);
+            leftBoxes[i] = leftBox;
+            rightSum += exit[BINS - 1 - i].count;
+            rightCount[BINS - 2 - i] = rightSum;
+            rightBox.grow(bins[BINS - 1 - i].bounds);
+            rightBoxes[BINS - 2 - i] = rightBox;
+        }
+        for (int i = 0; i < BINS - 1; i++)
+        {
+            if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+            float cost = leftCount[i] * leftBoxes[i].area() + rightCount[i] * rightBoxes[i].area();
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestAxis = axis;
+                bestPos = boundsMin + binWidth * (i + 1);
+                bestLeft = leftBoxes[i];
+                bestRight = rightBoxes[i];
+            }
+        }
+    }
+
+    void refitNode(uint32_t nodeIndex, const std::vector<AABB> &primBounds)
+    {
+        BVHNode &node = nodes[nodeIndex];
+        if (node.isLeaf())
+        {
+            updateBounds(nodeIndex, primBounds);
+            return;
+        }
+        refitNode(node.leftFirst, primBounds);
+        refitNode(node.leftFirst + 1, primBounds);
+        node.bounds = nodes[node.leftFirst].bounds;
+        node.bounds.grow(nodes[node.leftFirst + 1].bounds);
+    }
+
+    void updateBounds(uint32_t nodeIndex, const std::vector<AABB> &primBounds)
+    {
+        BVHNode &node = nodes[nodeIndex];
+        node.bounds = AABB();
+        for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        {
+            node.bounds.grow(primBounds[primIndices[i]]);
+        }
+    }
+
+    // returns the cost of the best split, axis and position are written out
+    float findBestSplit(const BVHNode &node, const std::vector<AABB> &primBounds, const std::vector<point3> &centroids, int &bestAxis, float &bestPos) const
+    {
+        AABB centroidBounds;
+        for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++)
+        {
+            centroidBounds.grow(centroids[primIndices[i]]);
+        }
+
+        float bestCost = INFINITY;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float boundsMin = centroidBounds.min[axis];
+            float boundsMax = centroidBounds.max[axis];
+            if (boundsMin == boundsMax) continue;
+
+            Bin bins[BINS];
+            float scale = BINS / (boundsMax - boundsMin);
+            for (uint32_t i = node.leftFirst; i < node.leftFirst + node.count; i++)
+            {
+                uint32_t prim = primIndices[i];
+                int binIndex = glm::min(BINS - 1, int((centroids[prim][axis] - boundsMin) * scale));
+                bins[binIndex].count++;
+                bins[binIndex].bounds.grow(primBounds[prim]);
+            }
+
+            // sweep from both sides to get the area and count of every split plane
+            float leftArea[BINS - 1], rightArea[BINS - 1];
+            uint32_t leftCount[BINS - 1], rightCount[BINS - 1];
+            AABB leftBox, rightBox;
+            uint32_t leftSum = 0, rightSum = 0;
+            for (int i = 0; i < BINS - 1; i++)
+            {
+                leftSum += bins[i].count;
+                leftCount[i] = leftSum;
+                leftBox.grow(bins[i].bounds);
+                leftArea[i] = leftBox.area();
+                rightSum += bins[BINS - 1 - i].count;
+                rightCount[BINS - 2 - i] = rightSum;
+                rightBox.grow(bins[BINS - 1 - i].bounds);
+                rightArea[BINS - 2 - i] = rightBox.area();
+            }
+
+            float binWidth = (boundsMax - boundsMin) / BINS;
+            for (int i = 0; i < BINS - 1; i++)
+            {
+                if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+                float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestPos = boundsMin + binWidth * (i + 1);
+                }
+            }
+        }
+        return bestCost;
+    }
+
+    // last index of the left half of [first, last], the range is split where the highest differing bit flips
+    static uint32_t findMortonSplit(const std::vector<uint64_t> &codes, uint32_t first, uint32_t last)
+    {
+        uint64_t firstCode = codes[first];
+        uint64_t lastCode = codes[last];
+        if (firstCode == lastCode)
+        {
+            return (first + last) / 2;
+        }
+        int commonPrefix = countLeadingZeros(firstCode ^ lastCode);
+
+        // binary search for the last code that still shares more than commonPrefix bits with the first one
+        uint32_t split = first;
+        uint32_t step = last - first;
+        do
+        {
+            step = (step + 1) / 2;
+            uint32_t newSplit = split + step;
+            if (newSplit < last && countLeadingZeros(firstCode ^ codes[newSplit]) > commonPrefix)
+            {
+                split = newSplit;
+            }
+        } while (step > 1);
+        return split;
+    }
+
+    void emitLBVH(uint32_t nodeIndex, uint32_t first, uint32_t count, int depth, const std::vector<uint64_t> &codes, const std::vector<AABB> &primBounds, std::atomic<uint32_t> &nodeCount)
+    {
+        BVHNode &node = nodes[nodeIndex];
+        if (count <= LBVH_LEAF_SIZE || depth >= MAX_DEPTH - 1)
+        {
+            node.leftFirst = first;
+            node.count = count;
+            updateBounds(nodeIndex, primBounds);
+            return;
+        }
+
+        uint32_t split = findMortonSplit(codes, first, first + count - 1);
+        uint32_t leftChild = nodeCount.fetch_add(2);
+        node.leftFirst = leftChild;
+        node.count = 0;
+        emitLBVH(leftChild, first, split + 1 - first, depth + 1, codes, primBounds, nodeCount);
+        emitLBVH(leftChild + 1, split + 1, first + count - split - 1, depth + 1, codes, primBounds, nodeCount);
+        node.bounds = nodes[leftChild].bounds;
+        node.bounds.grow(nodes[leftChild + 1].bounds);
+    }
+
+    void subdivide(uint32_t nodeIndex, int depth, const std::vector<AABB> &primBounds, const std::vector<point3> &centroids)
+    {
+        BVHNode &node = nodes[nodeIndex];
+        if (node.count <= 1 || depth >= MAX_DEPTH - 1) return;
+
+        int axis = 0;
+        float splitPos = 0;
+        float splitCost = findBestSplit(node, primBounds, centroids, axis, splitPos);
+        if (splitCost == INFINITY) return;
+
+        float leafCost = node.count * node.bounds.area();
+        splitCost += TRAVERSAL_COST * node.bounds.area();
+        if (splitCost >= leafCost && node.count <= MAX_LEAF_SIZE) return;
+
+        // partition the primitives around the split plane
+        int64_t i = node.leftFirst;
+        int64_t j = i + node.count - 1;
+        while (i <= j)
+        {
+            if (centroids[primIndices[i]][axis] < splitPos)
+            {
+                i++;
+            }
+            else
+            {
+                std::swap(primIndices[i], primIndices[j--]);
+            }
+        }
+
+        uint32_t leftCount = uint32_t(i) - node.leftFirst;
+        if (leftCount == 0 || leftCount == node.count) return;
+
+        uint32_t leftChild = uint32_t(nodes.size());
+        uint32_t first = node.leftFirst;
+        uint32_t count = node.count;
+        nodes.push_back(BVHNode{{}, first, leftCount});
+        nodes.push_back(BVHNode{{}, uint32_t(i), count - leftCount});
+        // push_back may have reallocated, don't use node from here on
+        nodes[nodeIndex].leftFirst = leftChild;
+        nodes[nodeIndex].count = 0;
+
+        updateBounds(leftChild, primBounds);
+        updateBounds(leftChild + 1, primBounds);
+        subdivide(leftChild, depth + 1, primBounds, centroids);
+        subdivide(leftChild + 1, depth + 1, primBounds, centroids);
+    }
+};
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "bvh.h"
+#include "wide_bvh.h"
+
+#include <string>
+#include <fstream>
+#include <filesystem>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <utility>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Private copy on write mapping of a whole file, writes (e.g. a bvh refit) never reach the file
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile()
+    {
+        close();
+    }
+    bool open(const std::string &path)
+    {
+        close();
+#ifdef _WIN32
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        HANDLE mapping = fileSize.QuadPart > 0 ? CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL) : NULL;
+        CloseHandle(file);
+        if (mapping == NULL) return false;
+        void *view = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+        CloseHandle(mapping);
+        if (view == NULL) return false;
+        bytes = static_cast<uint8_t*>(view);
+        length = size_t(fileSize.QuadPart);
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0)
+        {
+            ::close(fd);
+            return false;
+        }
+        void *view = mmap(nullptr, size_t(info.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (view == MAP_FAILED) return false;
+        bytes = static_cast<uint8_t*>(view);
+        length = size_t(info.st_size);
+#endif
+        return true;
+    }
+    void close()
+    {
+        if (!bytes) return;
+#ifdef _WIN32
+        UnmapViewOfFile(bytes);
+#else
+        munmap(bytes, length);
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+    void swap(MappedFile &other)
+    {
+        std::swap(bytes, other.bytes);
+        std::swap(length, other.length);
+    }
+    uint8_t *data() { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    uint8_t *bytes = nullptr;
+    size_t length = 0;
+};
+
+// The file is the header followed by the node and index arrays exactly as they are laid out in memory, each one
+// starting at a 64 byte aligned offset. Loading maps the file and points the trees at it, there is nothing to parse
+// and since nodes only store indices nothing to fix up either.
+struct BVHCacheHeader
+{
+    static constexpr char MAGIC[8] = {'R', 'T', 'B', 'V', 'H', 'C', 'A', 'C'};
+    static constexpr uint32_t VERSION = 2;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;
+    uint64_t key;
+    uint32_t nodeSize;
+    uint32_t wideNodeSize;
+    uint64_t nodeCount;
+    uint64_t primCount;
+    uint64_t wideNodeCount;
+    uint64_t nodeOffset;
+    uint64_t primOffset;
+    uint64_t wideNodeOffset;
+    uint64_t fileSize;
+    float buildCost;
+    uint32_t padding;
+};
+
+inline uint64_t alignCacheOffset(uint64_t offset)
+{
+    return (offset + 63) & ~uint64_t(63);
+}
+
+// whether count elements of elemSize bytes at offset lie inside a file of fileSize bytes, after the header and aligned
+inline bool cacheRangeFits(uint64_t offset, uint64_t count, uint64_t elemSize, uint64_t fileSize)
+{
+    if (offset % 64 != 0 || offset < sizeof(BVHCacheHeader) || offset > fileSize) return false;
+    return elemSize == 0 ? count == 0 : count <= (fileSize - offset) / elemSize;
+}
+
+inline std::string bvhCachePath(const std::string &dir, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+    return (std::filesystem::path(dir) / name).string();
+}
+
+inline uint32_t wideNodeSize(BVHLayout layout)
+{
+    switch (layout)
+    {
+        case BVHLayout::Wide4:          return sizeof(WideBVHNode<4>);
+        case BVHLayout::Wide8:          return sizeof(WideBVHNode<8>);
+        case BVHLayout::Wide4Quantized: return sizeof(QuantizedWideBVHNode<4>);
+        case BVHLayout::Wide8Quantized: return sizeof(QuantizedWideBVHNode<8>);
+        default:                        return 0;
+    }
+}
+
+template <int N, typename Node>
+inline void borrowWideBVH(WideBVH<N, Node> &tree, uint8_t *base, const BVHCacheHeader &header)
+{
+    tree.nodes.borrow(reinterpret_cast<Node*>(base + header.wideNodeOffset), header.wideNodeCount);
+    tree.primIndices.borrow(reinterpret_cast<uint32_t*>(base + header.primOffset), header.primCount);
+}
+
+template <int N, typename Node>
+inline void clearWideBVH(WideBVH<N, Node> &tree)
+{
+    tree.nodes.clear();
+    tree.primIndices.clear();
+}
+
+// Maps the cache file and points the trees at it, returns false if it is missing, damaged or was written for something
+// else. file only takes the new mapping once it checked out, until then the trees may still point into the old one.
+inline bool loadBVHCache(const std::string &path, uint64_t key, BVHLayout layout, MappedFile &file, BVH &bvh, WideBVH<4> &bvh4, WideBVH<8> &bvh8,
+                         QuantizedWideBVH<4> &qbvh4, QuantizedWideBVH<8> &qbvh8, float &buildCost)
+{
+    MappedFile loaded;
+    if (!loaded.open(path)) return false;
+
+    BVHCacheHeader header;
+    if (loaded.size() < sizeof(header)) return false;
+    memcpy(&header, loaded.data(), sizeof(header));
+    if (memcmp(header.magic, BVHCacheHeader::MAGIC, sizeof(header.magic)) != 0 || header.version != BVHCacheHeader::VERSION || header.key != key ||
+        header.layout != uint32_t(layout) || header.nodeSize != sizeof(BVHNode) || header.wideNodeSize != wideNodeSize(layout) ||
+        header.fileSize != loaded.size())
+    {
+        return false;
+    }
+    if (!cacheRangeFits(header.nodeOffset, header.nodeCount, header.nodeSize, loaded.size()) ||
+        !cacheRangeFits(header.primOffset, header.primCount, sizeof(uint32_t), loaded.size()) ||
+        !cacheRangeFits(header.wideNodeOffset, header.wideNodeCount, header.wideNodeSize, loaded.size()))
+    {
+        return false;
+    }
+
+    uint8_t *base = loaded.data();
+    bvh.nodes.borrow(reinterpret_cast<BVHNode*>(base + header.nodeOffset), header.nodeCount);
+    bvh.primIndices.borrow(reinterpret_cast<uint32_t*>(base + header.primOffset), header.primCount);
+    clearWideBVH(bvh4);
+    clearWideBVH(bvh8);
+    clearWideBVH(qbvh4);
+    clearWideBVH(qbvh8);
+    // wide trees index the same primitive list as the binary one
+    switch (layout)
+    {
+        case BVHLayout::Binary:         break;
+        case BVHLayout::Wide4:          borrowWideBVH(bvh4, base, header); break;
+        case BVHLayout::Wide8:          borrowWideBVH(bvh8, base, header); break;
+        case BVHLayout::Wide4Quantized: borrowWideBVH(qbvh4, base, header); break;
+        case BVHLayout::Wide8Quantized: borrowWideBVH(qbvh8, base, header); break;
+    }
+    buildCost = header.buildCost;
+    // the old mapping goes away with loaded, nothing points into it anymore
+    file.swap(loaded);
+    return true;
+}
+
+// Writes to a temporary file of its own first so a crash or a second instance writing the same cache never leaves a
+// half written file behind, the rename is atomic and the last writer wins.
+inline bool saveBVHCache(const std::string &path, uint64_t key, BVHLayout layout, const BVH &bvh, const WideBVH<4> &bvh4, const WideBVH<8> &bvh8,
+                         const QuantizedWideBVH<4> &qbvh4, const QuantizedWideBVH<8> &qbvh8, float buildCost)
+{
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+    const void *wideNodes = nullptr;
+    uint64_t wideNodeCount = 0;
+    switch (layout)
+    {
+        case BVHLayout::Binary:         break;
+        case BVHLayout::Wide4:          wideNodes = bvh4.nodes.data(); wideNodeCount = bvh4.nodes.size(); break;
+        case BVHLayout::Wide8:          wideNodes = bvh8.nodes.data(); wideNodeCount = bvh8.nodes.size(); break;
+        case BVHLayout::Wide4Quantized: wideNodes = qbvh4.nodes.data(); wideNodeCount = qbvh4.nodes.size(); break;
+        case BVHLayout::Wide8Quantized: wideNodes = qbvh8.nodes.data(); wideNodeCount = qbvh8.nodes.size(); break;
+    }
+
+    BVHCacheHeader header{};
+    memcpy(header.magic, BVHCacheHeader::MAGIC, sizeof(header.magic));
+    header.version = BVHCacheHeader::VERSION;
+    header.layout = uint32_t(layout);
+    header.key = key;
+    header.nodeSize = sizeof(BVHNode);
+    header.wideNodeSize = wideNodeSize(layout);
+    header.nodeCount = bvh.nodes.size();
+    header.primCount = bvh.primIndices.size();
+    header.wideNodeCount = wideNodeCount;
+    header.nodeOffset = alignCacheOffset(sizeof(header));
+    header.primOffset = alignCacheOffset(header.nodeOffset + header.nodeCount * sizeof(BVHNode));
+    header.wideNodeOffset = alignCacheOffset(header.primOffset + header.primCount * sizeof(uint32_t));
+    header.fileSize = header.wideNodeOffset + wideNodeCount * header.wideNodeSize;
+    header.buildCost = buildCost;
+
+#ifdef _WIN32
+    unsigned long pid = GetCurrentProcessId();
+#else
+    unsigned long pid = (unsigned long)getpid();
+#endif
+    static std::atomic<unsigned> saves{0};
+    std::string tmpPath = path + "." + std::to_string(pid) + "." + std::to_string(saves++) + ".tmp";
+    bool written;
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        auto writeAt = [&](uint64_t offset, const void *data, uint64_t size)
+        {
+            static const char zeros[64] = {};
+            uint64_t pos = uint64_t(out.tellp());
+            out.write(zeros, std::streamsize(offset - pos));
+            out.write(static_cast<const char*>(data), std::streamsize(size));
+        };
+        writeAt(0, &header, sizeof(header));
+        writeAt(header.nodeOffset, bvh.nodes.data(), header.nodeCount * sizeof(BVHNode));
+        writeAt(header.primOffset, bvh.primIndices.data(), header.primCount * sizeof(uint32_t));
+        writeAt(header.wideNodeOffset, wideNodes, wideNodeCount * header.wideNodeSize);
+        out.flush();
+        written = bool(out);
+    }
+    if (!written || std::filesystem::file_size(tmpPath, error) != header.fileSize || error)
+    {
+        std::filesystem::remove(tmpPath, error);
+        return false;
+    }
+    std::filesystem::rename(tmpPath, path, error);
+    if (error) std::filesystem::remove(tmpPath, error);
+    return !error;
+}
+
+#endif
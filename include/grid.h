@@ -0,0 +1,329 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "aabb.h"
+#include "bvh.h"
+#include "morton.h"
+#include "parallel.h"
+
+#include <vector>
+#include <cstdint>
+#include <atomic>
+#include <algorithm>
+
+// Which structure a ShapeList uses to find the shapes a ray hits
+enum class Accelerator
+{
+    BVH,
+    Grid,
+    TwoLevelGrid,
+};
+
+// one regular grid, cells are stored x fastest
+struct GridLevel
+{
+    AABB bounds;
+    glm::ivec3 res;
+    vec3 cellSize;
+    vec3 invCellSize;
+    uint32_t firstCell; // into Grid::cellStart
+};
+
+// Uniform grid walked with a 3D-DDA, builds in linear time and beats a tree when the shapes are about the same size
+// and spread evenly (e.g. particles). Every shape is referenced from every cell its bounds overlap. The two level
+// version only builds a coarse grid and gives every crowded cell its own small grid, which adapts to uneven scenes.
+class Grid
+{
+public:
+    // cells per primitive, the resolution follows from this and the volume of the bounds
+    static constexpr float DENSITY = 2.0f;
+    static constexpr float TOP_DENSITY = 1.0f / 8.0f;
+    static constexpr uint32_t SUBGRID_MIN_PRIMS = 16;
+    static constexpr int MAX_RESOLUTION = 1024;
+    static constexpr uint32_t MAILBOX_SIZE = 8;
+    static constexpr uint32_t CELL_BATCH = 16;
+
+    void build(const std::vector<AABB> &primBounds, int numThreads, bool twoLevel)
+    {
+        levels.clear();
+        subGrids.clear();
+        cellStart.clear();
+        primIndices.clear();
+        if (primBounds.empty()) return;
+
+        std::vector<uint32_t> prims(primBounds.size());
+        for (uint32_t i = 0; i < prims.size(); i++)
+        {
+            prims[i] = i;
+        }
+        AABB bounds;
+        for (const AABB &box : primBounds)
+        {
+            bounds.grow(box);
+        }
+        levels.push_back(makeLevel(bounds, prims.size(), twoLevel ? TOP_DENSITY : DENSITY));
+        fillLevel(levels[0], primBounds, prims, numThreads, cellStart, primIndices);
+        if (!twoLevel) return;
+
+        // every crowded top cell gets its own grid over the part of its shapes inside the cell
+        const GridLevel &top = levels[0];
+        uint32_t topCells = uint32_t(top.res.x * top.res.y * top.res.z);
+        std::vector<uint32_t> crowded;
+        for (uint32_t c = 0; c < topCells; c++)
+        {
+            if (cellStart[c + 1] - cellStart[c] >= SUBGRID_MIN_PRIMS) crowded.push_back(c);
+        }
+
+        struct SubGrid
+        {
+            GridLevel level;
+            std::vector<uint32_t> cellStart;
+            std::vector<uint32_t> primIndices;
+        };
+        std::vector<SubGrid> built(crowded.size());
+        std::atomic<size_t> next{0};
+        parallelFor(numThreads, [&](int)
+        {
+            size_t i;
+            while ((i = next.fetch_add(1)) < crowded.size())
+            {
+                uint32_t c = crowded[i];
+                std::vector<uint32_t> cellPrims(primIndices.begin() + cellStart[c], primIndices.begin() + cellStart[c + 1]);
+                AABB bounds;
+                for (uint32_t prim : cellPrims)
+                {
+                    bounds.grow(primBounds[prim]);
+                }
+                built[i].level = makeLevel(bounds.intersection(cellBounds(top, c)), cellPrims.size(), DENSITY);
+                fillLevel(built[i].level, primBounds, cellPrims, 1, built[i].cellStart, built[i].primIndices);
+            }
+        });
+
+        subGrids.assign(topCells, -1);
+        for (size_t i = 0; i < crowded.size(); i++)
+        {
+            SubGrid &sub = built[i];
+            sub.level.firstCell = uint32_t(cellStart.size());
+            uint32_t primOffset = uint32_t(primIndices.size());
+            for (uint32_t start : sub.cellStart)
+            {
+                cellStart.push_back(start + primOffset);
+            }
+            primIndices.insert(primIndices.end(), sub.primIndices.begin(), sub.primIndices.end());
+            subGrids[crowded[i]] = int32_t(levels.size());
+            levels.push_back(sub.level);
+        }
+    }
+
+    bool empty() const { return levels.empty(); }
+    AABB bounds() const { return levels.empty() ? AABB() : levels[0].bounds; }
+
+    // same contract as BVH::traverse, nodeVisits counts the visited cells
+    template <bool AnyHit = false, typename Intersect>
+    bool traverse(const Ray &r, float t_min, float &t_max, Intersect &&intersect, TraversalStats *stats = nullptr) const
+    {
+        if (levels.empty()) return false;
+
+        vec3 invDir = 1.0f / r.direction;
+        bool hitAnything = false;
+        // shapes overlapping several cells would be tested again in every one of them, the last few tested ones are
+        // remembered and skipped
+        uint32_t mailbox[MAILBOX_SIZE];
+        std::fill(mailbox, mailbox + MAILBOX_SIZE, UINT32_MAX);
+        uint32_t mailboxNext = 0;
+        // the shapes of a cell that weren't tested yet are handed over in batches like a bvh leaf
+        uint32_t batch[CELL_BATCH];
+        uint32_t batchCount = 0;
+        auto flush = [&]()
+        {
+            if (stats) stats->primTests += batchCount;
+            bool hit = intersectLeaf<AnyHit>(intersect, batch, batchCount, t_max);
+            batchCount = 0;
+            if (!hit) return false;
+            hitAnything = true;
+            // any hit is done with the first one, t_max stays as the caller gave it
+            return AnyHit;
+        };
+        auto testCell = [&](const GridLevel &level, uint32_t cell)
+        {
+            uint32_t begin = cellStart[level.firstCell + cell], end = cellStart[level.firstCell + cell + 1];
+            if (stats) stats->nodeVisits++;
+            for (uint32_t i = begin; i < end; i++)
+            {
+                uint32_t prim = primIndices[i];
+                if (std::find(mailbox, mailbox + MAILBOX_SIZE, prim) != mailbox + MAILBOX_SIZE) continue;
+                mailbox[mailboxNext++ % MAILBOX_SIZE] = prim;
+                batch[batchCount++] = prim;
+                if (batchCount == CELL_BATCH && flush()) return true;
+            }
+            return batchCount > 0 && flush();
+        };
+
+        walk(levels[0], r, invDir, t_min, t_max, t_max, [&](uint32_t cell, float tEnter, float tExit)
+        {
+            if (subGrids.empty() || subGrids[cell] < 0) return testCell(levels[0], cell);
+            const GridLevel &sub = levels[subGrids[cell]];
+            return walk(sub, r, invDir, tEnter, tExit, t_max, [&](uint32_t subCell, float, float)
+            {
+                return testCell(sub, subCell);
+            });
+        });
+        return hitAnything;
+    }
+
+    std::vector<GridLevel> levels;
+    std::vector<int32_t> subGrids; // level of every top cell's own grid, -1 if it has none, empty for a flat grid
+    std::vector<uint32_t> cellStart; // numCells + 1 entries per level, indexes primIndices
+    std::vector<uint32_t> primIndices;
+
+private:
+    static GridLevel makeLevel(AABB bounds, size_t primCount, float density)
+    {
+        // padded so shapes on the border and flat scenes still get proper cells
+        vec3 extent = bounds.extent();
+        float pad = glm::max(glm::max(extent.x, glm::max(extent.y, extent.z)), 1e-3f) * 1e-4f;
+        bounds.min -= pad;
+        bounds.max += pad;
+        extent = bounds.extent();
+
+        float cellsPerUnit = std::cbrt(density * float(primCount) / (extent.x * extent.y * extent.z));
+        GridLevel level;
+        level.bounds = bounds;
+        level.res = glm::clamp(glm::ivec3(extent * cellsPerUnit), glm::ivec3(1), glm::ivec3(MAX_RESOLUTION));
+        level.cellSize = extent / vec3(level.res);
+        level.invCellSize = 1.0f / level.cellSize;
+        level.firstCell = 0;
+        return level;
+    }
+
+    static glm::ivec3 cellCoord(const GridLevel &level, const point3 &p)
+    {
+        return glm::clamp(glm::ivec3(glm::floor((p - level.bounds.min) * level.invCellSize)), glm::ivec3(0), level.res - 1);
+    }
+
+    static AABB cellBounds(const GridLevel &level, uint32_t cell)
+    {
+        glm::ivec3 c(cell % level.res.x, (cell / level.res.x) % level.res.y, cell / (level.res.x * level.res.y));
+        point3 min = level.bounds.min + vec3(c) * level.cellSize;
+        return AABB(min, min + level.cellSize);
+    }
+
+    // Cell references are written as (cell, prim) pairs and sorted by cell, cellStart then falls out of the
+    // boundaries between runs of equal cells. Every step is parallel and the result doesn't depend on the thread count.
+    static void fillLevel(const GridLevel &level, const std::vector<AABB> &primBounds, const std::vector<uint32_t> &prims, int numThreads,
+                          std::vector<uint32_t> &cellStart, std::vector<uint32_t> &primIndices)
+    {
+        size_t count = prims.size();
+        if (count < 4096) numThreads = 1;
+
+        std::vector<uint32_t> refOffset(count + 1);
+        parallelForRange(numThreads, count, [&](size_t begin, size_t end, int)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                glm::ivec3 lo = cellCoord(level, primBounds[prims[i]].min), hi = cellCoord(level, primBounds[prims[i]].max);
+                glm::ivec3 span = hi - lo + 1;
+                refOffset[i + 1] = uint32_t(span.x * span.y * span.z);
+            }
+        });
+        for (size_t i = 0; i < count; i++)
+        {
+            refOffset[i + 1] += refOffset[i];
+        }
+
+        size_t refCount = refOffset[count];
+        std::vector<uint64_t> keys(refCount);
+        std::vector<uint32_t> values(refCount);
+        parallelForRange(numThreads, count, [&](size_t begin, size_t end, int)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                glm::ivec3 lo = cellCoord(level, primBounds[prims[i]].min), hi = cellCoord(level, primBounds[prims[i]].max);
+                uint32_t ref = refOffset[i];
+                for (int z = lo.z; z <= hi.z; z++)
+                {
+                    for (int y = lo.y; y <= hi.y; y++)
+                    {
+                        for (int x = lo.x; x <= hi.x; x++)
+                        {
+                            keys[ref] = uint64_t(x + level.res.x * (y + level.res.y * z));
+                            values[ref] = prims[i];
+                            ref++;
+                        }
+                    }
+                }
+            }
+        });
+
+        uint32_t numCells = uint32_t(level.res.x * level.res.y * level.res.z);
+        radixSort(keys, values, 64 - countLeadingZeros(numCells), numThreads);
+
+        // the first reference of every cell sets the start of all empty cells before it
+        cellStart.assign(size_t(numCells) + 1, uint32_t(refCount));
+        parallelForRange(numThreads, refCount, [&](size_t begin, size_t end, int)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                uint64_t first = i == 0 ? 0 : keys[i - 1] + 1;
+                for (uint64_t c = first; c <= keys[i]; c++)
+                {
+                    cellStart[c] = uint32_t(i);
+                }
+            }
+        });
+        primIndices = std::move(values);
+    }
+
+    // 3D-DDA through the cells of one level overlapping [tStart, tEnd], calls visit(cell, tEnter, tExit) front to back
+    // and stops once the next cell starts past the closest hit. visit() returns true to end the walk early, walk()
+    // then returns true too.
+    template <typename Visit>
+    static bool walk(const GridLevel &level, const Ray &r, const vec3 &invDir, float tStart, float tEnd, float &t_max, Visit &&visit)
+    {
+        float tEnter = level.bounds.intersect(r, invDir, tStart, glm::min(tEnd, t_max));
+        if (tEnter == INFINITY) return false;
+
+        glm::ivec3 cell = cellCoord(level, r.origin + r.direction * tEnter);
+        glm::ivec3 step, stop;
+        vec3 tNext, tDelta;
+        for (int a = 0; a < 3; a++)
+        {
+            if (r.direction[a] > 0)
+            {
+                step[a] = 1;
+                stop[a] = level.res[a];
+                tNext[a] = (level.bounds.min[a] + (cell[a] + 1) * level.cellSize[a] - r.origin[a]) * invDir[a];
+                tDelta[a] = level.cellSize[a] * invDir[a];
+            }
+            else if (r.direction[a] < 0)
+            {
+                step[a] = -1;
+                stop[a] = -1;
+                tNext[a] = (level.bounds.min[a] + cell[a] * level.cellSize[a] - r.origin[a]) * invDir[a];
+                tDelta[a] = -level.cellSize[a] * invDir[a];
+            }
+            else
+            {
+                step[a] = 0;
+                stop[a] = -1;
+                tNext[a] = INFINITY;
+                tDelta[a] = INFINITY;
+            }
+        }
+
+        while (true)
+        {
+            int axis = tNext.x < tNext.y ? (tNext.x < tNext.z ? 0 : 2) : (tNext.y < tNext.z ? 1 : 2);
+            float tExit = tNext[axis];
+            if (visit(uint32_t(cell.x + level.res.x * (cell.y + level.res.y * cell.z)), tEnter, tExit)) return true;
+            if (tExit > glm::min(tEnd, t_max)) return false;
+
+            cell[axis] += step[axis];
+            if (cell[axis] == stop[axis]) return false;
+            tEnter = tExit;
+            tNext[axis] += tDelta[axis];
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef LIGHT_H
+#define LIGHT_H
+
+#include "utils.h"
+#include "aabb.h"
+#include "shape.h"
+#include "material.h"
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include <glm/gtc/constants.hpp>
+
+// What a light or a group of lights can send anywhere: the box it sits in, its power phi, the cone around w holding
+// the normals of its surface (half angle acos(cosThetaO)) and how far from its normals it emits (acos(cosThetaE)).
+// Two sided lights emit on both sides of their normals. Conty Estevez and Kulla, "Importance Sampling of Many Lights
+// with Adaptive Tree Splitting" (2018), with the importance bound of pbrt-v4.
+struct LightBounds
+{
+    AABB bounds;
+    vec3 w = vec3(0, 0, 1);
+    float phi = 0;
+    float cosThetaO = 1;
+    float cosThetaE = 1;
+    bool twoSided = false;
+
+    // upper bound on what the lights send to p, relative to other bounds
+    float importance(const point3 &p) const
+    {
+        if (phi <= 0) return 0;
+        point3 center = bounds.centroid();
+        float d2 = glm::max(glm::dot(p - center, p - center), glm::length(bounds.extent()) / 2);
+
+        // cos of the smallest angle between a normal in the cone and the direction to p, the box's own extent seen
+        // from p taken off it as well
+        float cosThetaP = 1;
+        if (glm::any(glm::lessThan(p, bounds.min)) || glm::any(glm::greaterThan(p, bounds.max)))
+        {
+            vec3 wi = glm::normalize(p - center);
+            float cosThetaW = glm::dot(w, wi);
+            if (twoSided) cosThetaW = glm::abs(cosThetaW);
+            float sinThetaW = safeSqrt(1 - cosThetaW * cosThetaW);
+
+            float radius2 = glm::dot(bounds.max - center, bounds.max - center);
+            float sin2ThetaB = radius2 / glm::dot(p - center, p - center);
+            float cosThetaB = sin2ThetaB >= 1 ? -1 : safeSqrt(1 - sin2ThetaB);
+            float sinThetaB = safeSqrt(1 - cosThetaB * cosThetaB);
+
+            float sinThetaO = safeSqrt(1 - cosThetaO * cosThetaO);
+            float cosThetaX = cosSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+            float sinThetaX = sinSubClamped(sinThetaW, cosThetaW, sinThetaO, cosThetaO);
+            cosThetaP = cosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+        }
+        if (cosThetaP <= cosThetaE) return 0;
+        return phi * cosThetaP / d2;
+    }
+
+    static LightBounds merge(const LightBounds &a, const LightBounds &b)
+    {
+        if (a.phi <= 0) return b;
+        if (b.phi <= 0) return a;
+        LightBounds merged = a;
+        merged.bounds.grow(b.bounds);
+        merged.phi = a.phi + b.phi;
+        mergeCones(merged.w, merged.cosThetaO, b.w, b.cosThetaO);
+        merged.cosThetaE = glm::min(a.cosThetaE, b.cosThetaE);
+        merged.twoSided = a.twoSided || b.twoSided;
+        return merged;
+    }
+
+    // solid angle measure of the directions the lights emit into, for the surface area orientation heuristic
+    float orientationMeasure() const
+    {
+        float thetaO = glm::acos(glm::clamp(cosThetaO, -1.0f, 1.0f));
+        float thetaE = glm::acos(glm::clamp(cosThetaE, -1.0f, 1.0f));
+        float thetaW = glm::min(thetaO + thetaE, glm::pi<float>());
+        float sinThetaO = safeSqrt(1 - cosThetaO * cosThetaO);
+        return 2 * glm::pi<float>() * (1 - cosThetaO) +
+               glm::pi<float>() / 2 * (2 * thetaW * sinThetaO - glm::cos(thetaO - 2 * thetaW) - 2 * thetaO * sinThetaO + cosThetaO);
+    }
+
+private:
+    static float safeSqrt(float x)
+    {
+        return glm::sqrt(glm::max(x, 0.0f));
+    }
+    // cos and sin of max(0, a - b) given those of a and b
+    static float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 1 : cosA * cosB + sinA * sinB;
+    }
+    static float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        return cosA > cosB ? 0 : sinA * cosB - cosA * sinB;
+    }
+    // grows the cone around w to hold the one around wb as well
+    static void mergeCones(vec3 &w, float &cosTheta, const vec3 &wb, float cosThetaB)
+    {
+        float pi = glm::pi<float>();
+        float thetaA = glm::acos(glm::clamp(cosTheta, -1.0f, 1.0f));
+        float thetaB = glm::acos(glm::clamp(cosThetaB, -1.0f, 1.0f));
+        float thetaD = glm::acos(glm::clamp(glm::dot(w, wb), -1.0f, 1.0f));
+        if (glm::min(thetaD + thetaB, pi) <= thetaA) return;
+        if (glm::min(thetaD + thetaA, pi) <= thetaB)
+        {
+            w = wb;
+            cosTheta = cosThetaB;
+            return;
+        }
+        float thetaO = (thetaA + thetaD + thetaB) / 2;
+        vec3 axis = glm::cross(w, wb);
+        if (thetaO >= pi || glm::dot(axis, axis) == 0)
+        {
+            cosTheta = -1;
+            return;
+        }
+        // turn w towards wb until the cone touches both
+        float thetaR = thetaO - thetaA;
+        axis = glm::normalize(axis);
+        w = glm::normalize(w * glm::cos(thetaR) + glm::cross(axis, w) * glm::sin(thetaR));
+        cosTheta = glm::cos(thetaO);
+    }
+};
+
+// The shapes of a ShapeList with an emitting material that can be sampled, for next event estimation. Lights inside
+// groups aren't in it, paths only find them by scattering into them. Lights are picked from a bvh over their
+// LightBounds, walked down from the root choosing each child in proportion to its importance for the shading point,
+// so thousands of small lights cost about as much noise as a few. Without the tree they are picked uniformly.
+class LightList
+{
+public:
+    static constexpr int BINS = 12;
+    // below this many levels nodes split by importance, deeper ones at the median so every light's path from the
+    // root fits in the 64 bit trail
+    static constexpr int MAX_SAOH_DEPTH = 40;
+
+    // after the world is set up, again whenever shapes are added or change material
+    void build(const ShapeList &world, bool useTree = true)
+    {
+        lights.clear();
+        index.clear();
+        lightBounds.clear();
+        trails.clear();
+        nodes.clear();
+        tree = useTree;
+        for (Shape *shape : world.shapes)
+        {
+            const Material *material = shape->lightMaterial();
+            if (!material || !material->emits()) continue;
+            LightBounds b = boundsOf(shape, material);
+            if (b.phi <= 0) continue;
+            index[shape] = uint32_t(lights.size());
+            lights.push_back(shape);
+            lightBounds.push_back(b);
+        }
+        if (!tree || lights.empty()) return;
+
+        trails.resize(lights.size());
+        std::vector<uint32_t> order(lights.size());
+        for (uint32_t i = 0; i < order.size(); i++) order[i] = i;
+        nodes.reserve(2 * lights.size());
+        buildNode(order, 0, uint32_t(order.size()), 0, 0);
+    }
+    bool empty() const { return lights.empty(); }
+    size_t size() const { return lights.size(); }
+
+    // picks a light to sample from shading point p, pdf is the chance of picking it, null if no light reaches p
+    Shape *sample(const point3 &p, ThreadLocal &tl, float &pdf) const
+    {
+        if (lights.empty()) return nullptr;
+        if (!tree)
+        {
+            pdf = 1.0f / lights.size();
+            return lights[glm::min(size_t(tl.randFloat() * lights.size()), lights.size() - 1)];
+        }
+
+        uint32_t n = 0;
+        float pmf = 1;
+        while (!nodes[n].leaf)
+        {
+            uint32_t left = n + 1, right = nodes[n].child;
+            float importanceLeft = nodes[left].bounds.importance(p), importanceRight = nodes[right].bounds.importance(p);
+            if (importanceLeft + importanceRight <= 0) return nullptr;
+            float pickLeft = importanceLeft / (importanceLeft + importanceRight);
+            if (tl.randFloat() < pickLeft)
+            {
+                n = left;
+                pmf *= pickLeft;
+            }
+            else
+            {
+                n = right;
+                pmf *= 1 - pickLeft;
+            }
+        }
+        if (n == 0 && nodes[0].bounds.importance(p) <= 0) return nullptr;
+        pdf = pmf;
+        return lights[nodes[n].child];
+    }
+    // chance that sample() picks shape from p, 0 for shapes that aren't in the list
+    float pdf(const point3 &p, const Shape *shape) const
+    {
+        auto found = index.find(shape);
+        if (found == index.end()) return 0;
+        if (!tree) return 1.0f / lights.size();
+
+        uint64_t trail = trails[found->second];
+        uint32_t n = 0;
+        float pmf = 1;
+        while (!nodes[n].leaf)
+        {
+            uint32_t left = n + 1, right = nodes[n].child;
+            float importanceLeft = nodes[left].bounds.importance(p), importanceRight = nodes[right].bounds.importance(p);
+            if (importanceLeft + importanceRight <= 0) return 0;
+            bool goRight = trail & 1;
+            pmf *= (goRight ? importanceRight : importanceLeft) / (importanceLeft + importanceRight);
+            n = goRight ? right : left;
+            trail >>= 1;
+        }
+        if (n == 0 && nodes[0].bounds.importance(p) <= 0) return 0;
+        return pmf;
+    }
+
+private:
+    // the left child of an interior node follows it, child is the right one, for leaves it is the light
+    struct Node
+    {
+        LightBounds bounds;
+        uint32_t child;
+        bool leaf;
+    };
+
+    static LightBounds boundsOf(const Shape *shape, const Material *material)
+    {
+        LightBounds b;
+        b.bounds = shape->boundingBox();
+        point3 p = b.bounds.centroid();
+        col3 emitted = material->emitted(0, 0, p);
+        // Diffuse lights emit the same on both sides of every point, into the hemisphere around the normal
+        b.twoSided = true;
+        b.phi = (emitted.x + emitted.y + emitted.z) / 3 * shape->surfaceArea() * glm::pi<float>() * 2;
+        shape->normalBounds(b.w, b.cosThetaO);
+        b.cosThetaE = 0;
+        return b;
+    }
+
+    uint32_t buildNode(std::vector<uint32_t> &order, uint32_t begin, uint32_t end, uint64_t trail, int depth)
+    {
+        uint32_t nodeIndex = uint32_t(nodes.size());
+        nodes.push_back(Node{});
+        if (end - begin == 1)
+        {
+            nodes[nodeIndex] = Node{lightBounds[order[begin]], order[begin], true};
+            trails[order[begin]] = trail;
+            return nodeIndex;
+        }
+
+        AABB centroidBounds;
+        LightBounds all;
+        for (uint32_t i = begin; i < end; i++)
+        {
+            centroidBounds.grow(lightBounds[order[i]].bounds.centroid());
+            all = LightBounds::merge(all, lightBounds[order[i]]);
+        }
+
+        uint32_t mid = depth < MAX_SAOH_DEPTH ? splitByImportance(order, begin, end, centroidBounds, all.bounds) : begin;
+        if (mid == begin || mid == end)
+        {
+            int axis = centroidBounds.longestAxis();
+            mid = (begin + end) / 2;
+            std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](uint32_t a, uint32_t b)
+            {
+                return lightBounds[a].bounds.centroid()[axis] < lightBounds[b].bounds.centroid()[axis];
+            });
+        }
+
+        buildNode(order, begin, mid, trail, depth + 1);
+        uint32_t right = buildNode(order, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+        nodes[nodeIndex] = Node{all, right, false};
+        return nodeIndex;
+    }
+
+    // Binned surface area orientation heuristic: the split that minimizes power times orientation measure times box
+    // area of both sides, boxes stretched along the other axes count for more. Returns the first light of the right
+    // side, begin if no split beats another.
+    uint32_t splitByImportance(std::vector<uint32_t> &order, uint32_t begin, uint32_t end, const AABB &centroidBounds, const AABB &bounds)
+    {
+        vec3 centroidExtent = centroidBounds.extent(), extent = bounds.extent();
+        float maxExtent = glm::max(extent.x, glm::max(extent.y, extent.z));
+        auto cost = [](const LightBounds &b, float stretch)
+        {
+            return b.phi <= 0 ? 0 : b.phi * b.orientationMeasure() * b.bounds.area() * stretch;
+        };
+
+        float bestCost = INFINITY;
+        int bestAxis = -1, bestBin = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (centroidExtent[axis] <= 0) continue;
+            LightBounds bins[BINS];
+            for (uint32_t i = begin; i < end; i++)
+            {
+                LightBounds &bin = bins[binOf(lightBounds[order[i]], centroidBounds, axis)];
+                bin = LightBounds::merge(bin, lightBounds[order[i]]);
+            }
+            float stretch = extent[axis] > 0 ? maxExtent / extent[axis] : 1;
+            // costs of everything right of each split, then sweep the left side across
+            float rightCost[BINS];
+            float rightPhi[BINS];
+            LightBounds right;
+            for (int split = BINS - 1; split > 0; split--)
+            {
+                right = LightBounds::merge(right, bins[split]);
+                rightCost[split] = cost(right, stretch);
+                rightPhi[split] = right.phi;
+            }
+            LightBounds left;
+            for (int split = 1; split < BINS; split++)
+            {
+                left = LightBounds::merge(left, bins[split - 1]);
+                float c = cost(left, stretch) + rightCost[split];
+                if (left.phi > 0 && rightPhi[split] > 0 && c < bestCost)
+                {
+                    bestCost = c;
+                    bestAxis = axis;
+                    bestBin = split;
+                }
+            }
+        }
+        if (bestAxis < 0) return begin;
+        auto first = std::partition(order.begin() + begin, order.begin() + end, [&](uint32_t light)
+        {
+            return binOf(lightBounds[light], centroidBounds, bestAxis) < bestBin;
+        });
+        return uint32_t(first - order.begin());
+    }
+    static int binOf(const LightBounds &b, const AABB &centroidBounds, int axis)
+    {
+        float offset = (b.bounds.centroid()[axis] - centroidBounds.min[axis]) / centroidBounds.extent()[axis];
+        return glm::clamp(int(offset * BINS), 0, BINS - 1);
+    }
+
+    std::vector<Shape*> lights;
+    std::unordered_map<const Shape*, uint32_t> index;
+    std::vector<LightBounds> lightBounds;
+    // per light, bit d tells whether its path from the root goes right at depth d
+    std::vector<uint64_t> trails;
+    std::vector<Node> nodes;
+    bool tree = true;
+};
+
+#endif
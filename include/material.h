@@ -10,11 +10,24 @@
 class Material
 {
 public:
+    virtual ~Material() = default;
     virtual bool scatter(const Ray &r_in, const HitRecord &rec, col3 &attenuation, Ray& r_out, ThreadLocal& tl) const = 0;
     virtual col3 emitted(float u, float v, point3 &p) const 
     {
         return col3(0, 0, 0);
     }
+    // shapes with an emitting material go into the LightList
+    virtual bool emits() const
+    {
+        return false;
+    }
+    // For materials whose scatter() picks directions with a known density: value is the attenuation towards dir
+    // times that density, which is pdf. Mirrors, glass and fuzzy metal return false, they only see lights through
+    // the rays they scatter.
+    virtual bool evalScatter(const Ray & /*r_in*/, const HitRecord & /*rec*/, const vec3 & /*dir*/, col3 & /*value*/, float & /*pdf*/) const
+    {
+        return false;
+    }
 };
 
 class MaterialList
@@ -59,6 +72,14 @@ public:
         attenuation = albedo;
         return true;
     }
+    // scatter() picks cosine weighted directions around the normal
+    bool evalScatter(const Ray & /*r_in*/, const HitRecord &rec, const vec3 &dir, col3 &value, float &pdf) const override
+    {
+        float cosine = glm::dot(rec.normal, glm::normalize(dir));
+        pdf = glm::max(cosine, 0.0f) / glm::pi<float>();
+        value = albedo * pdf;
+        return true;
+    }
     col3 albedo;
 };
 
@@ -133,6 +154,10 @@ public:
     {
         return c;
     }
+    bool emits() const override
+    {
+        return true;
+    }
     col3 c;
 
 private:
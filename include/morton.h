@@ -0,0 +1,114 @@
+#ifndef MORTON_H
+#define MORTON_H
+
+#include "vector.h"
+#include "parallel.h"
+
+#include <cstdint>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+inline int countLeadingZeros(uint64_t x)
+{
+    if (x == 0) return 64;
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, x);
+    return 63 - int(index);
+#else
+    return __builtin_clzll(x);
+#endif
+}
+
+// spreads the lower 10 bits of x so there are two zero bits between each of them
+inline uint32_t expandBits10(uint32_t x)
+{
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
+
+// spreads the lower 21 bits of x so there are two zero bits between each of them
+inline uint64_t expandBits21(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | (x << 32)) & 0x001f00000000ffff;
+    x = (x | (x << 16)) & 0x001f0000ff0000ff;
+    x = (x | (x << 8)) & 0x100f00f00f00f00f;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3;
+    x = (x | (x << 2)) & 0x1249249249249249;
+    return x;
+}
+
+// p is expected to be normalized to [0, 1]
+inline uint32_t morton30(const vec3 &p)
+{
+    vec3 q = glm::clamp(p * 1024.0f, 0.0f, 1023.0f);
+    return (expandBits10(uint32_t(q.x)) << 2) | (expandBits10(uint32_t(q.y)) << 1) | expandBits10(uint32_t(q.z));
+}
+
+inline uint64_t morton63(const vec3 &p)
+{
+    vec3 q = glm::clamp(p * 2097152.0f, 0.0f, 2097151.0f);
+    return (expandBits21(uint64_t(q.x)) << 2) | (expandBits21(uint64_t(q.y)) << 1) | expandBits21(uint64_t(q.z));
+}
+
+// Stable LSD radix sort of keys (only the lower keyBits are looked at), values are moved along with their keys.
+// Every 8 bit pass builds per thread histograms, prefix sums them and scatters every chunk in parallel.
+inline void radixSort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values, int keyBits, int numThreads)
+{
+    constexpr int RADIX = 256;
+    size_t count = keys.size();
+    numThreads = int(glm::max(size_t(1), glm::min(size_t(numThreads), count / 4096 + 1)));
+
+    std::vector<uint64_t> keysTmp(count);
+    std::vector<uint32_t> valuesTmp(count);
+    std::vector<size_t> offsets(size_t(numThreads) * RADIX);
+
+    for (int shift = 0; shift < keyBits; shift += 8)
+    {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallelForRange(numThreads, count, [&](size_t begin, size_t end, int n)
+        {
+            size_t *histogram = &offsets[size_t(n) * RADIX];
+            for (size_t i = begin; i < end; i++)
+            {
+                histogram[(keys[i] >> shift) & 0xff]++;
+            }
+        });
+
+        // digit major, thread minor so equal digits keep their input order
+        size_t sum = 0;
+        for (int digit = 0; digit < RADIX; digit++)
+        {
+            for (int n = 0; n < numThreads; n++)
+            {
+                size_t c = offsets[size_t(n) * RADIX + digit];
+                offsets[size_t(n) * RADIX + digit] = sum;
+                sum += c;
+            }
+        }
+
+        parallelForRange(numThreads, count, [&](size_t begin, size_t end, int n)
+        {
+            size_t *offset = &offsets[size_t(n) * RADIX];
+            for (size_t i = begin; i < end; i++)
+            {
+                size_t dst = offset[(keys[i] >> shift) & 0xff]++;
+                keysTmp[dst] = keys[i];
+                valuesTmp[dst] = values[i];
+            }
+        });
+
+        keys.swap(keysTmp);
+        values.swap(valuesTmp);
+    }
+}
+
+#endif
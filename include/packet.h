@@ -0,0 +1,283 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "simd.h"
+#include "ray.h"
+#include "aabb.h"
+#include "triangle_simd.h"
+
+// W rays stored lane by lane, e.g. the primary rays of a small block of neighbouring pixels
+template <int W>
+struct RayPacket
+{
+    vfloat<W> ox, oy, oz;
+    vfloat<W> dx, dy, dz;
+    vfloat<W> invDx, invDy, invDz;
+
+    RayPacket() = default;
+    explicit RayPacket(const Ray *rays)
+    {
+        alignas(64) float lanes[9][W];
+        for (int i = 0; i < W; i++)
+        {
+            lanes[0][i] = rays[i].origin.x; lanes[1][i] = rays[i].origin.y; lanes[2][i] = rays[i].origin.z;
+            lanes[3][i] = rays[i].direction.x; lanes[4][i] = rays[i].direction.y; lanes[5][i] = rays[i].direction.z;
+            lanes[6][i] = 1.0f / rays[i].direction.x; lanes[7][i] = 1.0f / rays[i].direction.y; lanes[8][i] = 1.0f / rays[i].direction.z;
+        }
+        ox = vfloat<W>::load(lanes[0]); oy = vfloat<W>::load(lanes[1]); oz = vfloat<W>::load(lanes[2]);
+        dx = vfloat<W>::load(lanes[3]); dy = vfloat<W>::load(lanes[4]); dz = vfloat<W>::load(lanes[5]);
+        invDx = vfloat<W>::load(lanes[6]); invDy = vfloat<W>::load(lanes[7]); invDz = vfloat<W>::load(lanes[8]);
+    }
+    Ray ray(int lane) const
+    {
+        return Ray(point3(laneOf(ox, lane), laneOf(oy, lane), laneOf(oz, lane)), vec3(laneOf(dx, lane), laneOf(dy, lane), laneOf(dz, lane)));
+    }
+    static float laneOf(const vfloat<W> &v, int lane)
+    {
+        alignas(64) float lanes[W];
+        v.store(lanes);
+        return lanes[lane];
+    }
+};
+
+// slab test of every lane against one box, same math as AABB::intersect
+template <int W>
+inline vmask<W> intersectPacket(const AABB &box, const RayPacket<W> &p, const vfloat<W> &t_min, const vfloat<W> &t_max)
+{
+    vfloat<W> tx0 = (vfloat<W>(box.min.x) - p.ox) * p.invDx, tx1 = (vfloat<W>(box.max.x) - p.ox) * p.invDx;
+    vfloat<W> ty0 = (vfloat<W>(box.min.y) - p.oy) * p.invDy, ty1 = (vfloat<W>(box.max.y) - p.oy) * p.invDy;
+    vfloat<W> tz0 = (vfloat<W>(box.min.z) - p.oz) * p.invDz, tz1 = (vfloat<W>(box.max.z) - p.oz) * p.invDz;
+    vfloat<W> tEnter = vmax(vmax(vmin(tx0, tx1), vmin(ty0, ty1)), vmax(vmin(tz0, tz1), t_min));
+    vfloat<W> tExit = vmin(vmin(vmax(tx0, tx1), vmax(ty0, ty1)), vmin(vmax(tz0, tz1), t_max));
+    return tEnter <= tExit;
+}
+
+// Sphere::intersect for every lane in active, lanes that hit closer than t_max get t_max set to the hit
+template <int W>
+inline vmask<W> intersectSpherePacket(const point3 &cen, float rad, const RayPacket<W> &p, const vmask<W> &active,
+                                      const vfloat<W> &t_min, vfloat<W> &t_max)
+{
+    vfloat<W> ocx = p.ox - vfloat<W>(cen.x), ocy = p.oy - vfloat<W>(cen.y), ocz = p.oz - vfloat<W>(cen.z);
+    vfloat<W> a = p.dx * p.dx + p.dy * p.dy + p.dz * p.dz;
+    vfloat<W> invA = vfloat<W>(1.0f) / a;
+    vfloat<W> half_b = ocx * p.dx + ocy * p.dy + ocz * p.dz;
+    vfloat<W> s = half_b * invA;
+    vfloat<W> lx = ocx - s * p.dx, ly = ocy - s * p.dy, lz = ocz - s * p.dz;
+
+    vfloat<W> dis = a * (vfloat<W>(rad * rad) - (lx * lx + ly * ly + lz * lz));
+    vmask<W> hit = active & (vfloat<W>(0.0f) <= dis);
+    if (hit.bits() == 0) return hit;
+
+    vfloat<W> sqrtd = vsqrt(vmax(dis, vfloat<W>(0.0f)));
+    vfloat<W> zero(0.0f);
+    vfloat<W> nearRoot = (zero - half_b - sqrtd) * invA;
+    vfloat<W> farRoot = (zero - half_b + sqrtd) * invA;
+    vmask<W> nearOk = (t_min <= nearRoot) & (nearRoot <= t_max);
+    vmask<W> farOk = (t_min <= farRoot) & (farRoot <= t_max);
+    hit = hit & (nearOk | farOk);
+    t_max = vselect(hit, vselect(nearOk, nearRoot, farRoot), t_max);
+    return hit;
+}
+
+// WatertightRay of every lane, set up once per packet and shared by every triangle the packet is tested against. The
+// lanes are stored axis by axis so the simd tests below load 4 or 8 lanes of each.
+template <int W>
+struct WatertightPacket
+{
+    alignas(64) float ox[W], oy[W], oz[W];
+    alignas(64) float sx[W], sy[W], sz[W];
+    alignas(64) int32_t kx[W], ky[W], kz[W];
+
+    explicit WatertightPacket(const RayPacket<W> &p)
+    {
+        alignas(64) float lanes[6][W];
+        p.ox.store(lanes[0]); p.oy.store(lanes[1]); p.oz.store(lanes[2]);
+        p.dx.store(lanes[3]); p.dy.store(lanes[4]); p.dz.store(lanes[5]);
+        for (int i = 0; i < W; i++)
+        {
+            WatertightRay r(Ray(point3(lanes[0][i], lanes[1][i], lanes[2][i]), vec3(lanes[3][i], lanes[4][i], lanes[5][i])));
+            ox[i] = r.origin.x; oy[i] = r.origin.y; oz[i] = r.origin.z;
+            sx[i] = r.sx; sy[i] = r.sy; sz[i] = r.sz;
+            kx[i] = r.kx; ky[i] = r.ky; kz[i] = r.kz;
+        }
+    }
+    WatertightRay lane(int i) const
+    {
+        WatertightRay r;
+        r.origin = point3(ox[i], oy[i], oz[i]);
+        r.kx = kx[i]; r.ky = ky[i]; r.kz = kz[i];
+        r.sx = sx[i]; r.sy = sy[i]; r.sz = sz[i];
+        return r;
+    }
+};
+
+#ifdef SIMD_RUNTIME_DISPATCH
+
+// Lanes [first, first + 4) of intersectTrianglePacket(), the steps of intersectTriangle() with every lane sheared along
+// its own axes, picked from x, y and z by blends. Returns the lanes of active that hit and writes their t to tMax.
+template <int W>
+SIMD_TARGET("avx2,fma")
+inline int intersectTriangleLanesAVX2(const point3 *v, const WatertightPacket<W> &r, int first, int active, const float *tMin, float *tMax)
+{
+    __m128 origin[3] = {_mm_load_ps(r.ox + first), _mm_load_ps(r.oy + first), _mm_load_ps(r.oz + first)};
+    __m128i k[3] = {_mm_load_si128(reinterpret_cast<const __m128i*>(r.kx + first)),
+                    _mm_load_si128(reinterpret_cast<const __m128i*>(r.ky + first)),
+                    _mm_load_si128(reinterpret_cast<const __m128i*>(r.kz + first))};
+    __m128i one = _mm_set1_epi32(1), two = _mm_set1_epi32(2);
+
+    // x, y and z in every lane's permuted axes for the three corners
+    __m128 p[3][3];
+    for (int vert = 0; vert < 3; vert++)
+    {
+        __m128 rel[3];
+        for (int axis = 0; axis < 3; axis++) rel[axis] = _mm_sub_ps(_mm_set1_ps(v[vert][axis]), origin[axis]);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m128 picked = _mm_blendv_ps(rel[0], rel[1], _mm_castsi128_ps(_mm_cmpeq_epi32(k[axis], one)));
+            p[vert][axis] = _mm_blendv_ps(picked, rel[2], _mm_castsi128_ps(_mm_cmpeq_epi32(k[axis], two)));
+        }
+    }
+    __m256d sx = _mm256_cvtps_pd(_mm_load_ps(r.sx + first)), sy = _mm256_cvtps_pd(_mm_load_ps(r.sy + first));
+    __m128 sz = _mm_load_ps(r.sz + first);
+    __m256d zero = _mm256_setzero_pd();
+    __m256d ax = shearVertex4(p[0][0], sx, p[0][2]), ay = shearVertex4(p[0][1], sy, p[0][2]);
+    __m256d bx = shearVertex4(p[1][0], sx, p[1][2]), by = shearVertex4(p[1][1], sy, p[1][2]);
+    __m256d cx = shearVertex4(p[2][0], sx, p[2][2]), cy = shearVertex4(p[2][1], sy, p[2][2]);
+
+    // W_ is the W of intersectTriangle(), W is the lane count here
+    __m256d U = _mm256_sub_pd(_mm256_mul_pd(cx, by), _mm256_mul_pd(cy, bx));
+    __m256d V = _mm256_sub_pd(_mm256_mul_pd(ax, cy), _mm256_mul_pd(ay, cx));
+    __m256d W_ = _mm256_sub_pd(_mm256_mul_pd(bx, ay), _mm256_mul_pd(by, ax));
+    __m256d anyNeg = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(U, zero, _CMP_LT_OQ), _mm256_cmp_pd(V, zero, _CMP_LT_OQ)),
+                                  _mm256_cmp_pd(W_, zero, _CMP_LT_OQ));
+    __m256d anyPos = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(U, zero, _CMP_GT_OQ), _mm256_cmp_pd(V, zero, _CMP_GT_OQ)),
+                                  _mm256_cmp_pd(W_, zero, _CMP_GT_OQ));
+    __m256d det = _mm256_add_pd(_mm256_add_pd(U, V), W_);
+    __m256d inside = _mm256_andnot_pd(_mm256_and_pd(anyNeg, anyPos), _mm256_cmp_pd(det, zero, _CMP_NEQ_OQ));
+    int hits = _mm256_movemask_pd(inside) & active;
+    if (!hits) return 0;
+
+    __m256d az = _mm256_cvtps_pd(_mm_mul_ps(sz, p[0][2]));
+    __m256d bz = _mm256_cvtps_pd(_mm_mul_ps(sz, p[1][2]));
+    __m256d cz = _mm256_cvtps_pd(_mm_mul_ps(sz, p[2][2]));
+    __m256d T = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(U, az), _mm256_mul_pd(V, bz)), _mm256_mul_pd(W_, cz));
+    __m128 hitT = _mm256_cvtpd_ps(_mm256_div_pd(T, det));
+    __m128 inRange = _mm_and_ps(_mm_cmpge_ps(hitT, _mm_load_ps(tMin + first)), _mm_cmple_ps(hitT, _mm_load_ps(tMax + first)));
+    hits &= _mm_movemask_ps(inRange);
+    __m128 hitMask = _mm_castsi128_ps(_mm_setr_epi32(-(hits & 1), -((hits >> 1) & 1), -((hits >> 2) & 1), -((hits >> 3) & 1)));
+    _mm_store_ps(tMax + first, _mm_blendv_ps(_mm_load_ps(tMax + first), hitT, hitMask));
+    return hits;
+}
+
+// lanes [first, first + 8), same steps as the avx2 version
+template <int W>
+SIMD_TARGET("avx512f")
+inline int intersectTriangleLanesAVX512(const point3 *v, const WatertightPacket<W> &r, int first, int active, const float *tMin, float *tMax)
+{
+    __m256 origin[3] = {_mm256_load_ps(r.ox + first), _mm256_load_ps(r.oy + first), _mm256_load_ps(r.oz + first)};
+    __m256i k[3] = {_mm256_load_si256(reinterpret_cast<const __m256i*>(r.kx + first)),
+                    _mm256_load_si256(reinterpret_cast<const __m256i*>(r.ky + first)),
+                    _mm256_load_si256(reinterpret_cast<const __m256i*>(r.kz + first))};
+    __m256i one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+
+    __m256 p[3][3];
+    for (int vert = 0; vert < 3; vert++)
+    {
+        __m256 rel[3];
+        for (int axis = 0; axis < 3; axis++) rel[axis] = _mm256_sub_ps(_mm256_set1_ps(v[vert][axis]), origin[axis]);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            __m256 picked = _mm256_blendv_ps(rel[0], rel[1], _mm256_castsi256_ps(_mm256_cmpeq_epi32(k[axis], one)));
+            p[vert][axis] = _mm256_blendv_ps(picked, rel[2], _mm256_castsi256_ps(_mm256_cmpeq_epi32(k[axis], two)));
+        }
+    }
+    __m512d sx = _mm512_cvtps_pd(_mm256_load_ps(r.sx + first)), sy = _mm512_cvtps_pd(_mm256_load_ps(r.sy + first));
+    __m256 sz = _mm256_load_ps(r.sz + first);
+    __m512d zero = _mm512_setzero_pd();
+    __m512d ax = shearVertex8(p[0][0], sx, p[0][2]), ay = shearVertex8(p[0][1], sy, p[0][2]);
+    __m512d bx = shearVertex8(p[1][0], sx, p[1][2]), by = shearVertex8(p[1][1], sy, p[1][2]);
+    __m512d cx = shearVertex8(p[2][0], sx, p[2][2]), cy = shearVertex8(p[2][1], sy, p[2][2]);
+
+    __m512d U = _mm512_sub_pd(_mm512_mul_pd(cx, by), _mm512_mul_pd(cy, bx));
+    __m512d V = _mm512_sub_pd(_mm512_mul_pd(ax, cy), _mm512_mul_pd(ay, cx));
+    __m512d W_ = _mm512_sub_pd(_mm512_mul_pd(bx, ay), _mm512_mul_pd(by, ax));
+    __mmask8 anyNeg = _mm512_cmp_pd_mask(U, zero, _CMP_LT_OQ) | _mm512_cmp_pd_mask(V, zero, _CMP_LT_OQ) | _mm512_cmp_pd_mask(W_, zero, _CMP_LT_OQ);
+    __mmask8 anyPos = _mm512_cmp_pd_mask(U, zero, _CMP_GT_OQ) | _mm512_cmp_pd_mask(V, zero, _CMP_GT_OQ) | _mm512_cmp_pd_mask(W_, zero, _CMP_GT_OQ);
+    __m512d det = _mm512_add_pd(_mm512_add_pd(U, V), W_);
+    int hits = ~(anyNeg & anyPos) & _mm512_cmp_pd_mask(det, zero, _CMP_NEQ_OQ) & active;
+    if (!hits) return 0;
+
+    __m256 az = _mm256_mul_ps(sz, p[0][2]), bz = _mm256_mul_ps(sz, p[1][2]), cz = _mm256_mul_ps(sz, p[2][2]);
+    __m512d T = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(U, _mm512_cvtps_pd(az)), _mm512_mul_pd(V, _mm512_cvtps_pd(bz))),
+                              _mm512_mul_pd(W_, _mm512_cvtps_pd(cz)));
+    __m256 hitT = _mm512_cvtpd_ps(_mm512_div_pd(T, det));
+    __m256 inRange = _mm256_and_ps(_mm256_cmp_ps(hitT, _mm256_load_ps(tMin + first), _CMP_GE_OQ),
+                                   _mm256_cmp_ps(hitT, _mm256_load_ps(tMax + first), _CMP_LE_OQ));
+    hits &= _mm256_movemask_ps(inRange);
+    __m256i laneBits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i hitMask = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(hits), laneBits), laneBits);
+    _mm256_store_ps(tMax + first, _mm256_blendv_ps(_mm256_load_ps(tMax + first), hitT, _mm256_castsi256_ps(hitMask)));
+    return hits;
+}
+
+#endif
+
+// intersectTriangle() for every lane in active, lanes that hit closer than t_max get t_max set to the hit. The
+// watertight test shears the triangle along each lane's own dominant axis, so the lanes pick their axes by blends and
+// run the test 8 (avx512) or 4 (avx2) lanes at a time in double like nearestTriangle() does, which keeps packet and
+// single ray images identical. Without either the lanes run the scalar test one by one.
+template <int W>
+inline vmask<W> intersectTrianglePacket(const point3 &v0, const point3 &v1, const point3 &v2, const WatertightPacket<W> &r,
+                                        const vmask<W> &active, const vfloat<W> &t_min, vfloat<W> &t_max)
+{
+    int activeBits = active.bits(), hits = 0;
+    if (activeBits == 0) return active;
+    alignas(64) float tMin[W], tMax[W];
+    t_min.store(tMin);
+    t_max.store(tMax);
+#ifdef SIMD_RUNTIME_DISPATCH
+    const point3 v[3] = {v0, v1, v2};
+    SimdLevel level = cpuSimdLevel();
+    if (W >= 8 && level == SimdLevel::AVX512)
+    {
+        for (int first = 0; first < W; first += 8)
+        {
+            int lanes = (activeBits >> first) & 0xff;
+            if (lanes) hits |= intersectTriangleLanesAVX512(v, r, first, lanes, tMin, tMax) << first;
+        }
+        t_max = vfloat<W>::load(tMax);
+        return vmask<W>::fromBits(hits);
+    }
+    if (level == SimdLevel::AVX2 || level == SimdLevel::AVX512)
+    {
+        for (int first = 0; first < W; first += 4)
+        {
+            int lanes = (activeBits >> first) & 0xf;
+            if (lanes) hits |= intersectTriangleLanesAVX2(v, r, first, lanes, tMin, tMax) << first;
+        }
+        t_max = vfloat<W>::load(tMax);
+        return vmask<W>::fromBits(hits);
+    }
+#endif
+    for (int i = 0; i < W; i++)
+    {
+        float t, u, v;
+        if (((activeBits >> i) & 1) && intersectTriangle(v0, v1, v2, r.lane(i), tMin[i], tMax[i], t, u, v))
+        {
+            tMax[i] = t;
+            hits |= 1 << i;
+        }
+    }
+    t_max = vfloat<W>::load(tMax);
+    return vmask<W>::fromBits(hits);
+}
+
+// the same for a packet that is tested against this one triangle only
+template <int W>
+inline vmask<W> intersectTrianglePacket(const point3 &v0, const point3 &v1, const point3 &v2, const RayPacket<W> &p, const vmask<W> &active,
+                                        const vfloat<W> &t_min, vfloat<W> &t_max)
+{
+    return intersectTrianglePacket(v0, v1, v2, WatertightPacket<W>(p), active, t_min, t_max);
+}
+
+#endif
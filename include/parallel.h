@@ -0,0 +1,30 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "thread_pool.h"
+
+#include <functional>
+
+// runs task(threadIndex) for numThreads indices on the workers of the global pool and waits for all of them
+inline void parallelFor(int numThreads, const std::function<void(int)> &task)
+{
+    if (numThreads <= 1)
+    {
+        task(0);
+        return;
+    }
+    ThreadPool::global().run(numThreads, task);
+}
+
+// splits [0, count) into numThreads contiguous chunks and runs task(begin, end, threadIndex) on each
+inline void parallelForRange(int numThreads, size_t count, const std::function<void(size_t, size_t, int)> &task)
+{
+    parallelFor(numThreads, [&](int n)
+    {
+        size_t begin = count * n / numThreads;
+        size_t end = count * (n + 1) / numThreads;
+        task(begin, end, n);
+    });
+}
+
+#endif
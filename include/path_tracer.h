@@ -0,0 +1,123 @@
+#ifndef PATH_TRACER_H
+#define PATH_TRACER_H
+
+#include "ray.h"
+#include "utils.h"
+#include "shape.h"
+#include "material.h"
+#include "light.h"
+#include "setting.h"
+
+// Chance that russian roulette keeps a path carrying throughput, its brightest channel capped below 1 so even paths
+// bouncing between white surfaces end eventually. Survivors are divided by it, which keeps the estimate unbiased.
+inline float survivalProbability(const col3 &throughput)
+{
+    return glm::min(glm::max(throughput.x, glm::max(throughput.y, throughput.z)), 0.95f);
+}
+
+// multiple importance sampling weight of a sample taken with density pdf that another strategy takes with otherPdf
+inline float powerHeuristic(float pdf, float otherPdf)
+{
+    float a = pdf * pdf, b = otherPdf * otherPdf;
+    return a / (a + b);
+}
+
+// Density that scattering from rec along r_in picks dir, 0 for materials that can't tell (e.g. mirrors), whose
+// scattered rays are the only way they see lights.
+inline float scatterPdf(const Ray &r_in, const HitRecord &rec, const vec3 &dir)
+{
+    col3 value;
+    float pdf;
+    return rec.material->evalScatter(r_in, rec, dir, value, pdf) ? pdf : 0;
+}
+
+// Light from one point on one light reaching rec straight through a shadow ray, weighted against scattering picking
+// the same direction. r_in is the ray that hit rec.
+inline col3 sampleDirectLight(const Ray &r_in, const HitRecord &rec, ShapeList &world, const LightList &lights, ThreadLocal &tl)
+{
+    float pickPdf, pdf;
+    vec3 dir;
+    Shape *light = lights.sample(rec.p, tl, pickPdf);
+    if (!light || !light->sampleLight(rec.p, tl, dir, pdf)) return col3(0, 0, 0);
+
+    col3 value;
+    float bsdfPdf;
+    if (!rec.material->evalScatter(r_in, rec, dir, value, bsdfPdf) || bsdfPdf <= 0) return col3(0, 0, 0);
+
+    Ray shadow(rec.p, dir);
+    HitRecord lightRec;
+    if (!light->rayHit(shadow, 0.0001, INFINITY, lightRec)) return col3(0, 0, 0);
+    if (world.occluded(shadow, 0.0001, lightRec.t * (1 - 1e-4f))) return col3(0, 0, 0);
+
+    float lightPdf = pickPdf * pdf;
+    return value * lightRec.material->emitted(lightRec.u, lightRec.v, lightRec.p) * (powerHeuristic(lightPdf, bsdfPdf) / lightPdf);
+}
+
+// Weight of the light rec emits along r, which scattering picked with density bsdfPdf (0 for camera rays and bounces
+// off materials without a density). Lights that sampleDirectLight() could have picked share it, the rest count fully.
+inline float emissionWeight(const Ray &r, const HitRecord &rec, float bsdfPdf, const LightList &lights)
+{
+    if (bsdfPdf <= 0) return 1;
+    float pickPdf = lights.pdf(r.origin, rec.shape);
+    if (pickPdf <= 0) return 1;
+    return powerHeuristic(bsdfPdf, pickPdf * rec.shape->lightPdf(r.origin, r.direction));
+}
+
+// Color arriving along r from its first hit rec, found by the caller (e.g. a packet). The bounces run as a loop that
+// multiplies every attenuation into the path throughput instead of recursing. Paths end at setting.maxDepth hits, and
+// from setting.rouletteDepth hits on russian roulette ends dark paths early. With setting.lightSampling every hit on
+// a material with a scatter density also samples a light, see sampleDirectLight().
+inline col3 shade(Ray r, HitRecord rec, ShapeList &world, const LightList &lights, const Settings &setting, ThreadLocal &tl)
+{
+    bool lightSampling = setting.lightSampling && !lights.empty();
+    col3 color(0, 0, 0), throughput(1, 1, 1);
+    float bsdfPdf = 0;
+    for (int hits = 1; ; hits++)
+    {
+        col3 emitted = rec.material->emitted(rec.u, rec.v, rec.p);
+        if (lightSampling && emitted != col3(0, 0, 0)) emitted *= emissionWeight(r, rec, bsdfPdf, lights);
+        color += throughput * emitted;
+
+        Ray scattered;
+        col3 attenuation;
+        if (hits >= setting.maxDepth || !rec.material->scatter(r, rec, attenuation, scattered, tl)) break;
+        if (lightSampling)
+        {
+            color += throughput * sampleDirectLight(r, rec, world, lights, tl);
+            bsdfPdf = scatterPdf(r, rec, scattered.direction);
+        }
+        throughput *= attenuation;
+        if (hits >= setting.rouletteDepth)
+        {
+            float survival = survivalProbability(throughput);
+            if (tl.randFloat() >= survival) break;
+            throughput /= survival;
+        }
+
+        r = scattered;
+        if (!world.hit(r, 0.0001, INFINITY, rec))
+        {
+            color += throughput * setting.background;
+            break;
+        }
+    }
+    return color;
+}
+
+// color arriving along r, one sample of the pixel r goes through
+inline col3 rayColor(const Ray &r, ShapeList &world, const LightList &lights, const Settings &setting, ThreadLocal &tl)
+{
+    if (setting.maxDepth <= 0)
+    {
+        return col3(0, 0, 0);
+    }
+
+    HitRecord rec;
+    if (!world.hit(r, 0.0001, INFINITY, rec))
+    {
+        return setting.background;
+    }
+    return shade(r, rec, world, lights, setting, tl);
+}
+
+#endif
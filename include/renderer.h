@@ -0,0 +1,384 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "utils.h"
+#include "ray.h"
+#include "camera.h"
+#include "shape.h"
+#include "light.h"
+#include "setting.h"
+#include "path_tracer.h"
+#include "wavefront.h"
+#include "tiles.h"
+#include "parallel.h"
+#include "thread_pool.h"
+#include "timer.h"
+#include "accumulation.h"
+
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <chrono>
+#include <functional>
+
+// The primary rays of a block of W neighbouring pixels are traced as one packet, the bounces after the first hit go
+// through shade() one by one since they scatter in all directions. Adds setting.samplesPerPixel samples of every
+// pixel of tile to film.
+template <int W>
+void renderPackets(const Tile &tile, const Settings &setting, Camera &cam, ShapeList &world, const LightList &lights,
+                   AccumulationBuffer &film, ThreadLocal &tl)
+{
+    int width = film.width, height = film.height;
+    constexpr int blockWidth = W >= 8 ? 4 : 2;
+    constexpr int blockHeight = W / blockWidth;
+
+    for (int j = tile.y0; j < tile.y1; j += blockHeight)
+    {
+        for (int i = tile.x0; i < tile.x1; i += blockWidth)
+        {
+            int active = 0;
+            for (int lane = 0; lane < W; lane++)
+            {
+                if (i + lane % blockWidth < tile.x1 && j + lane / blockWidth < tile.y1) active |= 1 << lane;
+            }
+
+            col3 pixelCol[W] = {};
+            for (int s=0; s<setting.samplesPerPixel; s++)
+            {
+                Ray rays[W];
+                for (int lane = 0; lane < W; lane++)
+                {
+                    float u = float(i + lane % blockWidth + tl.randFloat()) / (width - 1);
+                    float v = float(j + lane / blockWidth + tl.randFloat()) / (height - 1);
+                    rays[lane] = cam.getRay(u, v);
+                }
+
+                HitRecord recs[W];
+                int hits = setting.maxDepth > 0 ? world.hitPacket(RayPacket<W>(rays), active, 0.0001, INFINITY, recs) : 0;
+                for (int lane = 0; lane < W; lane++)
+                {
+                    if (!((active >> lane) & 1)) continue;
+                    if ((hits >> lane) & 1) pixelCol[lane] += shade(rays[lane], recs[lane], world, lights, setting, tl);
+                    else if (setting.maxDepth > 0) pixelCol[lane] += setting.background;
+                }
+            }
+
+            for (int lane = 0; lane < W; lane++)
+            {
+                if ((active >> lane) & 1) film.add(i + lane % blockWidth, j + lane / blockWidth, pixelCol[lane], setting.samplesPerPixel);
+            }
+        }
+    }
+}
+
+// Side of the tiles wavefront passes are split into. A pass of one sample per pixel over tiles of setting.tileSize
+// would give the integrator a few hundred paths per stage, so tiles double in size while a tile still fits in
+// setting.wavefrontBatchSize paths and every thread still gets a few tiles to balance the load with.
+inline int wavefrontTileSize(const Settings &setting, int width, int height)
+{
+    int side = glm::max(setting.tileSize, 1);
+    size_t batchSize = size_t(glm::max(setting.wavefrontBatchSize, 1));
+    size_t samples = size_t(glm::max(setting.samplesPerPixel, 1));
+    int minTiles = 4 * glm::max(setting.numThreads, 1);
+    while (size_t(2 * side) * size_t(2 * side) * samples <= batchSize)
+    {
+        int tilesX = (width + 2 * side - 1) / (2 * side);
+        int tilesY = (height + 2 * side - 1) / (2 * side);
+        if (tilesX * tilesY < minTiles) break;
+        side *= 2;
+    }
+    return side;
+}
+
+// adds setting.samplesPerPixel samples of every pixel of tile to film with packets, single rays or the wavefront
+// integrator, whichever setting asks for
+inline void renderTile(const Tile &tile, Settings &setting, Camera &cam, ShapeList &world, const LightList &lights,
+                       AccumulationBuffer &film, WavefrontIntegrator &integrator, std::vector<col3> &tileSums, ThreadLocal &tl)
+{
+    int width = film.width, height = film.height;
+    if (setting.integrator == Integrator::Wavefront)
+    {
+        tileSums.assign(size_t(tile.width()) * tile.height(), col3(0, 0, 0));
+        integrator.render(tile, width, height, setting, cam, world, lights, tileSums.data(), tl);
+        for (int j = tile.y0; j < tile.y1; j++)
+        {
+            for (int i = tile.x0; i < tile.x1; i++)
+            {
+                film.add(i, j, tileSums[(j - tile.y0) * tile.width() + i - tile.x0], setting.samplesPerPixel);
+            }
+        }
+        return;
+    }
+
+    switch (setting.packetSize)
+    {
+        case 4:  renderPackets<4>(tile, setting, cam, world, lights, film, tl); return;
+        case 8:  renderPackets<8>(tile, setting, cam, world, lights, film, tl); return;
+        case 16: renderPackets<16>(tile, setting, cam, world, lights, film, tl); return;
+        default: break;
+    }
+
+    // TODO: Switching i and j might be even faster
+    for (int j = tile.y0; j < tile.y1; j++)
+    {
+        for (int i = tile.x0; i < tile.x1; i++)
+        {
+            col3 pixelCol(0, 0, 0);
+            for (int s=0; s<setting.samplesPerPixel; s++)
+            {
+                float u = float(i + tl.randFloat()) / (width - 1);
+                float v = float(j + tl.randFloat()) / (height - 1);
+
+                Ray r = cam.getRay(u, v);
+
+                pixelCol += rayColor(r, world, lights, setting, tl);
+            }
+            film.add(i, j, pixelCol, setting.samplesPerPixel);
+        }
+    }
+}
+
+// Flag shared between whoever may want a render to stop and its workers, which look at it before every tile. Copies
+// share the flag.
+class CancellationToken
+{
+public:
+    CancellationToken() : flag(std::make_shared<std::atomic<bool>>(false)) {}
+
+    void cancel() { *flag = true; }
+    bool cancelled() const { return *flag; }
+
+private:
+    std::shared_ptr<std::atomic<bool>> flag;
+};
+
+// One image of world seen through cam, rendered on the thread pool in passes of one sample per pixel added to an
+// AccumulationBuffer. run() returns right away, the passes stop early when the token is cancelled or the time budget
+// is used up, both checked before every tile, so a pass can end with only some of its pixels done. The film keeps a
+// sample count per pixel that says how far each one got. run() can be called again after wait() to trace more
+// samples on top.
+class RenderJob
+{
+public:
+    // world and lights have to stay as they are until the job is destroyed
+    RenderJob(int width, int height, const Settings &setting, const Camera &cam, ShapeList &world, const LightList &lights)
+        : setting(setting), cam(cam), world(world), lights(lights)
+    {
+        film.resize(width, height);
+    }
+    ~RenderJob()
+    {
+        cancel();
+        wait();
+    }
+    RenderJob(const RenderJob &) = delete;
+    RenderJob &operator=(const RenderJob &) = delete;
+
+    // Traces passes passes, stopping once budgetMs have passed since this call or token is cancelled. A run still
+    // going is stopped first, its unfinished passes are added to these. The token is only read, cancelling it stops
+    // every job it was given to.
+    void run(int passes, float budgetMs = INFINITY, CancellationToken token = CancellationToken())
+    {
+        bool going = !done();
+        if (going) cancel();
+        wait();
+        if (!going) passesLeft = 0;
+        cancelRequested = false;
+        this->token = token;
+        passesLeft += glm::max(passes, 0);
+        deadline = std::chrono::steady_clock::time_point::max();
+        if (budgetMs < 1e9f)
+        {
+            deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(int64_t(double(budgetMs) * 1000));
+        }
+        timedOut = false;
+        timer.from();
+        future = ThreadPool::global().submit([this]() { accumulate(); });
+    }
+    // stops this job only, the token given to run() stays as it is
+    void cancel() { cancelRequested = true; }
+    bool done() const
+    {
+        return !future.valid() || future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+    // waits for the passes of the last run() to finish or stop
+    void wait()
+    {
+        if (future.valid()) future.get();
+    }
+
+    // the samples so far, only to be read while no run is going
+    const AccumulationBuffer &result() const { return film; }
+    // samples every pixel reached, row by row, only while no run is going
+    std::vector<int> sampleCounts() const
+    {
+        std::vector<int> counts(film.pixels.size());
+        for (size_t p = 0; p < counts.size(); p++) counts[p] = int(film.pixels[p].w);
+        return counts;
+    }
+    // passes every pixel got
+    int passes() const { return finishedPasses; }
+    // passes run() asked for that didn't happen yet
+    int remaining() const { return passesLeft; }
+    // time from the last run() to the end of its last pass, finished or not
+    float elapsedMs() const { return passMs; }
+    bool cancelled() const { return cancelRequested || token.cancelled(); }
+    // whether the last run stopped at its time budget
+    bool outOfTime() const { return timedOut; }
+
+    // called on the render thread after every pass with the film so far, including a pass that was cut short
+    std::function<void(const AccumulationBuffer &)> onPass;
+
+private:
+    bool stopping()
+    {
+        if (cancelRequested || token.cancelled()) return true;
+        if (std::chrono::steady_clock::now() < deadline) return false;
+        timedOut = true;
+        return true;
+    }
+    void accumulate()
+    {
+        Settings passSetting = setting;
+        passSetting.samplesPerPixel = 1;
+        int tileSize = setting.tileSize;
+        if (setting.integrator == Integrator::Wavefront) tileSize = wavefrontTileSize(passSetting, film.width, film.height);
+        // the stage buffers are kept for every pass and run, one set per task index
+        workers.resize(size_t(glm::max(setting.numThreads, 1)));
+        std::atomic<bool> stop{false};
+        while (passesLeft > 0 && !stop)
+        {
+            uint32_t seed = seeds++;
+            TileQueue tiles(film.width, film.height, tileSize);
+            parallelFor(setting.numThreads, [&](int n)
+            {
+                // every pass needs samples of its own, cut short ones included
+                ThreadLocal tl;
+                tl.init(seed * uint32_t(setting.numThreads) + n);
+
+                Worker &worker = workers[n];
+                Tile tile;
+                while (!stop && tiles.next(tile))
+                {
+                    if (stopping())
+                    {
+                        stop = true;
+                        break;
+                    }
+                    renderTile(tile, passSetting, cam, world, lights, film, worker.integrator, worker.tileSums, tl);
+                }
+            });
+            // a pass cut short only left some pixels without their sample of it, the counts say which
+            if (!stop)
+            {
+                finishedPasses++;
+                passesLeft--;
+            }
+            passMs = timer.now() / 1000;
+            if (onPass) onPass(film);
+            if (!stop && stopping()) break;
+        }
+    }
+
+    struct Worker
+    {
+        WavefrontIntegrator integrator;
+        std::vector<col3> tileSums;
+    };
+
+    Settings setting;
+    Camera cam;
+    ShapeList &world;
+    const LightList &lights;
+    AccumulationBuffer film;
+    std::vector<Worker> workers;
+
+    CancellationToken token;
+    std::atomic<bool> cancelRequested{false};
+    std::chrono::steady_clock::time_point deadline;
+    std::atomic<bool> timedOut{false};
+    TimeIt timer;
+    std::atomic<int> finishedPasses{0};
+    std::atomic<int> passesLeft{0};
+    std::atomic<float> passMs{0};
+    uint32_t seeds = 0;
+    std::future<void> future;
+};
+
+// Keeps a RenderJob going in the background for the ui. After each pass a copy of its film is published, present()
+// resolves the newest one for the ui thread without waiting on the render, again with other tonemap settings if asked
+// to. start() cancels the job of the previous view, its workers give up at their next tile, and accumulates the new
+// one from scratch, until setting.samplesPerPixel passes or setting.timeBudgetMs. addPasses() keeps the samples so far
+// and traces more on top of them.
+class ProgressiveRenderer
+{
+public:
+    ProgressiveRenderer() = default;
+    ~ProgressiveRenderer()
+    {
+        stop();
+    }
+    ProgressiveRenderer(const ProgressiveRenderer &) = delete;
+    ProgressiveRenderer &operator=(const ProgressiveRenderer &) = delete;
+
+    // world and lights have to stay as they are until stop() or the next start()
+    void start(int width, int height, const Settings &setting, const Camera &cam, ShapeList &world, const LightList &lights)
+    {
+        stop();
+        {
+            std::lock_guard<std::mutex> lock(publishedMutex);
+            published.resize(width, height);
+            fresh = false;
+        }
+        budgetMs = setting.timeBudgetMs > 0 ? setting.timeBudgetMs : INFINITY;
+        job = std::make_unique<RenderJob>(width, height, setting, cam, world, lights);
+        job->onPass = [this](const AccumulationBuffer &film)
+        {
+            std::lock_guard<std::mutex> lock(publishedMutex);
+            published.pixels = film.pixels;
+            fresh = true;
+        };
+        job->run(setting.samplesPerPixel, budgetMs);
+    }
+    // traces count more passes on top of the ones so far, after the passes still left, with a new time budget
+    void addPasses(int count)
+    {
+        if (job) job->run(count, budgetMs);
+    }
+    // cancels the passes left and waits for the workers to leave their tiles
+    void stop()
+    {
+        if (!job) return;
+        job->cancel();
+        job->wait();
+    }
+
+    // Resolves the newest published samples into data, a width x height image, if a pass finished since the last
+    // call or always is set, and the size still matches.
+    bool present(uint32_t *data, int width, int height, const Settings &display, bool always = false)
+    {
+        std::lock_guard<std::mutex> lock(publishedMutex);
+        if (!(fresh || always) || width != published.width || height != published.height) return false;
+        resolve(published, display, data);
+        fresh = false;
+        return true;
+    }
+    bool running() const { return job && !job->done(); }
+    // passes that finished, pixels of a pass that was cut short have one sample more
+    int samples() const { return job ? job->passes() : 0; }
+    // time from the last start() or addPasses() to the end of its last pass
+    float elapsedMs() const { return job ? job->elapsedMs() : 0; }
+    bool outOfTime() const { return job && job->outOfTime(); }
+
+private:
+    std::unique_ptr<RenderJob> job;
+    float budgetMs = INFINITY;
+    // copy of the film after the last pass, for present()
+    AccumulationBuffer published;
+    std::mutex publishedMutex;
+    bool fresh = false;
+};
+
+#endif
@@ -5,6 +5,8 @@
 #include "material.h"
 #include "setting.h"
 
+#include <glm/gtc/matrix_transform.hpp>
+
 void my_example_scene(ShapeList &world, MaterialList &materials, Settings &setting, point3 &from, point3 &at)
 {
     from = point3(10, 5, -2);
@@ -32,5 +34,136 @@ void triangle_example(ShapeList &world, MaterialList &materials, Settings &setti
     setting.fov = 90;
 }
 
+void random_spheres_example(ShapeList &world, MaterialList &materials, Settings &setting, point3 &from, point3 &at)
+{
+    from = point3(13, 2, 3);
+    at = point3(0, 0, 0);
+    ThreadLocal tl;
+    tl.init(0);
+    Material *ground = materials.add<Lambertian>(col3(.5, .5, .5));
+    world.add<Sphere>(point3(0, -1000, 0), 1000, ground);
+    for (int a = -50; a < 50; a++)
+    {
+        for (int b = -50; b < 50; b++)
+        {
+            point3 center(a + 0.9f * tl.randFloat(), 0.1f, b + 0.9f * tl.randFloat());
+            float choice = tl.randFloat();
+            Material *mat;
+            if (choice < 0.8f)
+            {
+                mat = materials.add<Lambertian>(tl.randVec3() * tl.randVec3());
+            }
+            else if (choice < 0.95f)
+            {
+                mat = materials.add<Metal>(tl.randVec3(0.5f, 1), tl.randFloat(0, 0.5f));
+            }
+            else
+            {
+                mat = materials.add<Dielectric>(1.5);
+            }
+            world.add<Sphere>(center, 0.1f, mat);
+        }
+    }
+    setting.background = col3(.7, .8, 1);
+    // ten thousand small spheres, build time matters more than the last bit of traversal speed
+    setting.bvhBuilder = BVHBuilder::LBVH;
+}
+void forest_example(ShapeList &world, MaterialList &materials, Settings &setting, point3 &from, point3 &at)
+{
+    from = point3(0, 15, -60);
+    at = point3(0, 0, 0);
+    Material *ground = materials.add<Lambertian>(col3(.4, .3, .2));
+    Material *bark = materials.add<Lambertian>(col3(.3, .2, .1));
+    Material *leaves = materials.add<Lambertian>(col3(.1, .5, .1));
+    world.add<Sphere>(point3(0, -1000, 0), 1000, ground);
+
+    // one tree, every placed copy below only stores a transform
+    ShapeList *tree = world.addGroup();
+    for (int i = 0; i < 6; i++)
+    {
+        tree->add<Sphere>(point3(0, 0.25f * i, 0), 0.15f, bark);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        float angle = glm::radians(45.0f * i);
+        point3 tip(glm::cos(angle) * 1.2f, 1.2f, glm::sin(angle) * 1.2f);
+        point3 side(glm::cos(angle + 0.4f) * 1.2f, 1.4f, glm::sin(angle + 0.4f) * 1.2f);
+        tree->add<NaiveTriangle>(point3(0, 3.0f, 0), tip, side, leaves);
+        tree->add<NaiveTriangle>(point3(0, 3.0f, 0), side, tip, leaves);
+    }
+    tree->add<Sphere>(point3(0, 2.0f, 0), 0.8f, leaves);
+
+    ThreadLocal tl;
+    tl.init(0);
+    for (int i = 0; i < 10000; i++)
+    {
+        glm::mat4 transform = glm::translate(glm::mat4(1), point3(tl.randFloat(-100, 100), 0, tl.randFloat(-100, 100)));
+        transform = glm::rotate(transform, tl.randFloat(0, 6.2831f), vec3(0, 1, 0));
+        transform = glm::scale(transform, vec3(tl.randFloat(0.7f, 1.5f)));
+        world.add<Instance>(tree, transform);
+    }
+    setting.background = col3(.7, .8, 1);
+}
+void particles_example(ShapeList &world, MaterialList &materials, Settings &setting, point3 &from, point3 &at)
+{
+    from = point3(0, 5, -45);
+    at = point3(0, 5, 0);
+    Material *ground = materials.add<Lambertian>(col3(.5, .5, .5));
+    Material *dust = materials.add<Lambertian>(col3(.8, .6, .3));
+    world.add<Sphere>(point3(0, -1000, 0), 1000, ground);
+
+    // a million same sized particles spread evenly, a grid beats a tree here and builds much faster, the ground
+    // around them stays in the bvh of the world
+    ShapeList *cloud = world.addGroup();
+    cloud->accelerator = Accelerator::Grid;
+    ThreadLocal tl;
+    tl.init(0);
+    for (int i = 0; i < 1000000; i++)
+    {
+        cloud->add<Sphere>(tl.randVec3(-20, 20) + point3(0, 21, 0), 0.05f, dust);
+    }
+    world.add<Instance>(cloud, glm::mat4(1));
+    setting.background = col3(.7, .8, 1);
+}
+
+void terrain_example(ShapeList &world, MaterialList &materials, Settings &setting, point3 &from, point3 &at)
+{
+    from = point3(0, 25, -70);
+    at = point3(0, 0, 0);
+    Material *rock = materials.add<Lambertian>(col3(.5, .45, .4));
+
+    // a million triangle heightfield in one mesh, the vertex normals are the heightfield's gradient so it shades smooth
+    const int quads = 724;
+    const float size = 100, step = size / quads;
+    auto height = [](float x, float z) { return 4 * glm::sin(x * 0.15f) * glm::cos(z * 0.1f) + glm::sin(x * 0.7f + z * 0.5f); };
+    std::vector<point3> positions;
+    std::vector<vec3> normals;
+    std::vector<glm::vec2> uvs;
+    for (int j = 0; j <= quads; j++)
+    {
+        for (int i = 0; i <= quads; i++)
+        {
+            float x = i * step - size / 2, z = j * step - size / 2;
+            positions.push_back(point3(x, height(x, z), z));
+            float dx = (height(x + 0.01f, z) - height(x - 0.01f, z)) / 0.02f;
+            float dz = (height(x, z + 0.01f) - height(x, z - 0.01f)) / 0.02f;
+            normals.push_back(glm::normalize(vec3(-dx, 1, -dz)));
+            uvs.push_back(glm::vec2(float(i) / quads, float(j) / quads));
+        }
+    }
+    std::vector<uint32_t> indices;
+    indices.reserve(size_t(quads) * quads * 6);
+    for (int j = 0; j < quads; j++)
+    {
+        for (int i = 0; i < quads; i++)
+        {
+            uint32_t corner = uint32_t(j * (quads + 1) + i);
+            uint32_t quad[6] = {corner, corner + quads + 1, corner + 1, corner + 1, corner + quads + 1, corner + quads + 2};
+            indices.insert(indices.end(), quad, quad + 6);
+        }
+    }
+    world.add<TriangleMesh>(std::move(positions), std::move(indices), rock, std::move(normals), std::move(uvs));
+    setting.background = col3(.7, .8, 1);
+}
 
 #endif
\ No newline at end of file
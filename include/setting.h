@@ -1,14 +1,54 @@
 #ifndef SETTING_H
 #define SETTING_H
 
+#include "vector.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+
+#include <string>
+
+// how the paths of a frame are traced, see path_tracer.h and wavefront.h
+enum class Integrator
+{
+    Path,
+    Wavefront,
+};
+
+// curve the resolve pass maps accumulated radiance to display range with, see accumulation.h
+enum class Tonemap
+{
+    Clamp,
+    Reinhard,
+    ACES,
+};
+
 struct Settings
 {
     int samplesPerPixel = 100;
     float fov = 20.0f;
     int maxDepth = 50;
+    int rouletteDepth = 3; // hits after which russian roulette may end a path, paths run to maxDepth if this is higher
+    bool lightSampling = true; // every diffuse hit also samples a light of the LightList, see path_tracer.h
+    bool lightTree = true; // pick the light to sample through the light bvh of light.h instead of uniformly
     float EPSILON = 0.001;
     int numThreads = 12;
     col3 background{0};
+    BVHBuilder bvhBuilder = BVHBuilder::SAH;
+    BVHLayout bvhLayout = BVHLayout::Wide4;
+    float sbvhSplitBudget = 0.3f; // extra primitive references the SBVH may create, relative to the primitive count
+    float rebuildThreshold = 1.5f; // ShapeList::refit() rebuilds once the sah cost grew by this factor
+    // Built trees are stored in this directory, one file per geometry hash, builder, layout and split budget, and
+    // loaded instead of rebuilding. Nothing removes old files, so it is off (empty) unless a scene sets it.
+    std::string bvhCacheDir = "";
+    Integrator integrator = Integrator::Path;
+    int wavefrontBatchSize = 1 << 14; // paths a wavefront stage holds at once, per thread
+    float timeBudgetMs = 0; // a render stops after this long with the samples it has, 0 runs until samplesPerPixel
+    int tileSize = 16; // render threads take square tiles of this many pixels a side from a shared queue
+    int packetSize = 8; // primary rays traced together, 1 traces every ray on its own, otherwise 4, 8 or 16
+    // resolve pass only, changing these doesn't need new samples
+    float exposure = 1.0f;
+    Tonemap tonemap = Tonemap::Clamp;
+    float gamma = 2.0f;
 };
 
 #endif
\ No newline at end of file
@@ -3,10 +3,23 @@
 
 #include "ray.h"
 #include "utils.h"
+#include "aabb.h"
+#include "bvh.h"
+#include "wide_bvh.h"
+#include "grid.h"
+#include "packet.h"
+#include "sphere_simd.h"
+#include "triangle_simd.h"
+#include "bvh_cache.h"
+#include "setting.h"
 
 #include <vector>
 
+#include <glm/gtc/constants.hpp>
+
 class Material;
+class Shape;
+class PrimitiveTable;
 
 struct HitRecord
 {
@@ -16,6 +29,8 @@ struct HitRecord
     float u, v;
     bool frontFace;
     Material *material;
+    // the shape hit, for shapes inside a group the one in the group's list
+    Shape *shape = nullptr;
 
     inline void setFaceNormal(const Ray& r, const vec3& outwardNormal)
     {
@@ -28,9 +43,346 @@ struct HitRecord
 class Shape
 {
 public:
+    // lists delete their shapes through Shape pointers, meshes and instances own buffers of their own
+    virtual ~Shape() = default;
     virtual bool rayHit(const Ray& r, double t_min, double t_max, HitRecord& rec) = 0;
+    // true if anything is hit between t_min and t_max, shapes override it to skip filling a HitRecord
+    virtual bool occluded(const Ray& r, double t_min, double t_max)
+    {
+        HitRecord rec;
+        return rayHit(r, t_min, t_max, rec);
+    }
+    // Packet versions of rayHit() for ShapeList::hitPacket(), the lanes in active that hit between t_min and t_max get
+    // their t_max set to the hit and are set in the result. The defaults test the lanes one by one.
+    virtual vmask<4> rayHitPacket(const RayPacket<4> &p, const vmask<4> &active, const vfloat<4> &t_min, vfloat<4> &t_max)
+    {
+        return rayHitLanes(p, active, t_min, t_max);
+    }
+    virtual vmask<8> rayHitPacket(const RayPacket<8> &p, const vmask<8> &active, const vfloat<8> &t_min, vfloat<8> &t_max)
+    {
+        return rayHitLanes(p, active, t_min, t_max);
+    }
+    virtual vmask<16> rayHitPacket(const RayPacket<16> &p, const vmask<16> &active, const vfloat<16> &t_min, vfloat<16> &t_max)
+    {
+        return rayHitLanes(p, active, t_min, t_max);
+    }
+    virtual AABB boundingBox() const = 0;
+    // Shapes that can be sampled as lights return their material here, null for shapes that can't. sampleLight()
+    // picks a unit direction from p towards a point on the shape and the density of picking it per solid angle,
+    // lightPdf() is that density for a direction found some other way, 0 where sampleLight() never goes.
+    virtual const Material *lightMaterial() const { return nullptr; }
+    virtual bool sampleLight(const point3 & /*p*/, ThreadLocal & /*tl*/, vec3 & /*dir*/, float & /*pdf*/) const { return false; }
+    virtual float lightPdf(const point3 & /*p*/, const vec3 & /*dir*/) const { return 0; }
+    // area of the surface and a cone around the normals of every point on it, what the light bvh bounds lights by
+    virtual float surfaceArea() const { return 0; }
+    virtual void normalBounds(vec3 &axis, float &cosSpread) const
+    {
+        axis = vec3(0, 0, 1);
+        cosSpread = -1;
+    }
+    // Adds the shape to the flat arrays ShapeList traverses, shapes without their own arrays stay virtual calls
+    virtual void addPrimitive(PrimitiveTable &table);
+    // Identifies the geometry for the on disk bvh cache. The bvh only depends on the bounds unless the shape
+    // clips itself in splitBounds(), those shapes have to hash what the clipping depends on.
+    virtual uint64_t geometryHash(uint64_t seed) const
+    {
+        AABB box = boundingBox();
+        return hashBytes(&box, sizeof(box), seed);
+    }
+    // Bounds of the parts of the shape inside box on either side of the plane at pos along axis, used for spatial
+    // splits. Shapes that can't be clipped just split the box, which is always conservative.
+    virtual void splitBounds(int axis, float pos, const AABB &box, AABB &left, AABB &right) const
+    {
+        left = right = box;
+        left.max[axis] = glm::min(left.max[axis], pos);
+        right.min[axis] = glm::max(right.min[axis], pos);
+    }
+
+protected:
+    template <int W>
+    vmask<W> rayHitLanes(const RayPacket<W> &p, const vmask<W> &active, const vfloat<W> &t_min, vfloat<W> &t_max)
+    {
+        alignas(64) float tMin[W], tMax[W];
+        t_min.store(tMin);
+        t_max.store(tMax);
+        int activeBits = active.bits(), hits = 0;
+        HitRecord rec;
+        for (int i = 0; i < W; i++)
+        {
+            if (((activeBits >> i) & 1) && rayHit(p.ray(i), tMin[i], tMax[i], rec))
+            {
+                tMax[i] = rec.t;
+                hits |= 1 << i;
+            }
+        }
+        t_max = vfloat<W>::load(tMax);
+        return vmask<W>::fromBits(hits);
+    }
+};
+
+// Spheres and triangles of a ShapeList copied into one array per component, so leaves test them through a switch on
+// the type that inlines the intersection instead of a virtual call through a Shape pointer. Other shapes (e.g.
+// Instances) keep their virtual calls. ShapeList gathers it in build() and refit().
+class PrimitiveTable
+{
+public:
+    // a primitive is referenced by its type in the top two bits and its slot in that type's arrays
+    enum Type : uint32_t
+    {
+        SPHERE,
+        TRIANGLE,
+        OTHER,
+    };
+    static constexpr uint32_t TYPE_SHIFT = 30;
+    static constexpr uint32_t SLOT_MASK = (1u << TYPE_SHIFT) - 1;
+    // spheres or triangles of a leaf tested by one nearestSphere() or nearestTriangle() call
+    static constexpr int LEAF_BATCH = 16;
+
+    // closest primitive found so far, u and v are the barycentrics of triangle hits
+    struct Hit
+    {
+        uint32_t prim = 0;
+        float u = 0, v = 0;
+    };
+
+    void clear()
+    {
+        refs.clear();
+        sphereX.clear(); sphereY.clear(); sphereZ.clear(); sphereRadius.clear(); sphereMaterials.clear();
+        for (auto &vertex: triangleVertices)
+        {
+            for (auto &axis: vertex) axis.clear();
+        }
+        triangleNormals.clear(); triangleMaterials.clear();
+        others.clear();
+    }
+    void addSphere(const point3 &cen, float rad, Material *material)
+    {
+        refs.push_back(ref(SPHERE, sphereX.size()));
+        sphereX.push_back(cen.x); sphereY.push_back(cen.y); sphereZ.push_back(cen.z);
+        sphereRadius.push_back(rad);
+        sphereMaterials.push_back(material);
+    }
+    void addTriangle(const point3 &v0, const point3 &v1, const point3 &v2, const vec3 &normal, Material *material)
+    {
+        refs.push_back(ref(TRIANGLE, triangleNormals.size()));
+        const point3 *corners[3] = {&v0, &v1, &v2};
+        for (int vertex = 0; vertex < 3; vertex++)
+        {
+            for (int axis = 0; axis < 3; axis++) triangleVertices[vertex][axis].push_back((*corners[vertex])[axis]);
+        }
+        triangleNormals.push_back(normal);
+        triangleMaterials.push_back(material);
+    }
+    void addOther(Shape *shape)
+    {
+        refs.push_back(ref(OTHER, others.size()));
+        others.push_back(shape);
+    }
+    size_t size() const { return refs.size(); }
+    Type type(uint32_t prim) const { return Type(refs[prim] >> TYPE_SHIFT); }
+
+    // Closest hit test of shape prim, shrinks t_max to the hit. Other shapes fill otherRec right away, the built in
+    // types only fill a HitRecord in fillHit() once the closest hit is known.
+    inline bool intersect(uint32_t prim, const Ray &r, const WatertightRay &wr, float t_min, float &t_max, Hit &hit,
+                          HitRecord &otherRec) const
+    {
+        uint32_t slot = refs[prim] & SLOT_MASK;
+        float t, u = 0, v = 0;
+        switch (Type(refs[prim] >> TYPE_SHIFT))
+        {
+            case SPHERE:
+                if (!intersectSphere(slot, r, t_min, t_max, t)) return false;
+                break;
+            case TRIANGLE:
+                if (!intersectTriangle(slot, wr, t_min, t_max, t, u, v)) return false;
+                break;
+            default:
+            {
+                // shapes may write to rec on a miss as well
+                HitRecord rec;
+                if (!others[slot]->rayHit(r, t_min, t_max, rec)) return false;
+                otherRec = rec;
+                t = rec.t;
+                break;
+            }
+        }
+        t_max = t;
+        hit = {prim, u, v};
+        return true;
+    }
+    // intersect() for a whole leaf, the spheres and the triangles in it are tested together by nearestSphere() and
+    // nearestTriangle(). wr is r set up once per ray for the triangles.
+    inline bool intersectLeaf(const uint32_t *prims, uint32_t count, const Ray &r, const WatertightRay &wr, float t_min, float &t_max,
+                              Hit &hit, HitRecord &otherRec) const
+    {
+        bool hitAnything = false;
+        Batch spheres, triangles;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t prim = prims[i];
+            switch (type(prim))
+            {
+                case SPHERE:
+                    if (spheres.add(prim, refs[prim] & SLOT_MASK)) hitAnything |= nearestSphere(spheres, r, t_min, t_max, hit);
+                    break;
+                case TRIANGLE:
+                    if (triangles.add(prim, refs[prim] & SLOT_MASK)) hitAnything |= nearestTriangle(triangles, wr, t_min, t_max, hit);
+                    break;
+                default:
+                    hitAnything |= intersect(prim, r, wr, t_min, t_max, hit, otherRec);
+                    break;
+            }
+        }
+        hitAnything |= nearestSphere(spheres, r, t_min, t_max, hit);
+        hitAnything |= nearestTriangle(triangles, wr, t_min, t_max, hit);
+        return hitAnything;
+    }
+    inline bool occludedLeaf(const uint32_t *prims, uint32_t count, const Ray &r, const WatertightRay &wr, float t_min, float t_max) const
+    {
+        Batch spheres, triangles;
+        Hit hit;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t prim = prims[i];
+            switch (type(prim))
+            {
+                case SPHERE:
+                    if (spheres.add(prim, refs[prim] & SLOT_MASK) && nearestSphere(spheres, r, t_min, t_max, hit)) return true;
+                    break;
+                case TRIANGLE:
+                    if (triangles.add(prim, refs[prim] & SLOT_MASK) && nearestTriangle(triangles, wr, t_min, t_max, hit)) return true;
+                    break;
+                default:
+                    if (others[refs[prim] & SLOT_MASK]->occluded(r, t_min, t_max)) return true;
+                    break;
+            }
+        }
+        return nearestSphere(spheres, r, t_min, t_max, hit) || nearestTriangle(triangles, wr, t_min, t_max, hit);
+    }
+    template <int W>
+    inline vmask<W> intersectPacket(uint32_t prim, const RayPacket<W> &p, const WatertightPacket<W> &wp, const vmask<W> &active,
+                                    const vfloat<W> &t_min, vfloat<W> &t_max) const
+    {
+        uint32_t slot = refs[prim] & SLOT_MASK;
+        switch (Type(refs[prim] >> TYPE_SHIFT))
+        {
+            case SPHERE:
+                return intersectSpherePacket(point3(sphereX[slot], sphereY[slot], sphereZ[slot]), sphereRadius[slot], p, active, t_min, t_max);
+            case TRIANGLE:
+                return intersectTrianglePacket(triangleVertex(0, slot), triangleVertex(1, slot), triangleVertex(2, slot), wp, active, t_min, t_max);
+            default:
+                return others[slot]->rayHitPacket(p, active, t_min, t_max);
+        }
+    }
+    // fills rec for the closest hit intersect() found at t, otherRec is what it filled for other shapes
+    void fillHit(const Hit &hit, const Ray &r, float t, const HitRecord &otherRec, HitRecord &rec) const
+    {
+        uint32_t slot = refs[hit.prim] & SLOT_MASK;
+        switch (Type(refs[hit.prim] >> TYPE_SHIFT))
+        {
+            case SPHERE:
+            {
+                rec.t = t;
+                rec.p = r.at(t);
+                vec3 outwardNormal = (rec.p - point3(sphereX[slot], sphereY[slot], sphereZ[slot])) / sphereRadius[slot];
+                rec.setFaceNormal(r, outwardNormal);
+                rec.material = sphereMaterials[slot];
+                break;
+            }
+            case TRIANGLE:
+                rec.t = t;
+                rec.p = r.at(t);
+                rec.u = hit.u;
+                rec.v = hit.v;
+                rec.setFaceNormal(r, triangleNormals[slot]);
+                rec.material = triangleMaterials[slot];
+                break;
+            default:
+                rec = otherRec;
+                break;
+        }
+    }
+    Shape *other(uint32_t prim) const { return others[refs[prim] & SLOT_MASK]; }
+
+private:
+    // primitives of one type waiting in a leaf for the batched test
+    struct Batch
+    {
+        uint32_t prims[LEAF_BATCH], slots[LEAF_BATCH];
+        int count = 0;
+
+        // true once the batch is full
+        bool add(uint32_t prim, uint32_t slot)
+        {
+            prims[count] = prim;
+            slots[count++] = slot;
+            return count == LEAF_BATCH;
+        }
+    };
+
+    static uint32_t ref(Type type, size_t slot)
+    {
+        return (uint32_t(type) << TYPE_SHIFT) | uint32_t(slot);
+    }
+    inline bool intersectSphere(uint32_t slot, const Ray &r, float t_min, float t_max, float &root) const
+    {
+        return ::intersectSphere(point3(sphereX[slot], sphereY[slot], sphereZ[slot]), sphereRadius[slot], r, t_min, t_max, root);
+    }
+    inline bool intersectTriangle(uint32_t slot, const WatertightRay &wr, float t_min, float t_max, float &t, float &u, float &v) const
+    {
+        return ::intersectTriangle(triangleVertex(0, slot), triangleVertex(1, slot), triangleVertex(2, slot), wr, t_min, t_max, t, u, v);
+    }
+    point3 triangleVertex(int vertex, uint32_t slot) const
+    {
+        return point3(triangleVertices[vertex][0][slot], triangleVertices[vertex][1][slot], triangleVertices[vertex][2][slot]);
+    }
+    // test and empty a batch, shrinks t_max and sets hit if something in it is closer
+    inline bool nearestSphere(Batch &batch, const Ray &r, float t_min, float &t_max, Hit &hit) const
+    {
+        if (batch.count == 0) return false;
+        SphereSoA soa = {sphereX.data(), sphereY.data(), sphereZ.data(), sphereRadius.data()};
+        float t;
+        int nearest = ::nearestSphere(soa, batch.slots, batch.count, r, t_min, t_max, t);
+        batch.count = 0;
+        if (nearest < 0) return false;
+        t_max = t;
+        hit = {batch.prims[nearest], 0, 0};
+        return true;
+    }
+    inline bool nearestTriangle(Batch &batch, const WatertightRay &wr, float t_min, float &t_max, Hit &hit) const
+    {
+        if (batch.count == 0) return false;
+        TriangleSoA soa;
+        for (int vertex = 0; vertex < 3; vertex++)
+        {
+            for (int axis = 0; axis < 3; axis++) soa.v[vertex][axis] = triangleVertices[vertex][axis].data();
+        }
+        float t, u, v;
+        int nearest = ::nearestTriangle(soa, batch.slots, batch.count, wr, t_min, t_max, t, u, v);
+        batch.count = 0;
+        if (nearest < 0) return false;
+        t_max = t;
+        hit = {batch.prims[nearest], u, v};
+        return true;
+    }
+
+    std::vector<uint32_t> refs;
+    std::vector<float> sphereX, sphereY, sphereZ, sphereRadius;
+    std::vector<Material*> sphereMaterials;
+    // corner, then axis
+    std::vector<float> triangleVertices[3][3];
+    // unit length, facing the side the corners wind counterclockwise around
+    std::vector<vec3> triangleNormals;
+    std::vector<Material*> triangleMaterials;
+    std::vector<Shape*> others;
 };
 
+inline void Shape::addPrimitive(PrimitiveTable &table)
+{
+    table.addOther(this);
+}
+
 class ShapeList
 {
 public:
@@ -41,13 +393,248 @@ public:
         {
             delete shape;
         }
+        for (auto group: groups)
+        {
+            delete group;
+        }
     }
     template <typename T, typename... Args>
-    void add(Args&&... args)
+    T* add(Args&&... args)
+    {
+        T* p_shape = new T(std::forward<Args>(args)...);
+        shapes.push_back(p_shape);
+        built = false;
+        return p_shape;
+    }
+    // A list of shapes owned by this one that isn't hit directly, it is placed in the scene through Instances.
+    // Every instance shares the group's geometry and bvh.
+    ShapeList* addGroup()
+    {
+        ShapeList* group = new ShapeList();
+        groups.push_back(group);
+        return group;
+    }
+    // has to be called after the scene is set up and before rendering, hit() falls back to a linear scan otherwise
+    void build(const Settings &setting)
+    {
+        for (auto group: groups)
+        {
+            group->build(setting);
+        }
+        if (setting.bvhCacheDir.empty() || shapes.empty() || accelerator != Accelerator::BVH)
+        {
+            buildTopLevel(setting);
+            return;
+        }
+
+        uint64_t key = cacheKey(setting);
+        std::string path = bvhCachePath(setting.bvhCacheDir, key);
+        if (loadBVHCache(path, key, setting.bvhLayout, cacheFile, bvh, bvh4, bvh8, qbvh4, qbvh8, buildCost))
+        {
+            gatherPrimitives();
+            grid = Grid();
+            builtAccelerator = Accelerator::BVH;
+            layout = setting.bvhLayout;
+            built = true;
+            return;
+        }
+        buildTopLevel(setting);
+        saveBVHCache(path, key, layout, bvh, bvh4, bvh8, qbvh4, qbvh8, buildCost);
+    }
+    // only rebuilds the bvh over this list's own shapes, enough after moving instances around
+    void buildTopLevel(const Settings &setting)
+    {
+        std::vector<AABB> primBounds = shapeBounds(setting.numThreads);
+        gatherPrimitives();
+        builtAccelerator = accelerator;
+        if (accelerator != Accelerator::BVH)
+        {
+            grid.build(primBounds, setting.numThreads, accelerator == Accelerator::TwoLevelGrid);
+            bvh = BVH();
+            clearWideTrees();
+            built = true;
+            cacheFile.close();
+            return;
+        }
+        grid = Grid();
+        switch (setting.bvhBuilder)
+        {
+            case BVHBuilder::SAH:  bvh.build(primBounds); break;
+            case BVHBuilder::LBVH: bvh.buildLBVH(primBounds, setting.numThreads); break;
+            case BVHBuilder::SBVH:
+                bvh.buildSBVH(primBounds, [&](uint32_t prim, int axis, float pos, const AABB &box, AABB &left, AABB &right)
+                {
+                    shapes[prim]->splitBounds(axis, pos, box, left, right);
+                }, setting.sbvhSplitBudget);
+                break;
+        }
+        layout = setting.bvhLayout;
+        clearWideTrees();
+        switch (layout)
+        {
+            case BVHLayout::Binary:         break;
+            case BVHLayout::Wide4:          bvh4.build(bvh); break;
+            case BVHLayout::Wide8:          bvh8.build(bvh); break;
+            case BVHLayout::Wide4Quantized: qbvh4.build(bvh); break;
+            case BVHLayout::Wide8Quantized: qbvh8.build(bvh); break;
+        }
+        buildCost = bvh.sahCost();
+        built = true;
+        // nothing points into a previously loaded cache anymore
+        cacheFile.close();
+    }
+    // For shapes that moved in place (e.g. Sphere::cen changed between frames), updates the bounds of the
+    // existing trees instead of rebuilding them. Falls back to a full rebuild once the tree got too much worse
+    // than it was when built, returns true in that case.
+    bool refit(const Settings &setting)
+    {
+        if (!built)
+        {
+            build(setting);
+            return true;
+        }
+        bool rebuilt = false;
+        for (auto group: groups)
+        {
+            rebuilt |= group->refit(setting);
+        }
+        // grids can't be refit but rebuild in linear time
+        if (builtAccelerator != Accelerator::BVH)
+        {
+            buildTopLevel(setting);
+            return true;
+        }
+
+        std::vector<AABB> primBounds = shapeBounds(setting.numThreads);
+        gatherPrimitives();
+        bvh.refit(primBounds, setting.numThreads);
+        if (bvh.sahCost() > buildCost * setting.rebuildThreshold)
+        {
+            buildTopLevel(setting);
+            return true;
+        }
+        switch (layout)
+        {
+            case BVHLayout::Binary:         break;
+            case BVHLayout::Wide4:          bvh4.refit(primBounds, setting.numThreads); break;
+            case BVHLayout::Wide8:          bvh8.refit(primBounds, setting.numThreads); break;
+            case BVHLayout::Wide4Quantized: qbvh4.refit(primBounds, setting.numThreads); break;
+            case BVHLayout::Wide8Quantized: qbvh8.refit(primBounds, setting.numThreads); break;
+        }
+        return rebuilt;
+    }
+    bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec, TraversalStats *stats = nullptr)
     {
-        shapes.push_back(new T(std::forward<Args>(args)...));
+        if (!built)
+        {
+            return hitLinear(r, t_min, t_max, rec);
+        }
+        if (builtAccelerator != Accelerator::BVH)
+        {
+            return hit(grid, r, t_min, t_max, rec, stats);
+        }
+        switch (layout)
+        {
+            case BVHLayout::Wide4:          return hit(bvh4, r, t_min, t_max, rec, stats);
+            case BVHLayout::Wide8:          return hit(bvh8, r, t_min, t_max, rec, stats);
+            case BVHLayout::Wide4Quantized: return hit(qbvh4, r, t_min, t_max, rec, stats);
+            case BVHLayout::Wide8Quantized: return hit(qbvh8, r, t_min, t_max, rec, stats);
+            default:                        return hit(bvh, r, t_min, t_max, rec, stats);
+        }
     }
-    bool hit(const Ray& r, double t_min, double t_max, HitRecord& rec)
+    // Closest hits of W rays at once for the lanes set in active, recs[i] is filled for every lane set in the result.
+    // Packets traverse the binary bvh, which is there for every bvh layout, the grids trace the lanes one by one.
+    template <int W>
+    int hitPacket(const RayPacket<W> &packet, int active, double t_min, double t_max, HitRecord *recs, TraversalStats *stats = nullptr)
+    {
+        int hits = 0;
+        if (!built || builtAccelerator != Accelerator::BVH)
+        {
+            for (int i = 0; i < W; i++)
+            {
+                if (((active >> i) & 1) && hit(packet.ray(i), t_min, t_max, recs[i], stats)) hits |= 1 << i;
+            }
+            return hits;
+        }
+
+        uint32_t closest[W];
+        vfloat<W> tMin(static_cast<float>(t_min)), tMax(static_cast<float>(t_max));
+        WatertightPacket<W> watertight(packet);
+        bvh.traversePacket(packet, vmask<W>::fromBits(active), tMin, tMax, [&](uint32_t prim, const vmask<W> &mask, vfloat<W> &laneMax)
+        {
+            int hit = primitives.intersectPacket(prim, packet, watertight, mask, tMin, laneMax).bits();
+            hits |= hit;
+            for (int i = 0; i < W; i++)
+            {
+                if ((hit >> i) & 1) closest[i] = prim;
+            }
+        }, stats);
+
+        // Only the closest shape and t of every lane are known. Triangles redo their scalar test for the barycentrics,
+        // it is the same test the packet ran so it hits at the same t. Other shapes redo it to fill their HitRecord.
+        alignas(64) float tHit[W];
+        tMax.store(tHit);
+        HitRecord otherRec;
+        for (int i = 0; i < W; i++)
+        {
+            if (!((hits >> i) & 1)) continue;
+            Ray r = packet.ray(i);
+            PrimitiveTable::Type type = primitives.type(closest[i]);
+            if (type == PrimitiveTable::SPHERE)
+            {
+                primitives.fillHit({closest[i], 0, 0}, r, tHit[i], otherRec, recs[i]);
+                recs[i].shape = shapes[closest[i]];
+                continue;
+            }
+            if (type == PrimitiveTable::TRIANGLE)
+            {
+                PrimitiveTable::Hit triangleHit;
+                float t = tHit[i];
+                if (primitives.intersect(closest[i], r, watertight.lane(i), t_min, t, triangleHit, otherRec))
+                {
+                    primitives.fillHit(triangleHit, r, t, otherRec, recs[i]);
+                    recs[i].shape = shapes[closest[i]];
+                }
+                else if (!hit(r, t_min, t_max, recs[i]))
+                {
+                    hits &= ~(1 << i);
+                }
+                continue;
+            }
+            float slack = glm::abs(tHit[i]) * 1e-4f;
+            if (!primitives.other(closest[i])->rayHit(r, t_min, tHit[i] + slack, recs[i]) && !hit(r, t_min, t_max, recs[i]))
+            {
+                hits &= ~(1 << i);
+            }
+        }
+        return hits;
+    }
+    // Any hit query for shadow and ambient occlusion rays, stops at the first shape found between t_min and t_max
+    // instead of searching for the closest one and never fills a HitRecord.
+    bool occluded(const Ray& r, double t_min, double t_max, TraversalStats *stats = nullptr)
+    {
+        if (!built)
+        {
+            for (auto shape: shapes)
+            {
+                if (shape->occluded(r, t_min, t_max)) return true;
+            }
+            return false;
+        }
+        if (builtAccelerator != Accelerator::BVH)
+        {
+            return occluded(grid, r, t_min, t_max, stats);
+        }
+        switch (layout)
+        {
+            case BVHLayout::Wide4:          return occluded(bvh4, r, t_min, t_max, stats);
+            case BVHLayout::Wide8:          return occluded(bvh8, r, t_min, t_max, stats);
+            case BVHLayout::Wide4Quantized: return occluded(qbvh4, r, t_min, t_max, stats);
+            case BVHLayout::Wide8Quantized: return occluded(qbvh8, r, t_min, t_max, stats);
+            default:                        return occluded(bvh, r, t_min, t_max, stats);
+        }
+    }
+    bool hitLinear(const Ray& r, double t_min, double t_max, HitRecord& rec)
     {
         HitRecord tempRec;
         bool hitAnything = false;
@@ -65,7 +652,137 @@ public:
 
         return hitAnything;
     }
+    AABB boundingBox() const
+    {
+        if (built && !bvh.empty())
+        {
+            return bvh.nodes[0].bounds;
+        }
+        if (built && !grid.empty())
+        {
+            return grid.bounds();
+        }
+        AABB box;
+        for (auto shape: shapes)
+        {
+            box.grow(shape->boundingBox());
+        }
+        return box;
+    }
     std::vector<Shape*> shapes;
+    std::vector<ShapeList*> groups;
+    BVH bvh;
+    WideBVH<4> bvh4;
+    WideBVH<8> bvh8;
+    QuantizedWideBVH<4> qbvh4;
+    QuantizedWideBVH<8> qbvh8;
+    Grid grid;
+    // picked per list, e.g. a grid for a group of evenly spread particles inside a scene that otherwise uses a bvh
+    Accelerator accelerator = Accelerator::BVH;
+    // bytes used by the nodes of the tree that is traversed
+    size_t nodeMemory() const
+    {
+        switch (layout)
+        {
+            case BVHLayout::Wide4:          return bvh4.nodes.size() * sizeof(bvh4.nodes[0]);
+            case BVHLayout::Wide8:          return bvh8.nodes.size() * sizeof(bvh8.nodes[0]);
+            case BVHLayout::Wide4Quantized: return qbvh4.nodes.size() * sizeof(qbvh4.nodes[0]);
+            case BVHLayout::Wide8Quantized: return qbvh8.nodes.size() * sizeof(qbvh8.nodes[0]);
+            default:                        return bvh.nodes.size() * sizeof(bvh.nodes[0]);
+        }
+    }
+
+private:
+    // only the tree for the current layout is kept
+    void clearWideTrees()
+    {
+        bvh4.nodes.clear();
+        bvh4.primIndices.clear();
+        bvh8.nodes.clear();
+        bvh8.primIndices.clear();
+        qbvh4.nodes.clear();
+        qbvh4.primIndices.clear();
+        qbvh8.nodes.clear();
+        qbvh8.primIndices.clear();
+    }
+
+    // everything the built trees depend on
+    uint64_t cacheKey(const Settings &setting) const
+    {
+        uint32_t version = BVHCacheHeader::VERSION;
+        uint64_t key = hashBytes(&version, sizeof(version));
+        key = hashBytes(&setting.bvhBuilder, sizeof(setting.bvhBuilder), key);
+        key = hashBytes(&setting.bvhLayout, sizeof(setting.bvhLayout), key);
+        key = hashBytes(&setting.sbvhSplitBudget, sizeof(setting.sbvhSplitBudget), key);
+        uint64_t count = shapes.size();
+        key = hashBytes(&count, sizeof(count), key);
+        for (auto shape: shapes)
+        {
+            key = shape->geometryHash(key);
+        }
+        return key;
+    }
+
+    std::vector<AABB> shapeBounds(int numThreads) const
+    {
+        std::vector<AABB> primBounds(shapes.size());
+        if (shapes.size() < 4096) numThreads = 1;
+        parallelForRange(numThreads, shapes.size(), [&](size_t begin, size_t end, int)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                primBounds[i] = shapes[i]->boundingBox();
+            }
+        });
+        return primBounds;
+    }
+
+    void gatherPrimitives()
+    {
+        primitives.clear();
+        for (auto shape: shapes)
+        {
+            shape->addPrimitive(primitives);
+        }
+    }
+
+    template <typename Accel>
+    bool hit(const Accel& accel, const Ray& r, double t_min, double t_max, HitRecord& rec, TraversalStats *stats)
+    {
+        HitRecord otherRec;
+        PrimitiveTable::Hit closest;
+        WatertightRay wr(r);
+        float closestSoFar = t_max;
+        bool hitAnything = accel.traverse(r, t_min, closestSoFar, [&](const uint32_t *prims, uint32_t count, float &closestT)
+        {
+            return primitives.intersectLeaf(prims, count, r, wr, t_min, closestT, closest, otherRec);
+        }, stats);
+        if (hitAnything)
+        {
+            primitives.fillHit(closest, r, closestSoFar, otherRec, rec);
+            if (primitives.type(closest.prim) != PrimitiveTable::OTHER) rec.shape = shapes[closest.prim];
+        }
+        return hitAnything;
+    }
+
+    template <typename Accel>
+    bool occluded(const Accel& accel, const Ray& r, double t_min, double t_max, TraversalStats *stats)
+    {
+        float tMax = t_max;
+        WatertightRay wr(r);
+        return accel.template traverse<true>(r, t_min, tMax, [&](const uint32_t *prims, uint32_t count, float &)
+        {
+            return primitives.occludedLeaf(prims, count, r, wr, t_min, t_max);
+        }, stats);
+    }
+
+    PrimitiveTable primitives;
+
+    bool built = false;
+    float buildCost = 0;
+    MappedFile cacheFile;
+    Accelerator builtAccelerator = Accelerator::BVH;
+    BVHLayout layout = BVHLayout::Binary;
 };
 
 class Sphere : public Shape
@@ -75,34 +792,90 @@ public:
     Sphere(point3 &c, float r, Material *material) : cen(c), rad(r), material(material) {}
     bool rayHit(const Ray& r, double t_min, double t_max, HitRecord& rec) override
     {
-        vec3 oc = r.origin - cen;
-        float a = glm::length2(r.direction);
-        float half_b = glm::dot(oc, r.direction);
-        float c = glm::length2(oc) - (rad * rad);
-
-        float dis = (half_b * half_b) - (a * c);
-        if (dis < 0) return false;
-
-        float sqrtd = glm::sqrt(dis);
-        float root = (-half_b - sqrtd) / a;
-        if (root < t_min || t_max < root)
-        {
-            root = (-half_b + sqrtd) / a;
-            if (root < t_min || t_max < root)
-                return false;
-        }
+        float root;
+        if (!intersect(r, t_min, t_max, root)) return false;
 
         rec.t = root;
         rec.p = r.at(root);
         vec3 outwardNormal = (rec.p - cen) / rad;
         rec.setFaceNormal(r, outwardNormal);
         rec.material = material;
+        rec.shape = this;
         return true;
 
     }
+    bool occluded(const Ray& r, double t_min, double t_max) override
+    {
+        float root;
+        return intersect(r, t_min, t_max, root);
+    }
+    vmask<4> rayHitPacket(const RayPacket<4> &p, const vmask<4> &active, const vfloat<4> &t_min, vfloat<4> &t_max) override
+    {
+        return intersectSpherePacket(cen, rad, p, active, t_min, t_max);
+    }
+    vmask<8> rayHitPacket(const RayPacket<8> &p, const vmask<8> &active, const vfloat<8> &t_min, vfloat<8> &t_max) override
+    {
+        return intersectSpherePacket(cen, rad, p, active, t_min, t_max);
+    }
+    vmask<16> rayHitPacket(const RayPacket<16> &p, const vmask<16> &active, const vfloat<16> &t_min, vfloat<16> &t_max) override
+    {
+        return intersectSpherePacket(cen, rad, p, active, t_min, t_max);
+    }
+    AABB boundingBox() const override
+    {
+        vec3 r = vec3(glm::abs(rad));
+        return AABB(cen - r, cen + r);
+    }
+    void addPrimitive(PrimitiveTable &table) override
+    {
+        table.addSphere(cen, rad, material);
+    }
+    const Material *lightMaterial() const override
+    {
+        return material;
+    }
+    // uniform over the cone of directions the sphere covers seen from p, nothing from inside
+    bool sampleLight(const point3 &p, ThreadLocal &tl, vec3 &dir, float &pdf) const override
+    {
+        float coneSize;
+        if (!visibleCone(p, coneSize)) return false;
+        vec3 w = glm::normalize(cen - p), a, b;
+        orthonormalBasis(w, a, b);
+        float cosTheta = 1 - tl.randFloat() * coneSize;
+        float sinTheta = glm::sqrt(glm::max(0.0f, 1 - cosTheta * cosTheta));
+        float phi = 2 * glm::pi<float>() * tl.randFloat();
+        dir = glm::normalize(a * (glm::cos(phi) * sinTheta) + b * (glm::sin(phi) * sinTheta) + w * cosTheta);
+        pdf = 1 / (2 * glm::pi<float>() * coneSize);
+        return true;
+    }
+    float surfaceArea() const override
+    {
+        return 4 * glm::pi<float>() * rad * rad;
+    }
+    float lightPdf(const point3 &p, const vec3 &dir) const override
+    {
+        float coneSize, root;
+        if (!visibleCone(p, coneSize) || !intersect(Ray(p, dir), 0, INFINITY, root)) return 0;
+        return 1 / (2 * glm::pi<float>() * coneSize);
+    }
+    bool intersect(const Ray& r, float t_min, float t_max, float &root) const
+    {
+        return intersectSphere(cen, rad, r, t_min, t_max, root);
+    }
     point3 cen;
     float rad;
     Material *material;
+
+private:
+    // 1 - cos of the half angle the sphere covers seen from p, written so it stays precise for small far spheres
+    bool visibleCone(const point3 &p, float &coneSize) const
+    {
+        float dist2 = glm::dot(cen - p, cen - p), rad2 = rad * rad;
+        if (dist2 <= rad2) return false;
+        float sin2 = rad2 / dist2;
+        coneSize = sin2 / (1 + glm::sqrt(1 - sin2));
+        return true;
+    }
 };
 
 class NaiveTriangle : public Shape
@@ -110,53 +883,315 @@ class NaiveTriangle : public Shape
 public:
     NaiveTriangle(point3 v0, point3 v1, point3 v2, Material *material) : v0(v0), v1(v1), v2(v2), material(material)
     {
-        normal = glm::cross(v1 - v0, v2 - v0);
+        normal = glm::normalize(glm::cross(v1 - v0, v2 - v0));
     }
 
+    // two sided, u and v are the barycentric weights of v1 and v2
     bool rayHit(const Ray& r, double t_min, double t_max, HitRecord& rec) override
     {
-        float thit, t, u, v;
+        float t, u, v;
+        if (!intersect(r, t_min, t_max, t, u, v)) return false;
 
-        vec3 v0v1 = v1 - v0;
-        vec3 v0v2 = v2 - v0;
-        
-        vec3 pvec = glm::cross(r.direction, v0v2);
-        
-        float det = glm::dot(pvec, v0v1);
-        float kEpsilon = 0.00001;
-
-        if (det < kEpsilon) return false;
-
-        float invDet = 1 / det;
-        
-        vec3 tvec = r.origin - v0;
-        u = glm::dot(tvec, pvec) * invDet;
-        
-        if (u < 0 || u > 1) return false;
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.u = u;
+        rec.v = v;
+        rec.setFaceNormal(r, normal);
+        rec.material = material;
+        rec.shape = this;
+        return true;
+    }
+    bool occluded(const Ray& r, double t_min, double t_max) override
+    {
+        float t, u, v;
+        return intersect(r, t_min, t_max, t, u, v);
+    }
+    const Material *lightMaterial() const override
+    {
+        return material;
+    }
+    // uniform over the area, converted to solid angle seen from p
+    bool sampleLight(const point3 &p, ThreadLocal &tl, vec3 &dir, float &pdf) const override
+    {
+        float a = glm::sqrt(tl.randFloat()), b = tl.randFloat();
+        point3 q = v0 * (1 - a) + v1 * (a * (1 - b)) + v2 * (a * b);
+        float dist2 = glm::dot(q - p, q - p);
+        if (dist2 == 0) return false;
+        dir = (q - p) / glm::sqrt(dist2);
+        pdf = solidAnglePdf(dir, dist2);
+        return pdf > 0;
+    }
+    float lightPdf(const point3 &p, const vec3 &dir) const override
+    {
+        float t, u, v;
+        if (!intersect(Ray(p, dir), 0, INFINITY, t, u, v)) return 0;
+        float length2 = glm::dot(dir, dir);
+        return solidAnglePdf(dir / glm::sqrt(length2), t * t * length2);
+    }
+    float surfaceArea() const override
+    {
+        return 0.5f * glm::length(glm::cross(v1 - v0, v2 - v0));
+    }
+    void normalBounds(vec3 &axis, float &cosSpread) const override
+    {
+        axis = normal;
+        cosSpread = 1;
+    }
+    vmask<4> rayHitPacket(const RayPacket<4> &p, const vmask<4> &active, const vfloat<4> &t_min, vfloat<4> &t_max) override
+    {
+        return intersectTrianglePacket(v0, v1, v2, p, active, t_min, t_max);
+    }
+    vmask<8> rayHitPacket(const RayPacket<8> &p, const vmask<8> &active, const vfloat<8> &t_min, vfloat<8> &t_max) override
+    {
+        return intersectTrianglePacket(v0, v1, v2, p, active, t_min, t_max);
+    }
+    vmask<16> rayHitPacket(const RayPacket<16> &p, const vmask<16> &active, const vfloat<16> &t_min, vfloat<16> &t_max) override
+    {
+        return intersectTrianglePacket(v0, v1, v2, p, active, t_min, t_max);
+    }
+    bool intersect(const Ray& r, float t_min, float t_max, float &t, float &u, float &v) const
+    {
+        return intersectTriangle(v0, v1, v2, WatertightRay(r), t_min, t_max, t, u, v);
+    }
+    AABB boundingBox() const override
+    {
+        AABB box;
+        box.grow(v0);
+        box.grow(v1);
+        box.grow(v2);
+        return box;
+    }
+    void addPrimitive(PrimitiveTable &table) override
+    {
+        table.addTriangle(v0, v1, v2, normal, material);
+    }
+    uint64_t geometryHash(uint64_t seed) const override
+    {
+        seed = hashBytes(&v0, sizeof(v0), seed);
+        seed = hashBytes(&v1, sizeof(v1), seed);
+        return hashBytes(&v2, sizeof(v2), seed);
+    }
+    // clips the triangle against the plane instead of the box, so long diagonal triangles shrink on both sides
+    void splitBounds(int axis, float pos, const AABB &box, AABB &left, AABB &right) const override
+    {
+        left = right = AABB();
+        const point3 *verts[3] = {&v0, &v1, &v2};
+        for (int i = 0; i < 3; i++)
+        {
+            const point3 &a = *verts[i];
+            const point3 &b = *verts[(i + 1) % 3];
+            if (a[axis] <= pos) left.grow(a);
+            if (a[axis] >= pos) right.grow(a);
+            if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos))
+            {
+                point3 p = glm::mix(a, b, (pos - a[axis]) / (b[axis] - a[axis]));
+                p[axis] = pos;
+                left.grow(p);
+                right.grow(p);
+            }
+        }
+        left = left.intersection(box);
+        right = right.intersection(box);
+    }
 
-        vec3 qvec = glm::cross(tvec, v0v1);
-        v = glm::dot(r.direction, qvec) * invDet;
-        if (v < 0 || u + v > 1) return false;
+private:
+    // density per solid angle of a point picked uniformly on the triangle, seen at dist2 along unit direction dir
+    float solidAnglePdf(const vec3 &dir, float dist2) const
+    {
+        float cosine = glm::abs(glm::dot(normal, dir));
+        return cosine > 0 ? dist2 / (surfaceArea() * cosine) : 0;
+    }
 
-        t = glm::dot(v0v2, qvec) * invDet;
+    point3 v0, v1, v2;
+    vec3 normal;
+    Material *material;
+};
 
-        if (t < 0) return false;// std::cout << t << std::endl;
+// Triangles sharing one vertex buffer, every triangle is three indices into it. Normals and uvs are optional and per
+// vertex, hits interpolate them for smooth shading and texturing. The mesh goes into a ShapeList as one shape and keeps
+// its own bvh over its triangles, so a million triangles cost 12 bytes of indices each plus the shared vertices
+// instead of a NaiveTriangle object and a pointer each.
+class TriangleMesh : public Shape
+{
+public:
+    TriangleMesh(std::vector<point3> positions, std::vector<uint32_t> indices, Material *material, std::vector<vec3> normals = {},
+                 std::vector<glm::vec2> uvs = {})
+        : positions(std::move(positions)), indices(std::move(indices)), normals(std::move(normals)), uvs(std::move(uvs)),
+          material(material)
+    {
+        std::vector<AABB> triangleBounds(triangleCount());
+        for (uint32_t triangle = 0; triangle < triangleBounds.size(); triangle++)
+        {
+            for (int corner = 0; corner < 3; corner++)
+            {
+                triangleBounds[triangle].grow(vertex(triangle, corner));
+            }
+        }
+        bvh.build(triangleBounds);
+    }
 
-        rec.p = r.at(t);
+    bool rayHit(const Ray& r, double t_min, double t_max, HitRecord& rec) override
+    {
+        WatertightRay wr(r);
+        uint32_t hitTriangle = 0;
+        float closest = t_max, u = 0, v = 0;
+        bool hitAnything = bvh.traverse(r, t_min, closest, [&](const uint32_t *triangles, uint32_t count, float &tMax)
+        {
+            return nearestInLeaf(triangles, count, wr, t_min, tMax, hitTriangle, u, v);
+        });
+        if (!hitAnything) return false;
 
-        rec.t = t;
-        rec.normal = normal;
+        point3 p0 = vertex(hitTriangle, 0), p1 = vertex(hitTriangle, 1), p2 = vertex(hitTriangle, 2);
+        rec.t = closest;
+        rec.p = r.at(closest);
+        // the side is decided by the flat normal, the interpolated one only shades
+        vec3 flatNormal = glm::normalize(glm::cross(p1 - p0, p2 - p0));
+        rec.frontFace = glm::dot(r.direction, flatNormal) < 0;
+        vec3 shadingNormal = flatNormal;
+        if (!normals.empty())
+        {
+            shadingNormal = glm::normalize(interpolate(normals, hitTriangle, u, v));
+        }
+        rec.normal = rec.frontFace ? shadingNormal : -shadingNormal;
+        glm::vec2 uv = uvs.empty() ? glm::vec2(u, v) : interpolate(uvs, hitTriangle, u, v);
+        rec.u = uv.x;
+        rec.v = uv.y;
         rec.material = material;
-	
+        rec.shape = this;
         return true;
     }
-
+    bool occluded(const Ray& r, double t_min, double t_max) override
+    {
+        WatertightRay wr(r);
+        uint32_t hitTriangle;
+        float tMax = t_max, u, v;
+        return bvh.traverse<true>(r, t_min, tMax, [&](const uint32_t *triangles, uint32_t count, float &leafMax)
+        {
+            return nearestInLeaf(triangles, count, wr, t_min, leafMax, hitTriangle, u, v);
+        });
+    }
+    AABB boundingBox() const override
+    {
+        return bvh.empty() ? AABB() : bvh.nodes[0].bounds;
+    }
+    uint64_t geometryHash(uint64_t seed) const override
+    {
+        seed = hashBytes(positions.data(), positions.size() * sizeof(point3), seed);
+        return hashBytes(indices.data(), indices.size() * sizeof(uint32_t), seed);
+    }
+    size_t triangleCount() const { return indices.size() / 3; }
+    // bytes of the buffers and the mesh's bvh
+    size_t memory() const
+    {
+        return positions.size() * sizeof(point3) + indices.size() * sizeof(uint32_t) + normals.size() * sizeof(vec3) +
+               uvs.size() * sizeof(glm::vec2) + bvh.nodes.size() * sizeof(BVHNode) + bvh.primIndices.size() * sizeof(uint32_t);
+    }
 
 private:
-    point3 v0, v1, v2;
-    vec3 normal;
+    // triangles of a leaf copied out of the shared buffers per nearestTriangle() call
+    static constexpr int LEAF_BATCH = 8;
+
+    const point3 &vertex(uint32_t triangle, int corner) const
+    {
+        return positions[indices[3 * triangle + corner]];
+    }
+    template <typename T>
+    T interpolate(const std::vector<T> &attribute, uint32_t triangle, float u, float v) const
+    {
+        return (1 - u - v) * attribute[indices[3 * triangle]] + u * attribute[indices[3 * triangle + 1]] +
+               v * attribute[indices[3 * triangle + 2]];
+    }
+    bool nearestInLeaf(const uint32_t *triangles, uint32_t count, const WatertightRay &wr, float t_min, float &t_max, uint32_t &hitTriangle,
+                       float &hitU, float &hitV) const
+    {
+        static const uint32_t slots[LEAF_BATCH] = {0, 1, 2, 3, 4, 5, 6, 7};
+        float corners[3][3][LEAF_BATCH];
+        TriangleSoA soa;
+        for (int corner = 0; corner < 3; corner++)
+        {
+            for (int axis = 0; axis < 3; axis++) soa.v[corner][axis] = corners[corner][axis];
+        }
+        bool hitAnything = false;
+        for (uint32_t first = 0; first < count; first += LEAF_BATCH)
+        {
+            int batch = int(glm::min<uint32_t>(count - first, LEAF_BATCH));
+            for (int i = 0; i < batch; i++)
+            {
+                for (int corner = 0; corner < 3; corner++)
+                {
+                    const point3 &p = vertex(triangles[first + i], corner);
+                    for (int axis = 0; axis < 3; axis++) corners[corner][axis][i] = p[axis];
+                }
+            }
+            float t, u, v;
+            int nearest = nearestTriangle(soa, slots, batch, wr, t_min, t_max, t, u, v);
+            if (nearest < 0) continue;
+            t_max = t;
+            hitTriangle = triangles[first + nearest];
+            hitU = u;
+            hitV = v;
+            hitAnything = true;
+        }
+        return hitAnything;
+    }
+
+    std::vector<point3> positions;
+    std::vector<uint32_t> indices;
+    std::vector<vec3> normals;
+    std::vector<glm::vec2> uvs;
     Material *material;
+    BVH bvh;
 };
 
+// Places a shared group of shapes in the scene. Rays are moved into the group's object space instead of
+// copying its geometry, so any number of instances only cost a transform each.
+class Instance : public Shape
+{
+public:
+    Instance(ShapeList *group, const glm::mat4 &transform) : group(group)
+    {
+        setTransform(transform);
+    }
+    // the owning list has to run buildTopLevel() afterwards
+    void setTransform(const glm::mat4 &newTransform)
+    {
+        transform = newTransform;
+        inverse = glm::inverse(transform);
+        normalMatrix = glm::transpose(glm::mat3(inverse));
+    }
+    bool rayHit(const Ray& r, double t_min, double t_max, HitRecord& rec) override
+    {
+        // the direction isn't normalized so t is the same in both spaces
+        Ray local(vec3(inverse * glm::vec4(r.origin, 1)), vec3(inverse * glm::vec4(r.direction, 0)));
+        if (!group->hit(local, t_min, t_max, rec))
+        {
+            return false;
+        }
+        rec.p = r.at(rec.t);
+        rec.normal = glm::normalize(normalMatrix * rec.normal);
+        return true;
+    }
+    bool occluded(const Ray& r, double t_min, double t_max) override
+    {
+        Ray local(vec3(inverse * glm::vec4(r.origin, 1)), vec3(inverse * glm::vec4(r.direction, 0)));
+        return group->occluded(local, t_min, t_max);
+    }
+    AABB boundingBox() const override
+    {
+        AABB local = group->boundingBox();
+        AABB box;
+        for (int i = 0; i < 8; i++)
+        {
+            point3 corner((i & 1) ? local.max.x : local.min.x, (i & 2) ? local.max.y : local.min.y, (i & 4) ? local.max.z : local.min.z);
+            box.grow(vec3(transform * glm::vec4(corner, 1)));
+        }
+        return box;
+    }
+
+    glm::mat4 transform;
+    glm::mat4 inverse;
+    glm::mat3 normalMatrix;
+    ShapeList *group;
+};
 
 #endif
\ No newline at end of file
@@ -0,0 +1,291 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define SIMD_SSE
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define SIMD_AVX
+#endif
+
+#if defined(__AVX512F__)
+#define SIMD_AVX512
+#endif
+
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+// Functions compiled for a newer instruction set than the rest of the program, only called after cpuSimdLevel()
+// said the cpu has it. MSVC allows any intrinsic without it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#define SIMD_RUNTIME_DISPATCH
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define SIMD_TARGET(isa)
+#define SIMD_RUNTIME_DISPATCH
+#endif
+
+enum class SimdLevel
+{
+    Scalar,
+    SSE,
+    AVX2,    // with fma
+    AVX512,  // foundation only
+};
+
+// widest instruction set the cpu running the program supports, independent of the flags it was compiled with
+inline SimdLevel detectSimdLevel()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::AVX2;
+    if (__builtin_cpu_supports("sse2")) return SimdLevel::SSE;
+#elif defined(_MSC_VER) && defined(_M_X64)
+    int info[4];
+    __cpuid(info, 1);
+    bool osSavesAvx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0;
+    bool fma = (info[2] & (1 << 12)) != 0;
+    unsigned long long xcr0 = osSavesAvx ? _xgetbv(0) : 0;
+    __cpuidex(info, 7, 0);
+    if ((xcr0 & 0xe6) == 0xe6 && (info[1] & (1 << 16))) return SimdLevel::AVX512;
+    if ((xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) && fma) return SimdLevel::AVX2;
+    return SimdLevel::SSE;
+#endif
+    return SimdLevel::Scalar;
+}
+
+inline int lowestSetBit(uint32_t bits)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, bits);
+    return int(index);
+#else
+    return __builtin_ctz(bits);
+#endif
+}
+
+// detected once, can be lowered to compare the code paths
+inline SimdLevel &cpuSimdLevel()
+{
+    static SimdLevel level = detectSimdLevel();
+    return level;
+}
+
+// W lanes of floats and the matching lane masks. Widths the cpu has registers for map onto them (sse 4, avx 8,
+// avx512 16), any other width is split in two halves down to single floats, so every width works everywhere and only
+// gets slower on older cpus.
+template <int W> struct vfloat;
+template <int W> struct vmask;
+
+template <int W>
+struct vmask
+{
+    vmask<W / 2> lo, hi;
+
+    vmask() = default;
+    vmask(vmask<W / 2> lo, vmask<W / 2> hi) : lo(lo), hi(hi) {}
+    // lanes from the low bits of bits
+    static vmask fromBits(int bits) { return vmask(vmask<W / 2>::fromBits(bits), vmask<W / 2>::fromBits(bits >> (W / 2))); }
+    int bits() const { return lo.bits() | (hi.bits() << (W / 2)); }
+};
+
+template <int W>
+struct vfloat
+{
+    vfloat<W / 2> lo, hi;
+
+    vfloat() = default;
+    vfloat(float f) : lo(f), hi(f) {}
+    vfloat(vfloat<W / 2> lo, vfloat<W / 2> hi) : lo(lo), hi(hi) {}
+    static vfloat load(const float *p) { return vfloat(vfloat<W / 2>::load(p), vfloat<W / 2>::load(p + W / 2)); }
+    void store(float *p) const { lo.store(p); hi.store(p + W / 2); }
+};
+
+template <int W> inline vfloat<W> operator+(const vfloat<W> &a, const vfloat<W> &b) { return vfloat<W>(a.lo + b.lo, a.hi + b.hi); }
+template <int W> inline vfloat<W> operator-(const vfloat<W> &a, const vfloat<W> &b) { return vfloat<W>(a.lo - b.lo, a.hi - b.hi); }
+template <int W> inline vfloat<W> operator*(const vfloat<W> &a, const vfloat<W> &b) { return vfloat<W>(a.lo * b.lo, a.hi * b.hi); }
+template <int W> inline vfloat<W> operator/(const vfloat<W> &a, const vfloat<W> &b) { return vfloat<W>(a.lo / b.lo, a.hi / b.hi); }
+template <int W> inline vfloat<W> vmin(const vfloat<W> &a, const vfloat<W> &b) { return vfloat<W>(vmin(a.lo, b.lo), vmin(a.hi, b.hi)); }
+template <int W> inline vfloat<W> vmax(const vfloat<W> &a, const vfloat<W> &b) { return vfloat<W>(vmax(a.lo, b.lo), vmax(a.hi, b.hi)); }
+template <int W> inline vfloat<W> vsqrt(const vfloat<W> &a) { return vfloat<W>(vsqrt(a.lo), vsqrt(a.hi)); }
+template <int W> inline vmask<W> operator<(const vfloat<W> &a, const vfloat<W> &b) { return vmask<W>(a.lo < b.lo, a.hi < b.hi); }
+template <int W> inline vmask<W> operator<=(const vfloat<W> &a, const vfloat<W> &b) { return vmask<W>(a.lo <= b.lo, a.hi <= b.hi); }
+template <int W> inline vmask<W> operator>(const vfloat<W> &a, const vfloat<W> &b) { return b < a; }
+template <int W> inline vmask<W> operator>=(const vfloat<W> &a, const vfloat<W> &b) { return b <= a; }
+template <int W> inline vmask<W> operator&(const vmask<W> &a, const vmask<W> &b) { return vmask<W>(a.lo & b.lo, a.hi & b.hi); }
+template <int W> inline vmask<W> operator|(const vmask<W> &a, const vmask<W> &b) { return vmask<W>(a.lo | b.lo, a.hi | b.hi); }
+// picks a where mask is set, b everywhere else
+template <int W> inline vfloat<W> vselect(const vmask<W> &mask, const vfloat<W> &a, const vfloat<W> &b)
+{
+    return vfloat<W>(vselect(mask.lo, a.lo, b.lo), vselect(mask.hi, a.hi, b.hi));
+}
+
+// a single lane, the end of the splitting
+template <>
+struct vmask<1>
+{
+    bool m;
+
+    vmask() = default;
+    vmask(bool m) : m(m) {}
+    static vmask fromBits(int bits) { return vmask((bits & 1) != 0); }
+    int bits() const { return m ? 1 : 0; }
+};
+
+template <>
+struct vfloat<1>
+{
+    float v;
+
+    vfloat() = default;
+    vfloat(float f) : v(f) {}
+    static vfloat load(const float *p) { return vfloat(*p); }
+    void store(float *p) const { *p = v; }
+};
+
+inline vfloat<1> operator+(const vfloat<1> &a, const vfloat<1> &b) { return a.v + b.v; }
+inline vfloat<1> operator-(const vfloat<1> &a, const vfloat<1> &b) { return a.v - b.v; }
+inline vfloat<1> operator*(const vfloat<1> &a, const vfloat<1> &b) { return a.v * b.v; }
+inline vfloat<1> operator/(const vfloat<1> &a, const vfloat<1> &b) { return a.v / b.v; }
+inline vfloat<1> vmin(const vfloat<1> &a, const vfloat<1> &b) { return a.v < b.v ? a.v : b.v; }
+inline vfloat<1> vmax(const vfloat<1> &a, const vfloat<1> &b) { return a.v > b.v ? a.v : b.v; }
+inline vfloat<1> vsqrt(const vfloat<1> &a) { return std::sqrt(a.v); }
+inline vmask<1> operator<(const vfloat<1> &a, const vfloat<1> &b) { return a.v < b.v; }
+inline vmask<1> operator<=(const vfloat<1> &a, const vfloat<1> &b) { return a.v <= b.v; }
+inline vmask<1> operator&(const vmask<1> &a, const vmask<1> &b) { return a.m && b.m; }
+inline vmask<1> operator|(const vmask<1> &a, const vmask<1> &b) { return a.m || b.m; }
+inline vfloat<1> vselect(const vmask<1> &mask, const vfloat<1> &a, const vfloat<1> &b) { return mask.m ? a : b; }
+
+#ifdef SIMD_SSE
+template <>
+struct vmask<4>
+{
+    __m128 m;
+
+    vmask() = default;
+    vmask(__m128 m) : m(m) {}
+    static vmask fromBits(int bits)
+    {
+        __m128i lanes = _mm_and_si128(_mm_set1_epi32(bits), _mm_setr_epi32(1, 2, 4, 8));
+        return _mm_castsi128_ps(_mm_cmpeq_epi32(lanes, _mm_setr_epi32(1, 2, 4, 8)));
+    }
+    int bits() const { return _mm_movemask_ps(m); }
+};
+
+template <>
+struct vfloat<4>
+{
+    __m128 v;
+
+    vfloat() = default;
+    vfloat(__m128 v) : v(v) {}
+    vfloat(float f) : v(_mm_set1_ps(f)) {}
+    static vfloat load(const float *p) { return _mm_loadu_ps(p); }
+    void store(float *p) const { _mm_storeu_ps(p, v); }
+};
+
+inline vfloat<4> operator+(const vfloat<4> &a, const vfloat<4> &b) { return _mm_add_ps(a.v, b.v); }
+inline vfloat<4> operator-(const vfloat<4> &a, const vfloat<4> &b) { return _mm_sub_ps(a.v, b.v); }
+inline vfloat<4> operator*(const vfloat<4> &a, const vfloat<4> &b) { return _mm_mul_ps(a.v, b.v); }
+inline vfloat<4> operator/(const vfloat<4> &a, const vfloat<4> &b) { return _mm_div_ps(a.v, b.v); }
+inline vfloat<4> vmin(const vfloat<4> &a, const vfloat<4> &b) { return _mm_min_ps(a.v, b.v); }
+inline vfloat<4> vmax(const vfloat<4> &a, const vfloat<4> &b) { return _mm_max_ps(a.v, b.v); }
+inline vfloat<4> vsqrt(const vfloat<4> &a) { return _mm_sqrt_ps(a.v); }
+inline vmask<4> operator<(const vfloat<4> &a, const vfloat<4> &b) { return _mm_cmplt_ps(a.v, b.v); }
+inline vmask<4> operator<=(const vfloat<4> &a, const vfloat<4> &b) { return _mm_cmple_ps(a.v, b.v); }
+inline vmask<4> operator&(const vmask<4> &a, const vmask<4> &b) { return _mm_and_ps(a.m, b.m); }
+inline vmask<4> operator|(const vmask<4> &a, const vmask<4> &b) { return _mm_or_ps(a.m, b.m); }
+inline vfloat<4> vselect(const vmask<4> &mask, const vfloat<4> &a, const vfloat<4> &b)
+{
+    return _mm_or_ps(_mm_and_ps(mask.m, a.v), _mm_andnot_ps(mask.m, b.v));
+}
+#endif
+
+#ifdef SIMD_AVX
+template <>
+struct vmask<8>
+{
+    __m256 m;
+
+    vmask() = default;
+    vmask(__m256 m) : m(m) {}
+    static vmask fromBits(int bits)
+    {
+        return vmask(_mm256_set_m128(vmask<4>::fromBits(bits >> 4).m, vmask<4>::fromBits(bits).m));
+    }
+    int bits() const { return _mm256_movemask_ps(m); }
+};
+
+template <>
+struct vfloat<8>
+{
+    __m256 v;
+
+    vfloat() = default;
+    vfloat(__m256 v) : v(v) {}
+    vfloat(float f) : v(_mm256_set1_ps(f)) {}
+    static vfloat load(const float *p) { return _mm256_loadu_ps(p); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline vfloat<8> operator+(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_add_ps(a.v, b.v); }
+inline vfloat<8> operator-(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_sub_ps(a.v, b.v); }
+inline vfloat<8> operator*(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_mul_ps(a.v, b.v); }
+inline vfloat<8> operator/(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_div_ps(a.v, b.v); }
+inline vfloat<8> vmin(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_min_ps(a.v, b.v); }
+inline vfloat<8> vmax(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_max_ps(a.v, b.v); }
+inline vfloat<8> vsqrt(const vfloat<8> &a) { return _mm256_sqrt_ps(a.v); }
+inline vmask<8> operator<(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline vmask<8> operator<=(const vfloat<8> &a, const vfloat<8> &b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline vmask<8> operator&(const vmask<8> &a, const vmask<8> &b) { return _mm256_and_ps(a.m, b.m); }
+inline vmask<8> operator|(const vmask<8> &a, const vmask<8> &b) { return _mm256_or_ps(a.m, b.m); }
+inline vfloat<8> vselect(const vmask<8> &mask, const vfloat<8> &a, const vfloat<8> &b) { return _mm256_blendv_ps(b.v, a.v, mask.m); }
+#endif
+
+#ifdef SIMD_AVX512
+template <>
+struct vmask<16>
+{
+    __mmask16 m;
+
+    vmask() = default;
+    vmask(__mmask16 m) : m(m) {}
+    static vmask fromBits(int bits) { return vmask(__mmask16(bits)); }
+    int bits() const { return int(m); }
+};
+
+template <>
+struct vfloat<16>
+{
+    __m512 v;
+
+    vfloat() = default;
+    vfloat(__m512 v) : v(v) {}
+    vfloat(float f) : v(_mm512_set1_ps(f)) {}
+    static vfloat load(const float *p) { return _mm512_loadu_ps(p); }
+    void store(float *p) const { _mm512_storeu_ps(p, v); }
+};
+
+inline vfloat<16> operator+(const vfloat<16> &a, const vfloat<16> &b) { return _mm512_add_ps(a.v, b.v); }
+inline vfloat<16> operator-(const vfloat<16> &a, const vfloat<16> &b) { return _mm512_sub_ps(a.v, b.v); }
+inline vfloat<16> operator*(const vfloat<16> &a, const vfloat<16> &b) { return _mm512_mul_ps(a.v, b.v); }
+inline vfloat<16> operator/(const vfloat<16> &a, const vfloat<16> &b) { return _mm512_div_ps(a.v, b.v); }
+inline vfloat<16> vmin(const vfloat<16> &a, const vfloat<16> &b) { return _mm512_min_ps(a.v, b.v); }
+inline vfloat<16> vmax(const vfloat<16> &a, const vfloat<16> &b) { return _mm512_max_ps(a.v, b.v); }
+inline vfloat<16> vsqrt(const vfloat<16> &a) { return _mm512_sqrt_ps(a.v); }
+inline vmask<16> operator<(const vfloat<16> &a, const vfloat<16> &b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+inline vmask<16> operator<=(const vfloat<16> &a, const vfloat<16> &b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ); }
+inline vmask<16> operator&(const vmask<16> &a, const vmask<16> &b) { return __mmask16(a.m & b.m); }
+inline vmask<16> operator|(const vmask<16> &a, const vmask<16> &b) { return __mmask16(a.m | b.m); }
+inline vfloat<16> vselect(const vmask<16> &mask, const vfloat<16> &a, const vfloat<16> &b) { return _mm512_mask_blend_ps(mask.m, b.v, a.v); }
+#endif
+
+#endif
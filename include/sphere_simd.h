@@ -0,0 +1,245 @@
+#ifndef SPHERE_SIMD_H
+#define SPHERE_SIMD_H
+
+#include "simd.h"
+#include "ray.h"
+
+#include <cstdint>
+#include <cmath>
+
+#ifdef SIMD_RUNTIME_DISPATCH
+#include <immintrin.h>
+#endif
+
+// Ray against sphere, returns the nearest root between t_min and t_max. half_b * half_b - a * c cancels badly for
+// small or far away spheres, the distance from the center to the closest point on the line gives the same
+// discriminant without that.
+inline bool intersectSphere(const point3 &cen, float rad, const Ray &r, float t_min, float t_max, float &root)
+{
+    vec3 oc = r.origin - cen;
+    float a = glm::dot(r.direction, r.direction);
+    float invA = 1.0f / a;
+    float half_b = glm::dot(oc, r.direction);
+    vec3 closest = oc - (half_b * invA) * r.direction;
+    float dis = a * ((rad * rad) - glm::dot(closest, closest));
+    if (dis < 0) return false;
+
+    float sqrtd = glm::sqrt(dis);
+    root = (-half_b - sqrtd) * invA;
+    if (root < t_min || t_max < root)
+    {
+        root = (-half_b + sqrtd) * invA;
+        if (root < t_min || t_max < root) return false;
+    }
+    return true;
+}
+
+// sphere centers and radii, one array per component
+struct SphereSoA
+{
+    const float *x, *y, *z, *radius;
+};
+
+// nearestSphere() one sphere after the other
+inline int nearestSphereScalar(const SphereSoA &s, const uint32_t *slots, int count, const Ray &r, float t_min, float t_max, float &t)
+{
+    int nearest = -1;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t slot = slots[i];
+        float root;
+        if (intersectSphere(point3(s.x[slot], s.y[slot], s.z[slot]), s.radius[slot], r, t_min, t_max, root))
+        {
+            t_max = root;
+            nearest = i;
+        }
+    }
+    if (nearest >= 0) t = t_max;
+    return nearest;
+}
+
+#ifdef SIMD_RUNTIME_DISPATCH
+
+// every lane follows intersectSphere(), misses come out as INFINITY
+inline int nearestSphereSSE(const SphereSoA &s, const uint32_t *slots, int count, const Ray &r, float t_min, float t_max, float &t)
+{
+    __m128 ox = _mm_set1_ps(r.origin.x), oy = _mm_set1_ps(r.origin.y), oz = _mm_set1_ps(r.origin.z);
+    __m128 dx = _mm_set1_ps(r.direction.x), dy = _mm_set1_ps(r.direction.y), dz = _mm_set1_ps(r.direction.z);
+    float aScalar = glm::dot(r.direction, r.direction);
+    __m128 a = _mm_set1_ps(aScalar), invA = _mm_set1_ps(1.0f / aScalar);
+    __m128 tMin = _mm_set1_ps(t_min), zero = _mm_setzero_ps(), inf = _mm_set1_ps(INFINITY);
+    int nearest = -1;
+    for (int first = 0; first < count; first += 4)
+    {
+        // lanes past count repeat the first sphere and are masked off at the end
+        uint32_t lane[4];
+        for (int i = 0; i < 4; i++) lane[i] = slots[first + i < count ? first + i : first];
+        __m128 cx = _mm_setr_ps(s.x[lane[0]], s.x[lane[1]], s.x[lane[2]], s.x[lane[3]]);
+        __m128 cy = _mm_setr_ps(s.y[lane[0]], s.y[lane[1]], s.y[lane[2]], s.y[lane[3]]);
+        __m128 cz = _mm_setr_ps(s.z[lane[0]], s.z[lane[1]], s.z[lane[2]], s.z[lane[3]]);
+        __m128 rad = _mm_setr_ps(s.radius[lane[0]], s.radius[lane[1]], s.radius[lane[2]], s.radius[lane[3]]);
+        __m128 tMax = _mm_set1_ps(t_max);
+
+        __m128 ocx = _mm_sub_ps(ox, cx), ocy = _mm_sub_ps(oy, cy), ocz = _mm_sub_ps(oz, cz);
+        __m128 half_b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+        __m128 along = _mm_mul_ps(half_b, invA);
+        __m128 lx = _mm_sub_ps(ocx, _mm_mul_ps(along, dx)), ly = _mm_sub_ps(ocy, _mm_mul_ps(along, dy)), lz = _mm_sub_ps(ocz, _mm_mul_ps(along, dz));
+        __m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lx, lx), _mm_mul_ps(ly, ly)), _mm_mul_ps(lz, lz));
+        __m128 dis = _mm_mul_ps(a, _mm_sub_ps(_mm_mul_ps(rad, rad), dist2));
+        __m128 valid = _mm_cmpge_ps(dis, zero);
+        if (!(_mm_movemask_ps(valid) & ((1 << (count - first < 4 ? count - first : 4)) - 1))) continue;
+
+        __m128 sqrtd = _mm_sqrt_ps(_mm_max_ps(dis, zero));
+        __m128 minusB = _mm_sub_ps(zero, half_b);
+        __m128 nearRoot = _mm_mul_ps(_mm_sub_ps(minusB, sqrtd), invA);
+        __m128 farRoot = _mm_mul_ps(_mm_add_ps(minusB, sqrtd), invA);
+        __m128 nearOk = _mm_and_ps(_mm_cmpge_ps(nearRoot, tMin), _mm_cmple_ps(nearRoot, tMax));
+        __m128 farOk = _mm_and_ps(_mm_cmpge_ps(farRoot, tMin), _mm_cmple_ps(farRoot, tMax));
+        __m128 root = _mm_or_ps(_mm_and_ps(nearOk, nearRoot), _mm_andnot_ps(nearOk, farRoot));
+        __m128 hit = _mm_and_ps(valid, _mm_or_ps(nearOk, farOk));
+        root = _mm_or_ps(_mm_and_ps(hit, root), _mm_andnot_ps(hit, inf));
+
+        int laneMask = (1 << (count - first < 4 ? count - first : 4)) - 1;
+        int hits = _mm_movemask_ps(hit) & laneMask;
+        if (!hits) continue;
+        alignas(16) float roots[4];
+        _mm_store_ps(roots, root);
+        for (; hits; hits &= hits - 1)
+        {
+            int i = lowestSetBit(hits);
+            if (roots[i] <= t_max)
+            {
+                t_max = roots[i];
+                nearest = first + i;
+            }
+        }
+    }
+    if (nearest >= 0) t = t_max;
+    return nearest;
+}
+
+SIMD_TARGET("avx2,fma")
+inline int nearestSphereAVX2(const SphereSoA &s, const uint32_t *slots, int count, const Ray &r, float t_min, float t_max, float &t)
+{
+    __m256 ox = _mm256_set1_ps(r.origin.x), oy = _mm256_set1_ps(r.origin.y), oz = _mm256_set1_ps(r.origin.z);
+    __m256 dx = _mm256_set1_ps(r.direction.x), dy = _mm256_set1_ps(r.direction.y), dz = _mm256_set1_ps(r.direction.z);
+    float aScalar = glm::dot(r.direction, r.direction);
+    __m256 a = _mm256_set1_ps(aScalar), invA = _mm256_set1_ps(1.0f / aScalar);
+    __m256 tMin = _mm256_set1_ps(t_min), zero = _mm256_setzero_ps(), inf = _mm256_set1_ps(INFINITY);
+    const __m256i laneIndex = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int nearest = -1;
+    for (int first = 0; first < count; first += 8)
+    {
+        __m256i active = _mm256_cmpgt_epi32(_mm256_set1_epi32(count - first), laneIndex);
+        __m256i index = _mm256_maskload_epi32(reinterpret_cast<const int*>(slots + first), active);
+        __m256 activePs = _mm256_castsi256_ps(active);
+        __m256 cx = _mm256_mask_i32gather_ps(zero, s.x, index, activePs, 4);
+        __m256 cy = _mm256_mask_i32gather_ps(zero, s.y, index, activePs, 4);
+        __m256 cz = _mm256_mask_i32gather_ps(zero, s.z, index, activePs, 4);
+        __m256 rad = _mm256_mask_i32gather_ps(zero, s.radius, index, activePs, 4);
+        __m256 tMax = _mm256_set1_ps(t_max);
+
+        __m256 ocx = _mm256_sub_ps(ox, cx), ocy = _mm256_sub_ps(oy, cy), ocz = _mm256_sub_ps(oz, cz);
+        __m256 half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        __m256 along = _mm256_mul_ps(half_b, invA);
+        __m256 lx = _mm256_sub_ps(ocx, _mm256_mul_ps(along, dx));
+        __m256 ly = _mm256_sub_ps(ocy, _mm256_mul_ps(along, dy));
+        __m256 lz = _mm256_sub_ps(ocz, _mm256_mul_ps(along, dz));
+        __m256 dist2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lx, lx), _mm256_mul_ps(ly, ly)), _mm256_mul_ps(lz, lz));
+        __m256 dis = _mm256_mul_ps(a, _mm256_sub_ps(_mm256_mul_ps(rad, rad), dist2));
+        __m256 valid = _mm256_and_ps(_mm256_cmp_ps(dis, zero, _CMP_GE_OQ), activePs);
+        if (_mm256_testz_ps(valid, valid)) continue;
+
+        __m256 sqrtd = _mm256_sqrt_ps(_mm256_max_ps(dis, zero));
+        __m256 minusB = _mm256_sub_ps(zero, half_b);
+        __m256 nearRoot = _mm256_mul_ps(_mm256_sub_ps(minusB, sqrtd), invA);
+        __m256 farRoot = _mm256_mul_ps(_mm256_add_ps(minusB, sqrtd), invA);
+        __m256 nearOk = _mm256_and_ps(_mm256_cmp_ps(nearRoot, tMin, _CMP_GE_OQ), _mm256_cmp_ps(nearRoot, tMax, _CMP_LE_OQ));
+        __m256 farOk = _mm256_and_ps(_mm256_cmp_ps(farRoot, tMin, _CMP_GE_OQ), _mm256_cmp_ps(farRoot, tMax, _CMP_LE_OQ));
+        __m256 hit = _mm256_and_ps(valid, _mm256_or_ps(nearOk, farOk));
+        if (_mm256_testz_ps(hit, hit)) continue;
+        __m256 root = _mm256_blendv_ps(inf, _mm256_blendv_ps(farRoot, nearRoot, nearOk), hit);
+
+        // nearest lane, the first one on ties like the scalar loop
+        __m256 m = _mm256_min_ps(root, _mm256_permute2f128_ps(root, root, 1));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+        int lanes = _mm256_movemask_ps(_mm256_cmp_ps(root, m, _CMP_EQ_OQ));
+        t_max = _mm256_cvtss_f32(m);
+        nearest = first + lowestSetBit(lanes);
+    }
+    if (nearest >= 0) t = t_max;
+    return nearest;
+}
+
+SIMD_TARGET("avx512f")
+inline int nearestSphereAVX512(const SphereSoA &s, const uint32_t *slots, int count, const Ray &r, float t_min, float t_max, float &t)
+{
+    __m512 ox = _mm512_set1_ps(r.origin.x), oy = _mm512_set1_ps(r.origin.y), oz = _mm512_set1_ps(r.origin.z);
+    __m512 dx = _mm512_set1_ps(r.direction.x), dy = _mm512_set1_ps(r.direction.y), dz = _mm512_set1_ps(r.direction.z);
+    float aScalar = glm::dot(r.direction, r.direction);
+    __m512 a = _mm512_set1_ps(aScalar), invA = _mm512_set1_ps(1.0f / aScalar);
+    __m512 tMin = _mm512_set1_ps(t_min), zero = _mm512_setzero_ps(), inf = _mm512_set1_ps(INFINITY);
+    int nearest = -1;
+    for (int first = 0; first < count; first += 16)
+    {
+        int n = count - first < 16 ? count - first : 16;
+        __mmask16 active = __mmask16((1u << n) - 1);
+        __m512i index = _mm512_maskz_loadu_epi32(active, slots + first);
+        __m512 cx = _mm512_mask_i32gather_ps(zero, active, index, s.x, 4);
+        __m512 cy = _mm512_mask_i32gather_ps(zero, active, index, s.y, 4);
+        __m512 cz = _mm512_mask_i32gather_ps(zero, active, index, s.z, 4);
+        __m512 rad = _mm512_mask_i32gather_ps(zero, active, index, s.radius, 4);
+        __m512 tMax = _mm512_set1_ps(t_max);
+
+        __m512 ocx = _mm512_sub_ps(ox, cx), ocy = _mm512_sub_ps(oy, cy), ocz = _mm512_sub_ps(oz, cz);
+        __m512 half_b = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(ocx, dx), _mm512_mul_ps(ocy, dy)), _mm512_mul_ps(ocz, dz));
+        __m512 along = _mm512_mul_ps(half_b, invA);
+        __m512 lx = _mm512_sub_ps(ocx, _mm512_mul_ps(along, dx));
+        __m512 ly = _mm512_sub_ps(ocy, _mm512_mul_ps(along, dy));
+        __m512 lz = _mm512_sub_ps(ocz, _mm512_mul_ps(along, dz));
+        __m512 dist2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lx, lx), _mm512_mul_ps(ly, ly)), _mm512_mul_ps(lz, lz));
+        __m512 dis = _mm512_mul_ps(a, _mm512_sub_ps(_mm512_mul_ps(rad, rad), dist2));
+        __mmask16 valid = _mm512_mask_cmp_ps_mask(active, dis, zero, _CMP_GE_OQ);
+        if (!valid) continue;
+
+        __m512 sqrtd = _mm512_sqrt_ps(_mm512_max_ps(dis, zero));
+        __m512 minusB = _mm512_sub_ps(zero, half_b);
+        __m512 nearRoot = _mm512_mul_ps(_mm512_sub_ps(minusB, sqrtd), invA);
+        __m512 farRoot = _mm512_mul_ps(_mm512_add_ps(minusB, sqrtd), invA);
+        __mmask16 nearOk = _mm512_mask_cmp_ps_mask(valid, nearRoot, tMin, _CMP_GE_OQ) & _mm512_cmp_ps_mask(nearRoot, tMax, _CMP_LE_OQ);
+        __mmask16 farOk = _mm512_mask_cmp_ps_mask(valid, farRoot, tMin, _CMP_GE_OQ) & _mm512_cmp_ps_mask(farRoot, tMax, _CMP_LE_OQ);
+        __mmask16 hit = nearOk | farOk;
+        if (!hit) continue;
+        __m512 root = _mm512_mask_blend_ps(hit, inf, _mm512_mask_blend_ps(nearOk, farRoot, nearRoot));
+
+        float m = _mm512_reduce_min_ps(root);
+        __mmask16 lanes = _mm512_cmp_ps_mask(root, _mm512_set1_ps(m), _CMP_EQ_OQ);
+        t_max = m;
+        nearest = first + lowestSetBit(lanes);
+    }
+    if (nearest >= 0) t = t_max;
+    return nearest;
+}
+
+#endif
+
+// Nearest of the spheres at slots[0..count) the ray hits between t_min and t_max. Returns its position in slots and
+// sets t, or -1 on a miss. One ray is tested against 16 (avx512), 8 (avx2) or 4 (sse) spheres at a time, picked by
+// cpuSimdLevel() when the program runs.
+inline int nearestSphere(const SphereSoA &s, const uint32_t *slots, int count, const Ray &r, float t_min, float t_max, float &t)
+{
+#ifdef SIMD_RUNTIME_DISPATCH
+    // the scalar test stops at the discriminant for most spheres, so small batches are faster without gathering
+    switch (cpuSimdLevel())
+    {
+        case SimdLevel::AVX512: if (count >= 6) return nearestSphereAVX512(s, slots, count, r, t_min, t_max, t); break;
+        case SimdLevel::AVX2:   if (count >= 6) return nearestSphereAVX2(s, slots, count, r, t_min, t_max, t); break;
+        case SimdLevel::SSE:    if (count >= 12) return nearestSphereSSE(s, slots, count, r, t_min, t_max, t); break;
+        default:                break;
+    }
+#endif
+    return nearestSphereScalar(s, slots, count, r, t_min, t_max, t);
+}
+
+#endif
@@ -3,44 +3,118 @@
 
 #include "debug.h"
 
+#include <cstring>
+
 #include <glad/glad.h>
 
+// An rgba8 texture for showing the image while it renders. Storage is immutable and only allocated again when the
+// size changes. Uploads go through two pixel buffers that stay mapped: the cpu copies a frame into one while the gpu
+// may still be reading the other, and a fence per buffer makes sure a buffer is never overwritten before its upload
+// finished.
 class Texture2D
 {
 public:
+    static constexpr int BUFFERS = 2;
+
     Texture2D() = default;
     ~Texture2D()
     {
-        glCall(glDeleteTextures(1, &id));
+        remove();
     }
+    Texture2D(const Texture2D &) = delete;
+    Texture2D &operator=(const Texture2D &) = delete;
+
+    // copies data, width x height rgba8 pixels, into the texture
     void loadData(int width, int height, void *data)
     {
-        Texture2D::width = width;
-        Texture2D::height = height;
+        if (width <= 0 || height <= 0) return;
+        if (id == 0 || width != Texture2D::width || height != Texture2D::height) allocate(width, height);
 
-        glCall(glGenTextures(1, &id));
+        int buffer = next;
+        if (fences[buffer])
+        {
+            // the gpu may still be reading the buffer, writing it before the fence signals would tear the upload
+            GLenum status = GL_TIMEOUT_EXPIRED;
+            while (status == GL_TIMEOUT_EXPIRED)
+            {
+                glCall(status = glClientWaitSync(fences[buffer], GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000)));
+            }
+            // a failed wait would fail again on every later frame, so the fence is dropped and the gpu drained instead
+            if (status == GL_WAIT_FAILED) glCall(glFinish());
+            glCall(glDeleteSync(fences[buffer]));
+            fences[buffer] = nullptr;
+        }
+        next = (next + 1) % BUFFERS;
+        std::memcpy(mapped[buffer], data, byteSize());
 
+        glCall(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[buffer]));
         glCall(glBindTexture(GL_TEXTURE_2D, id));
+        glCall(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr));
+        glCall(fences[buffer] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0));
+        glCall(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+    }
+    void remove()
+    {
+        for (int b = 0; b < BUFFERS; b++)
+        {
+            if (fences[b])
+            {
+                glCall(glDeleteSync(fences[b]));
+                fences[b] = nullptr;
+            }
+            if (pbos[b])
+            {
+                glCall(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[b]));
+                glCall(glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER));
+                glCall(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+                mapped[b] = nullptr;
+            }
+        }
+        glCall(glDeleteBuffers(BUFFERS, pbos));
+        glCall(glDeleteTextures(1, &id));
+        id = 0;
+        for (int b = 0; b < BUFFERS; b++) pbos[b] = 0;
+        width = height = 0;
+    }
+    GLuint getHandle() { return id; }
+
+    int width = 0, height = 0;
 
+private:
+    size_t byteSize() const { return size_t(width) * height * 4; }
+
+    void allocate(int width, int height)
+    {
+        remove();
+        Texture2D::width = width;
+        Texture2D::height = height;
+
+        glCall(glGenTextures(1, &id));
         glCall(glBindTexture(GL_TEXTURE_2D, id));
+        glCall(glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height));
         glCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
         glCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
 
         glCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER));
         glCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER));
 
-        glCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data));
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glCall(glGenBuffers(BUFFERS, pbos));
+        for (int b = 0; b < BUFFERS; b++)
+        {
+            glCall(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[b]));
+            glCall(glBufferStorage(GL_PIXEL_UNPACK_BUFFER, byteSize(), nullptr, flags));
+            glCall(mapped[b] = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, byteSize(), flags));
+        }
+        glCall(glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0));
+        next = 0;
     }
-    void remove()
-    {
-        glCall(glDeleteTextures(1, &id));
-    }
-    GLuint getHandle() { return id; }
-
-    int width, height;
 
-private:
     GLuint id{};
+    GLuint pbos[BUFFERS]{};
+    void *mapped[BUFFERS]{};
+    GLsync fences[BUFFERS]{};
+    int next = 0;
 };
 
-#endif
\ No newline at end of file
+#endif
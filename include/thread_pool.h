@@ -0,0 +1,146 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <algorithm>
+#include <exception>
+
+// Long lived worker threads that sleep until jobs are queued, so renders and builds don't pay for creating and joining
+// threads every time. submit() queues a single job and returns a future for its result, run() runs task(0) to
+// task(count - 1) spread over the workers and waits for all of them. The thread calling run() works on the same tasks
+// instead of just waiting, so run() called from inside a job still finishes when every worker is busy. A task that
+// throws doesn't stop the others, run() rethrows the first exception once all of them returned.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int numWorkers)
+    {
+        for (int n = 0; n < numWorkers; n++)
+        {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // one worker per hardware thread, started on first use and shared by everything that runs in parallel
+    static ThreadPool &global()
+    {
+        static ThreadPool pool(std::max(1, int(std::thread::hardware_concurrency())));
+        return pool;
+    }
+    int size() const { return int(workers.size()); }
+
+    template <typename Job>
+    std::future<std::invoke_result_t<Job>> submit(Job &&job)
+    {
+        auto task = std::make_shared<std::packaged_task<std::invoke_result_t<Job>()>>(std::forward<Job>(job));
+        std::future<std::invoke_result_t<Job>> result = task->get_future();
+        push([task]() { (*task)(); }, 1);
+        return result;
+    }
+
+    // task(i) once for every i in [0, count), returns when all of them returned
+    void run(int count, const std::function<void(int)> &task)
+    {
+        if (count <= 0) return;
+        auto batch = std::make_shared<Batch>(task, count);
+        push([batch]() { batch->drain(); }, std::min(count - 1, size()));
+        batch->drain();
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->finished.wait(lock, [&]() { return batch->done == batch->count; });
+        if (batch->error) std::rethrow_exception(batch->error);
+    }
+
+private:
+    // the tasks of one run(), claimed one index at a time by whichever threads drain it
+    struct Batch
+    {
+        const std::function<void(int)> &task;
+        int count;
+        std::atomic<int> next{0};
+        int done = 0;
+        std::exception_ptr error; // the first task that threw, guarded by mutex
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        Batch(const std::function<void(int)> &task, int count) : task(task), count(count) {}
+
+        void drain()
+        {
+            int i, ran = 0;
+            while ((i = next.fetch_add(1)) < count)
+            {
+                try
+                {
+                    task(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error) error = std::current_exception();
+                }
+                ran++;
+            }
+            if (ran == 0) return;
+            std::lock_guard<std::mutex> lock(mutex);
+            done += ran;
+            if (done == count) finished.notify_all();
+        }
+    };
+
+    void push(std::function<void()> job, int copies)
+    {
+        if (copies <= 0) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int c = 0; c < copies; c++) jobs.push_back(job);
+        }
+        if (copies == 1) wake.notify_one();
+        else wake.notify_all();
+    }
+    void work()
+    {
+        while (true)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&]() { return stopping || !jobs.empty(); });
+                if (jobs.empty()) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+#endif
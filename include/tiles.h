@@ -0,0 +1,47 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <atomic>
+
+// the pixels [x0, x1) x [y0, y1) of an image
+struct Tile
+{
+    int x0, y0, x1, y1;
+
+    int width() const { return x1 - x0; }
+    int height() const { return y1 - y0; }
+};
+
+// Hands out the tiles of a width x height image, row by row, to any number of threads through one atomic counter.
+// Threads take the next tile whenever they finish one, so a thread that got cheap sky tiles just takes more of them
+// and every thread keeps working until the last tile is gone. Tiles at the right and top edges are cut to the image.
+class TileQueue
+{
+public:
+    TileQueue(int width, int height, int tileSize)
+        : width(width), height(height), tileSize(tileSize > 0 ? tileSize : 1)
+    {
+        tilesX = (width + this->tileSize - 1) / this->tileSize;
+        tilesY = (height + this->tileSize - 1) / this->tileSize;
+    }
+
+    // false once every tile was handed out
+    bool next(Tile &tile)
+    {
+        int n = nextTile.fetch_add(1, std::memory_order_relaxed);
+        if (n >= count()) return false;
+        tile.x0 = (n % tilesX) * tileSize;
+        tile.y0 = (n / tilesX) * tileSize;
+        tile.x1 = tile.x0 + tileSize < width ? tile.x0 + tileSize : width;
+        tile.y1 = tile.y0 + tileSize < height ? tile.y0 + tileSize : height;
+        return true;
+    }
+    int count() const { return width > 0 && height > 0 ? tilesX * tilesY : 0; }
+
+private:
+    int width, height, tileSize;
+    int tilesX, tilesY;
+    std::atomic<int> nextTile{0};
+};
+
+#endif
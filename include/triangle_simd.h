@@ -0,0 +1,269 @@
+#ifndef TRIANGLE_SIMD_H
+#define TRIANGLE_SIMD_H
+
+#include "simd.h"
+#include "ray.h"
+
+#include <cstdint>
+#include <cmath>
+#include <utility>
+
+#ifdef SIMD_RUNTIME_DISPATCH
+#include <immintrin.h>
+#endif
+
+// Ray set up for the watertight ray/triangle test of Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection"
+// (JCGT 2013). Triangles are sheared into a space where the ray starts at the origin and runs along +z, the test is
+// then three 2d edge functions whose signs two triangles sharing an edge always agree on, so no ray slips through
+// between them.
+struct WatertightRay
+{
+    point3 origin;
+    int kx, ky, kz;
+    float sx, sy, sz;
+
+    WatertightRay() = default;
+    explicit WatertightRay(const Ray &r) : origin(r.origin)
+    {
+        vec3 d = r.direction;
+        vec3 ad = glm::abs(d);
+        kz = ad.x > ad.y ? (ad.x > ad.z ? 0 : 2) : (ad.y > ad.z ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // keeps the winding so front faces stay front faces
+        if (d[kz] < 0) std::swap(kx, ky);
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1.0f / d[kz];
+    }
+};
+
+// Sheared coordinate of a vertex relative to the ray origin. The product of two floats is exact in double, so the
+// result is the same whether the compiler fuses the multiply and subtract or not, and every code path below sees the
+// same sheared vertices.
+inline float shearVertex(float a, float s, float az)
+{
+    return float(double(a) - double(s) * double(az));
+}
+
+// Two sided, t between t_min and t_max, u and v are the barycentric weights of v1 and v2. The edge functions are
+// evaluated in double for the same reason as shearVertex(), they come out exactly negated for a shared edge.
+inline bool intersectTriangle(const point3 &v0, const point3 &v1, const point3 &v2, const WatertightRay &r, float t_min, float t_max,
+                              float &t, float &u, float &v)
+{
+    vec3 a = v0 - r.origin, b = v1 - r.origin, c = v2 - r.origin;
+    float ax = shearVertex(a[r.kx], r.sx, a[r.kz]), ay = shearVertex(a[r.ky], r.sy, a[r.kz]);
+    float bx = shearVertex(b[r.kx], r.sx, b[r.kz]), by = shearVertex(b[r.ky], r.sy, b[r.kz]);
+    float cx = shearVertex(c[r.kx], r.sx, c[r.kz]), cy = shearVertex(c[r.ky], r.sy, c[r.kz]);
+
+    double U = double(cx) * by - double(cy) * bx;
+    double V = double(ax) * cy - double(ay) * cx;
+    double W = double(bx) * ay - double(by) * ax;
+    if ((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return false;
+    double det = U + V + W;
+    if (det == 0) return false;
+
+    float az = r.sz * a[r.kz], bz = r.sz * b[r.kz], cz = r.sz * c[r.kz];
+    double T = U * az + V * bz + W * cz;
+    t = float(T / det);
+    if (t < t_min || t > t_max) return false;
+    u = float(V / det);
+    v = float(W / det);
+    return true;
+}
+
+// triangle corners, one array per vertex and axis
+struct TriangleSoA
+{
+    const float *v[3][3];
+};
+
+// nearestTriangle() one triangle after the other
+inline int nearestTriangleScalar(const TriangleSoA &s, const uint32_t *slots, int count, const WatertightRay &r, float t_min, float t_max,
+                                 float &t, float &u, float &v)
+{
+    int nearest = -1;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t slot = slots[i];
+        point3 v0(s.v[0][0][slot], s.v[0][1][slot], s.v[0][2][slot]);
+        point3 v1(s.v[1][0][slot], s.v[1][1][slot], s.v[1][2][slot]);
+        point3 v2(s.v[2][0][slot], s.v[2][1][slot], s.v[2][2][slot]);
+        float hitT, hitU, hitV;
+        if (intersectTriangle(v0, v1, v2, r, t_min, t_max, hitT, hitU, hitV))
+        {
+            t_max = t = hitT;
+            u = hitU;
+            v = hitV;
+            nearest = i;
+        }
+    }
+    return nearest;
+}
+
+#ifdef SIMD_RUNTIME_DISPATCH
+
+// 4 lanes of intersectTriangle(), the sheared vertices and edge functions in double
+SIMD_TARGET("avx2,fma")
+inline __m256d shearVertex4(__m128 a, __m256d s, __m128 az)
+{
+    return _mm256_cvtps_pd(_mm256_cvtpd_ps(_mm256_sub_pd(_mm256_cvtps_pd(a), _mm256_mul_pd(s, _mm256_cvtps_pd(az)))));
+}
+
+SIMD_TARGET("avx2,fma")
+inline int nearestTriangleAVX2(const TriangleSoA &s, const uint32_t *slots, int count, const WatertightRay &r, float t_min, float t_max,
+                               float &t, float &u, float &v)
+{
+    const int k[3] = {r.kx, r.ky, r.kz};
+    __m128 origin[3] = {_mm_set1_ps(r.origin[r.kx]), _mm_set1_ps(r.origin[r.ky]), _mm_set1_ps(r.origin[r.kz])};
+    __m256d sx = _mm256_set1_pd(r.sx), sy = _mm256_set1_pd(r.sy);
+    __m128 sz = _mm_set1_ps(r.sz), tMin = _mm_set1_ps(t_min), inf = _mm_set1_ps(INFINITY);
+    __m256d zero = _mm256_setzero_pd();
+    const __m128i laneIndex = _mm_setr_epi32(0, 1, 2, 3);
+    int nearest = -1;
+    for (int first = 0; first < count; first += 4)
+    {
+        __m128i active = _mm_cmpgt_epi32(_mm_set1_epi32(count - first), laneIndex);
+        __m128i index = _mm_maskload_epi32(reinterpret_cast<const int*>(slots + first), active);
+        __m128 activePs = _mm_castsi128_ps(active);
+
+        // x, y and z in the ray's permuted axes for the three corners
+        __m128 p[3][3];
+        for (int vert = 0; vert < 3; vert++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                p[vert][axis] = _mm_sub_ps(_mm_mask_i32gather_ps(_mm_setzero_ps(), s.v[vert][k[axis]], index, activePs, 4), origin[axis]);
+            }
+        }
+        __m256d ax = shearVertex4(p[0][0], sx, p[0][2]), ay = shearVertex4(p[0][1], sy, p[0][2]);
+        __m256d bx = shearVertex4(p[1][0], sx, p[1][2]), by = shearVertex4(p[1][1], sy, p[1][2]);
+        __m256d cx = shearVertex4(p[2][0], sx, p[2][2]), cy = shearVertex4(p[2][1], sy, p[2][2]);
+
+        __m256d U = _mm256_sub_pd(_mm256_mul_pd(cx, by), _mm256_mul_pd(cy, bx));
+        __m256d V = _mm256_sub_pd(_mm256_mul_pd(ax, cy), _mm256_mul_pd(ay, cx));
+        __m256d W = _mm256_sub_pd(_mm256_mul_pd(bx, ay), _mm256_mul_pd(by, ax));
+        __m256d anyNeg = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(U, zero, _CMP_LT_OQ), _mm256_cmp_pd(V, zero, _CMP_LT_OQ)),
+                                      _mm256_cmp_pd(W, zero, _CMP_LT_OQ));
+        __m256d anyPos = _mm256_or_pd(_mm256_or_pd(_mm256_cmp_pd(U, zero, _CMP_GT_OQ), _mm256_cmp_pd(V, zero, _CMP_GT_OQ)),
+                                      _mm256_cmp_pd(W, zero, _CMP_GT_OQ));
+        __m256d det = _mm256_add_pd(_mm256_add_pd(U, V), W);
+        __m256d inside = _mm256_andnot_pd(_mm256_and_pd(anyNeg, anyPos), _mm256_cmp_pd(det, zero, _CMP_NEQ_OQ));
+        int insideBits = _mm256_movemask_pd(inside) & _mm_movemask_ps(activePs);
+        if (!insideBits) continue;
+
+        __m256d az = _mm256_cvtps_pd(_mm_mul_ps(sz, p[0][2]));
+        __m256d bz = _mm256_cvtps_pd(_mm_mul_ps(sz, p[1][2]));
+        __m256d cz = _mm256_cvtps_pd(_mm_mul_ps(sz, p[2][2]));
+        __m256d T = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(U, az), _mm256_mul_pd(V, bz)), _mm256_mul_pd(W, cz));
+        __m128 hitT = _mm256_cvtpd_ps(_mm256_div_pd(T, det));
+        __m128 inRange = _mm_and_ps(_mm_cmpge_ps(hitT, tMin), _mm_cmple_ps(hitT, _mm_set1_ps(t_max)));
+        int hits = insideBits & _mm_movemask_ps(inRange);
+        if (!hits) continue;
+
+        // nearest lane, the first one on ties
+        __m128 candidates = _mm_blendv_ps(inf, hitT, _mm_castsi128_ps(_mm_setr_epi32(-(hits & 1), -((hits >> 1) & 1), -((hits >> 2) & 1), -((hits >> 3) & 1))));
+        __m128 m = _mm_min_ps(candidates, _mm_shuffle_ps(candidates, candidates, _MM_SHUFFLE(1, 0, 3, 2)));
+        m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+        int lane = lowestSetBit(_mm_movemask_ps(_mm_cmpeq_ps(candidates, m)) & hits);
+
+        alignas(32) double laneU[4], laneV[4], laneDet[4];
+        _mm256_store_pd(laneU, V);
+        _mm256_store_pd(laneV, W);
+        _mm256_store_pd(laneDet, det);
+        t_max = t = _mm_cvtss_f32(m);
+        u = float(laneU[lane] / laneDet[lane]);
+        v = float(laneV[lane] / laneDet[lane]);
+        nearest = first + lane;
+    }
+    return nearest;
+}
+
+// 8 lanes of intersectTriangle(), same steps as the avx2 version
+SIMD_TARGET("avx512f")
+inline __m512d shearVertex8(__m256 a, __m512d s, __m256 az)
+{
+    return _mm512_cvtps_pd(_mm512_cvtpd_ps(_mm512_sub_pd(_mm512_cvtps_pd(a), _mm512_mul_pd(s, _mm512_cvtps_pd(az)))));
+}
+
+SIMD_TARGET("avx512f")
+inline int nearestTriangleAVX512(const TriangleSoA &s, const uint32_t *slots, int count, const WatertightRay &r, float t_min, float t_max,
+                                 float &t, float &u, float &v)
+{
+    const int k[3] = {r.kx, r.ky, r.kz};
+    __m256 origin[3] = {_mm256_set1_ps(r.origin[r.kx]), _mm256_set1_ps(r.origin[r.ky]), _mm256_set1_ps(r.origin[r.kz])};
+    __m512d sx = _mm512_set1_pd(r.sx), sy = _mm512_set1_pd(r.sy);
+    __m256 sz = _mm256_set1_ps(r.sz);
+    __m512d zero = _mm512_setzero_pd();
+    int nearest = -1;
+    for (int first = 0; first < count; first += 8)
+    {
+        int n = count - first < 8 ? count - first : 8;
+        __mmask16 active = __mmask16((1u << n) - 1);
+        __m512i index = _mm512_maskz_loadu_epi32(active, slots + first);
+
+        __m256 p[3][3];
+        for (int vert = 0; vert < 3; vert++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                __m512 gathered = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), active, index, s.v[vert][k[axis]], 4);
+                p[vert][axis] = _mm256_sub_ps(_mm512_castps512_ps256(gathered), origin[axis]);
+            }
+        }
+        __m512d ax = shearVertex8(p[0][0], sx, p[0][2]), ay = shearVertex8(p[0][1], sy, p[0][2]);
+        __m512d bx = shearVertex8(p[1][0], sx, p[1][2]), by = shearVertex8(p[1][1], sy, p[1][2]);
+        __m512d cx = shearVertex8(p[2][0], sx, p[2][2]), cy = shearVertex8(p[2][1], sy, p[2][2]);
+
+        __m512d U = _mm512_sub_pd(_mm512_mul_pd(cx, by), _mm512_mul_pd(cy, bx));
+        __m512d V = _mm512_sub_pd(_mm512_mul_pd(ax, cy), _mm512_mul_pd(ay, cx));
+        __m512d W = _mm512_sub_pd(_mm512_mul_pd(bx, ay), _mm512_mul_pd(by, ax));
+        __mmask8 anyNeg = _mm512_cmp_pd_mask(U, zero, _CMP_LT_OQ) | _mm512_cmp_pd_mask(V, zero, _CMP_LT_OQ) | _mm512_cmp_pd_mask(W, zero, _CMP_LT_OQ);
+        __mmask8 anyPos = _mm512_cmp_pd_mask(U, zero, _CMP_GT_OQ) | _mm512_cmp_pd_mask(V, zero, _CMP_GT_OQ) | _mm512_cmp_pd_mask(W, zero, _CMP_GT_OQ);
+        __m512d det = _mm512_add_pd(_mm512_add_pd(U, V), W);
+        __mmask8 inside = __mmask8(~(anyNeg & anyPos) & _mm512_cmp_pd_mask(det, zero, _CMP_NEQ_OQ) & active);
+        if (!inside) continue;
+
+        __m512d az = _mm512_cvtps_pd(_mm256_mul_ps(sz, p[0][2]));
+        __m512d bz = _mm512_cvtps_pd(_mm256_mul_ps(sz, p[1][2]));
+        __m512d cz = _mm512_cvtps_pd(_mm256_mul_ps(sz, p[2][2]));
+        __m512d T = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(U, az), _mm512_mul_pd(V, bz)), _mm512_mul_pd(W, cz));
+        __m512d hitT = _mm512_cvtps_pd(_mm512_cvtpd_ps(_mm512_div_pd(T, det)));
+        __mmask8 hits = inside & _mm512_cmp_pd_mask(hitT, _mm512_set1_pd(t_min), _CMP_GE_OQ) & _mm512_cmp_pd_mask(hitT, _mm512_set1_pd(t_max), _CMP_LE_OQ);
+        if (!hits) continue;
+
+        double m = _mm512_mask_reduce_min_pd(hits, hitT);
+        int lane = lowestSetBit(_mm512_mask_cmp_pd_mask(hits, hitT, _mm512_set1_pd(m), _CMP_EQ_OQ));
+
+        alignas(64) double laneU[8], laneV[8], laneDet[8];
+        _mm512_store_pd(laneU, V);
+        _mm512_store_pd(laneV, W);
+        _mm512_store_pd(laneDet, det);
+        t_max = t = float(m);
+        u = float(laneU[lane] / laneDet[lane]);
+        v = float(laneV[lane] / laneDet[lane]);
+        nearest = first + lane;
+    }
+    return nearest;
+}
+
+#endif
+
+// Nearest of the triangles at slots[0..count) the ray hits between t_min and t_max, sets t and the barycentrics u, v
+// of the hit and returns its position in slots, or -1 on a miss. Tests 8 (avx512) or 4 (avx2) triangles at a time,
+// picked by cpuSimdLevel() when the program runs.
+inline int nearestTriangle(const TriangleSoA &s, const uint32_t *slots, int count, const WatertightRay &r, float t_min, float t_max,
+                           float &t, float &u, float &v)
+{
+#ifdef SIMD_RUNTIME_DISPATCH
+    switch (cpuSimdLevel())
+    {
+        case SimdLevel::AVX512: if (count >= 3) return nearestTriangleAVX512(s, slots, count, r, t_min, t_max, t, u, v); break;
+        case SimdLevel::AVX2:   if (count >= 3) return nearestTriangleAVX2(s, slots, count, r, t_min, t_max, t, u, v); break;
+        default:                break;
+    }
+#endif
+    return nearestTriangleScalar(s, slots, count, r, t_min, t_max, t, u, v);
+}
+
+#endif
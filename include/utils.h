@@ -5,6 +5,7 @@
 #include <vector.h>
 #include <stdlib.h>
 #include <random>
+#include <cmath>
 
 
 std::string readFileContents(const char *filePath);
@@ -76,6 +77,27 @@ struct ThreadLocal
     }
 };
 
+// two unit vectors that make n (unit length) a right handed orthonormal basis, Duff et al. 2017
+inline void orthonormalBasis(const vec3 &n, vec3 &a, vec3 &b)
+{
+    float sign = std::copysign(1.0f, n.z);
+    float s = -1 / (sign + n.z);
+    float t = n.x * n.y * s;
+    a = vec3(1 + sign * n.x * n.x * s, sign * t, -sign * n.x);
+    b = vec3(t, sign + n.y * n.y * s, -n.y);
+}
+
+// 64 bit FNV-1a, chain calls by passing the previous hash as seed
+inline uint64_t hashBytes(const void *data, size_t size, uint64_t seed = 14695981039346656037ull)
+{
+    const uint8_t *bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        seed = (seed ^ bytes[i]) * 1099511628211ull;
+    }
+    return seed;
+}
+
 std::ostream& operator << (std::ostream &out, glm::vec3 &vec);
 std::ostream& operator << (std::ostream &out, glm::vec3 &&vec);
 
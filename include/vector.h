@@ -7,6 +7,7 @@ using vec3 = glm::vec3;
 using point3 = glm::vec3;
 using nor3 = glm::vec3;
 using col3 = glm::vec3;
+using vec4 = glm::vec4;
 
 
 #endif
\ No newline at end of file
@@ -0,0 +1,207 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "ray.h"
+#include "utils.h"
+#include "camera.h"
+#include "shape.h"
+#include "material.h"
+#include "setting.h"
+#include "path_tracer.h"
+#include "tiles.h"
+
+#include <vector>
+#include <algorithm>
+#include <typeinfo>
+
+// Traces paths a bounce at a time over a whole batch instead of one path to the end. Each depth intersects every live
+// ray, sorts the hits so the same material type and instance are scattered back to back, and compacts the rays that
+// scattered for the next depth. The stage buffers never hold more than setting.wavefrontBatchSize paths.
+class WavefrontIntegrator
+{
+public:
+    // Adds the samples of the pixels of tile, in a width x height image, to sums, laid out row by row over the tile.
+    void render(const Tile &tile, int width, int height, Settings &setting, Camera &cam, ShapeList &world,
+                const LightList &lights, col3 *sums, ThreadLocal &tl)
+    {
+        int samples = setting.samplesPerPixel;
+        if (tile.width() <= 0 || tile.height() <= 0 || samples <= 0) return;
+
+        size_t batchSize = size_t(glm::max(setting.wavefrontBatchSize, 1));
+        reserve(batchSize);
+        size_t pathCount = size_t(tile.width()) * tile.height() * samples;
+        for (size_t first = 0; first < pathCount; first += batchSize)
+        {
+            size_t count = glm::min(batchSize, pathCount - first);
+            generate(first, count, samples, tile, width, height, cam, tl);
+            for (int depth = 1; depth <= setting.maxDepth && count > 0; depth++)
+            {
+                size_t hitCount = intersect(count, setting, world, sums);
+                sortByMaterial(hitCount);
+                count = scatter(hitCount, depth, world, lights, setting, sums, tl);
+            }
+        }
+    }
+
+private:
+    struct Hit
+    {
+        uint64_t materialType;
+        const Material *material;
+        uint32_t path;
+    };
+
+    // live paths, indexed by path slot
+    std::vector<Ray> rays;
+    std::vector<col3> throughputs;
+    std::vector<uint32_t> pixels;
+    // density scattering picked the ray with, 0 for camera rays, see emissionWeight()
+    std::vector<float> scatterPdfs;
+    std::vector<HitRecord> recs;
+    std::vector<uint8_t> hitFlags;
+    // hits of the current depth in the order they get scattered
+    std::vector<Hit> hits;
+    // survivors are compacted into these, then swapped with the live buffers
+    std::vector<Ray> nextRays;
+    std::vector<col3> nextThroughputs;
+    std::vector<uint32_t> nextPixels;
+    std::vector<float> nextScatterPdfs;
+
+    // the buffers are kept between calls, only a new batch size sizes them again
+    void reserve(size_t batchSize)
+    {
+        if (rays.size() == batchSize) return;
+        rays.resize(batchSize);
+        throughputs.resize(batchSize);
+        pixels.resize(batchSize);
+        scatterPdfs.resize(batchSize);
+        recs.resize(batchSize);
+        hitFlags.resize(batchSize);
+        hits.resize(batchSize);
+        nextRays.resize(batchSize);
+        nextThroughputs.resize(batchSize);
+        nextPixels.resize(batchSize);
+        nextScatterPdfs.resize(batchSize);
+    }
+
+    void generate(size_t first, size_t count, int samples, const Tile &tile, int width, int height, Camera &cam, ThreadLocal &tl)
+    {
+        for (size_t k = 0; k < count; k++)
+        {
+            uint32_t pixel = uint32_t((first + k) / samples);
+            int i = tile.x0 + int(pixel % tile.width());
+            int j = tile.y0 + int(pixel / tile.width());
+            float u = float(i + tl.randFloat()) / (width - 1);
+            float v = float(j + tl.randFloat()) / (height - 1);
+            rays[k] = cam.getRay(u, v);
+            throughputs[k] = col3(1, 1, 1);
+            pixels[k] = pixel;
+            scatterPdfs[k] = 0;
+        }
+    }
+
+    // Misses pick up the background and end here, returns the number of hits. With setting.packetSize 4, 8 or 16 the
+    // batch goes through ShapeList::hitPacket() that many neighbouring rays at a time. Camera rays are generated pixel
+    // by pixel and scatter() compacts the survivors in material order, so neighbouring slots mostly head the same way.
+    size_t intersect(size_t count, Settings &setting, ShapeList &world, col3 *sums)
+    {
+        switch (setting.packetSize)
+        {
+            case 4:  intersectPackets<4>(count, world); break;
+            case 8:  intersectPackets<8>(count, world); break;
+            case 16: intersectPackets<16>(count, world); break;
+            default:
+                for (size_t k = 0; k < count; k++) hitFlags[k] = world.hit(rays[k], 0.0001, INFINITY, recs[k]);
+                break;
+        }
+
+        size_t hitCount = 0;
+        for (size_t k = 0; k < count; k++)
+        {
+            if (hitFlags[k])
+            {
+                const Material *material = recs[k].material;
+                hits[hitCount++] = {typeid(*material).hash_code(), material, uint32_t(k)};
+            }
+            else
+            {
+                sums[pixels[k]] += throughputs[k] * setting.background;
+            }
+        }
+        return hitCount;
+    }
+
+    template <int W>
+    void intersectPackets(size_t count, ShapeList &world)
+    {
+        for (size_t first = 0; first < count; first += W)
+        {
+            int lanes = int(glm::min(size_t(W), count - first));
+            // the lanes past the end of the batch repeat its last ray and are left out of the mask
+            Ray block[W];
+            for (int lane = 0; lane < W; lane++) block[lane] = rays[first + glm::min(lane, lanes - 1)];
+            HitRecord laneRecs[W];
+            int hit = world.hitPacket(RayPacket<W>(block), (1 << lanes) - 1, 0.0001, INFINITY, laneRecs);
+            for (int lane = 0; lane < lanes; lane++)
+            {
+                hitFlags[first + lane] = (hit >> lane) & 1;
+                if (hitFlags[first + lane]) recs[first + lane] = laneRecs[lane];
+            }
+        }
+    }
+
+    void sortByMaterial(size_t hitCount)
+    {
+        std::sort(hits.begin(), hits.begin() + hitCount, [](const Hit &a, const Hit &b)
+        {
+            if (a.materialType != b.materialType) return a.materialType < b.materialType;
+            if (a.material != b.material) return a.material < b.material;
+            return a.path < b.path;
+        });
+    }
+
+    // Adds what the hits emit and the lights they sample, and keeps the paths that scattered and survived russian
+    // roulette, all the same way shade() does it for hit number depth. Returns the number of live paths for the next
+    // depth.
+    size_t scatter(size_t hitCount, int depth, ShapeList &world, const LightList &lights, const Settings &setting, col3 *sums,
+                   ThreadLocal &tl)
+    {
+        bool lightSampling = setting.lightSampling && !lights.empty();
+        bool last = depth >= setting.maxDepth, roulette = depth >= setting.rouletteDepth;
+        size_t live = 0;
+        for (size_t h = 0; h < hitCount; h++)
+        {
+            uint32_t k = hits[h].path;
+            HitRecord &rec = recs[k];
+            col3 emitted = rec.material->emitted(rec.u, rec.v, rec.p);
+            if (lightSampling && emitted != col3(0, 0, 0)) emitted *= emissionWeight(rays[k], rec, scatterPdfs[k], lights);
+            sums[pixels[k]] += throughputs[k] * emitted;
+
+            col3 attenuation;
+            if (last || !rec.material->scatter(rays[k], rec, attenuation, nextRays[live], tl)) continue;
+            nextScatterPdfs[live] = 0;
+            if (lightSampling)
+            {
+                sums[pixels[k]] += throughputs[k] * sampleDirectLight(rays[k], rec, world, lights, tl);
+                nextScatterPdfs[live] = scatterPdf(rays[k], rec, nextRays[live].direction);
+            }
+            col3 throughput = throughputs[k] * attenuation;
+            if (roulette)
+            {
+                float survival = survivalProbability(throughput);
+                if (tl.randFloat() >= survival) continue;
+                throughput /= survival;
+            }
+            nextThroughputs[live] = throughput;
+            nextPixels[live] = pixels[k];
+            live++;
+        }
+        std::swap(rays, nextRays);
+        std::swap(throughputs, nextThroughputs);
+        std::swap(pixels, nextPixels);
+        std::swap(scatterPdfs, nextScatterPdfs);
+        return live;
+    }
+};
+
+#endif
@@ -0,0 +1,550 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include "bvh.h"
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define WIDE_BVH_SSE
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE4_1__) || defined(__AVX__)
+#define WIDE_BVH_SSE41
+#endif
+
+#if defined(__AVX__)
+#define WIDE_BVH_AVX
+#endif
+
+#if defined(__AVX2__)
+#define WIDE_BVH_AVX2
+#endif
+
+enum class BVHLayout
+{
+    Binary,
+    Wide4,
+    Wide8,
+    Wide4Quantized,
+    Wide8Quantized,
+};
+
+// Child bounds are stored as separate arrays per component so all of them can be tested against a ray at once
+template <int N>
+struct alignas(32) WideBVHNode
+{
+    float minX[N], minY[N], minZ[N];
+    float maxX[N], maxY[N], maxZ[N];
+    uint32_t child[N]; // node index for interior children, first primitive for leaf children
+    uint32_t count[N]; // number of primitives, 0 for interior children
+    uint32_t childCount;
+
+    // slots past childCount are cleared
+    void setChildren(uint32_t numChildren, const AABB *bounds, const uint32_t *index, const uint32_t *primCount)
+    {
+        childCount = numChildren;
+        for (uint32_t i = 0; i < N; i++)
+        {
+            AABB box = i < numChildren ? bounds[i] : AABB();
+            minX[i] = box.min.x; minY[i] = box.min.y; minZ[i] = box.min.z;
+            maxX[i] = box.max.x; maxY[i] = box.max.y; maxZ[i] = box.max.z;
+            child[i] = i < numChildren ? index[i] : 0;
+            count[i] = i < numChildren ? primCount[i] : 0;
+        }
+    }
+    AABB childBounds(uint32_t i) const
+    {
+        return AABB(point3(minX[i], minY[i], minZ[i]), point3(maxX[i], maxY[i], maxZ[i]));
+    }
+};
+
+// Same as WideBVHNode but the child bounds are 8 bit offsets into a grid over the node's own bounds, about half the
+// size so a lot more of the tree stays in cache. The grid spacing is a power of two, so origin + q * scale is exact and
+// the quantized boxes always contain the real ones.
+template <int N>
+struct alignas(32) QuantizedWideBVHNode
+{
+    float originX, originY, originZ;
+    float scaleX, scaleY, scaleZ;
+    uint8_t qMinX[N], qMinY[N], qMinZ[N];
+    uint8_t qMaxX[N], qMaxY[N], qMaxZ[N];
+    uint32_t child[N];
+    uint32_t count[N];
+    uint32_t childCount;
+
+    void setChildren(uint32_t numChildren, const AABB *bounds, const uint32_t *index, const uint32_t *primCount)
+    {
+        AABB box;
+        for (uint32_t i = 0; i < numChildren; i++)
+        {
+            box.grow(bounds[i]);
+        }
+        originX = box.min.x; originY = box.min.y; originZ = box.min.z;
+        scaleX = gridScale(box.min.x, box.max.x);
+        scaleY = gridScale(box.min.y, box.max.y);
+        scaleZ = gridScale(box.min.z, box.max.z);
+
+        childCount = numChildren;
+        for (uint32_t i = 0; i < N; i++)
+        {
+            if (i < numChildren)
+            {
+                qMinX[i] = quantizeMin(bounds[i].min.x, originX, scaleX); qMaxX[i] = quantizeMax(bounds[i].max.x, originX, scaleX);
+                qMinY[i] = quantizeMin(bounds[i].min.y, originY, scaleY); qMaxY[i] = quantizeMax(bounds[i].max.y, originY, scaleY);
+                qMinZ[i] = quantizeMin(bounds[i].min.z, originZ, scaleZ); qMaxZ[i] = quantizeMax(bounds[i].max.z, originZ, scaleZ);
+            }
+            else
+            {
+                qMinX[i] = qMinY[i] = qMinZ[i] = 0;
+                qMaxX[i] = qMaxY[i] = qMaxZ[i] = 0;
+            }
+            child[i] = i < numChildren ? index[i] : 0;
+            count[i] = i < numChildren ? primCount[i] : 0;
+        }
+    }
+    AABB childBounds(uint32_t i) const
+    {
+        return AABB(point3(originX + qMinX[i] * scaleX, originY + qMinY[i] * scaleY, originZ + qMinZ[i] * scaleZ),
+                    point3(originX + qMaxX[i] * scaleX, originY + qMaxY[i] * scaleY, originZ + qMaxZ[i] * scaleZ));
+    }
+
+private:
+    // smallest power of two that still lets 255 steps reach from origin to max
+    static float gridScale(float origin, float max)
+    {
+        int exponent = 0;
+        float mantissa = std::frexp((max - origin) / 255.0f, &exponent);
+        if (mantissa == 0.5f) exponent--;
+        float scale = std::ldexp(1.0f, exponent);
+        while (origin + 255.0f * scale < max)
+        {
+            scale *= 2.0f;
+        }
+        return scale;
+    }
+    // rounded outwards, the loops catch the cases where (v - origin) itself was rounded
+    static uint8_t quantizeMin(float v, float origin, float scale)
+    {
+        int q = glm::clamp(int(std::floor((v - origin) / scale)), 0, 255);
+        while (q > 0 && origin + q * scale > v) q--;
+        return uint8_t(q);
+    }
+    static uint8_t quantizeMax(float v, float origin, float scale)
+    {
+        int q = glm::clamp(int(std::ceil((v - origin) / scale)), 0, 255);
+        while (q < 255 && origin + q * scale < v) q++;
+        return uint8_t(q);
+    }
+};
+
+// Precomputed per ray data for the slab test, t = bound * invDir - origin * invDir. Direction components of 0 become
+// tiny ones of the same sign, an infinite invDir would make both products infinite and the difference NaN, dropping
+// every box an axis aligned ray hits.
+struct WideRay
+{
+    vec3 invDir;
+    vec3 originInvDir;
+
+    WideRay(const Ray &r)
+    {
+        vec3 d = r.direction;
+        for (int a = 0; a < 3; a++)
+        {
+            if (glm::abs(d[a]) < 1e-20f) d[a] = std::signbit(d[a]) ? -1e-20f : 1e-20f;
+        }
+        invDir = 1.0f / d;
+        originInvDir = r.origin * invDir;
+    }
+};
+
+inline bool slabTest(const AABB &box, const WideRay &ray, float t_min, float t_max, float &dist)
+{
+    vec3 t0 = box.min * ray.invDir - ray.originInvDir;
+    vec3 t1 = box.max * ray.invDir - ray.originInvDir;
+    vec3 tSmall = glm::min(t0, t1);
+    vec3 tBig = glm::max(t0, t1);
+    dist = glm::max(glm::max(tSmall.x, tSmall.y), glm::max(tSmall.z, t_min));
+    return dist <= glm::min(glm::min(tBig.x, tBig.y), glm::min(tBig.z, t_max));
+}
+
+// Tests the ray against every child of the node, writes the entry distances and returns a bit mask of the hit children
+template <int N, typename Node>
+inline int intersectChildren(const Node &node, const WideRay &ray, float t_min, float t_max, float *dist)
+{
+    int mask = 0;
+    for (uint32_t i = 0; i < node.childCount; i++)
+    {
+        if (slabTest(node.childBounds(i), ray, t_min, t_max, dist[i])) mask |= 1 << i;
+    }
+    return mask;
+}
+
+#ifdef WIDE_BVH_SSE
+inline int intersectChildren4(__m128 minX, __m128 minY, __m128 minZ, __m128 maxX, __m128 maxY, __m128 maxZ,
+                              const WideRay &ray, float t_min, float t_max, float *dist)
+{
+    __m128 idx = _mm_set1_ps(ray.invDir.x), idy = _mm_set1_ps(ray.invDir.y), idz = _mm_set1_ps(ray.invDir.z);
+    __m128 oix = _mm_set1_ps(ray.originInvDir.x), oiy = _mm_set1_ps(ray.originInvDir.y), oiz = _mm_set1_ps(ray.originInvDir.z);
+
+    __m128 tx0 = _mm_sub_ps(_mm_mul_ps(minX, idx), oix), tx1 = _mm_sub_ps(_mm_mul_ps(maxX, idx), oix);
+    __m128 ty0 = _mm_sub_ps(_mm_mul_ps(minY, idy), oiy), ty1 = _mm_sub_ps(_mm_mul_ps(maxY, idy), oiy);
+    __m128 tz0 = _mm_sub_ps(_mm_mul_ps(minZ, idz), oiz), tz1 = _mm_sub_ps(_mm_mul_ps(maxZ, idz), oiz);
+
+    __m128 tEnter = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx0, tx1), _mm_min_ps(ty0, ty1)), _mm_max_ps(_mm_min_ps(tz0, tz1), _mm_set1_ps(t_min)));
+    __m128 tExit = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx0, tx1), _mm_max_ps(ty0, ty1)), _mm_min_ps(_mm_max_ps(tz0, tz1), _mm_set1_ps(t_max)));
+    _mm_storeu_ps(dist, tEnter);
+    return _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit));
+}
+
+template <>
+inline int intersectChildren<4>(const WideBVHNode<4> &node, const WideRay &ray, float t_min, float t_max, float *dist)
+{
+    int mask = intersectChildren4(_mm_load_ps(node.minX), _mm_load_ps(node.minY), _mm_load_ps(node.minZ),
+                                  _mm_load_ps(node.maxX), _mm_load_ps(node.maxY), _mm_load_ps(node.maxZ), ray, t_min, t_max, dist);
+    return mask & ((1 << node.childCount) - 1);
+}
+
+#ifdef WIDE_BVH_AVX
+inline int intersectChildren8(__m256 minX, __m256 minY, __m256 minZ, __m256 maxX, __m256 maxY, __m256 maxZ,
+                              const WideRay &ray, float t_min, float t_max, float *dist)
+{
+    __m256 idx = _mm256_set1_ps(ray.invDir.x), idy = _mm256_set1_ps(ray.invDir.y), idz = _mm256_set1_ps(ray.invDir.z);
+    __m256 oix = _mm256_set1_ps(ray.originInvDir.x), oiy = _mm256_set1_ps(ray.originInvDir.y), oiz = _mm256_set1_ps(ray.originInvDir.z);
+
+    __m256 tx0 = _mm256_sub_ps(_mm256_mul_ps(minX, idx), oix), tx1 = _mm256_sub_ps(_mm256_mul_ps(maxX, idx), oix);
+    __m256 ty0 = _mm256_sub_ps(_mm256_mul_ps(minY, idy), oiy), ty1 = _mm256_sub_ps(_mm256_mul_ps(maxY, idy), oiy);
+    __m256 tz0 = _mm256_sub_ps(_mm256_mul_ps(minZ, idz), oiz), tz1 = _mm256_sub_ps(_mm256_mul_ps(maxZ, idz), oiz);
+
+    __m256 tEnter = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(tx0, tx1), _mm256_min_ps(ty0, ty1)), _mm256_max_ps(_mm256_min_ps(tz0, tz1), _mm256_set1_ps(t_min)));
+    __m256 tExit = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(tx0, tx1), _mm256_max_ps(ty0, ty1)), _mm256_min_ps(_mm256_max_ps(tz0, tz1), _mm256_set1_ps(t_max)));
+    _mm256_storeu_ps(dist, tEnter);
+    return _mm256_movemask_ps(_mm256_cmp_ps(tEnter, tExit, _CMP_LE_OQ));
+}
+#endif
+
+template <>
+inline int intersectChildren<8>(const WideBVHNode<8> &node, const WideRay &ray, float t_min, float t_max, float *dist)
+{
+#ifdef WIDE_BVH_AVX
+    int mask = intersectChildren8(_mm256_load_ps(node.minX), _mm256_load_ps(node.minY), _mm256_load_ps(node.minZ),
+                                  _mm256_load_ps(node.maxX), _mm256_load_ps(node.maxY), _mm256_load_ps(node.maxZ), ray, t_min, t_max, dist);
+#else
+    // two sse halves
+    int mask = 0;
+    for (int h = 0; h < 8; h += 4)
+    {
+        mask |= intersectChildren4(_mm_load_ps(node.minX + h), _mm_load_ps(node.minY + h), _mm_load_ps(node.minZ + h),
+                                   _mm_load_ps(node.maxX + h), _mm_load_ps(node.maxY + h), _mm_load_ps(node.maxZ + h), ray, t_min, t_max, dist + h) << h;
+    }
+#endif
+    return mask & ((1 << node.childCount) - 1);
+}
+
+#ifdef WIDE_BVH_SSE41
+// four 8 bit grid coordinates to world space floats
+inline __m128 dequantize4(const uint8_t *q, float origin, float scale)
+{
+    int32_t bytes;
+    memcpy(&bytes, q, sizeof(bytes));
+    __m128 f = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+    return _mm_add_ps(_mm_set1_ps(origin), _mm_mul_ps(f, _mm_set1_ps(scale)));
+}
+
+template <>
+inline int intersectChildren<4>(const QuantizedWideBVHNode<4> &node, const WideRay &ray, float t_min, float t_max, float *dist)
+{
+    int mask = intersectChildren4(dequantize4(node.qMinX, node.originX, node.scaleX), dequantize4(node.qMinY, node.originY, node.scaleY),
+                                  dequantize4(node.qMinZ, node.originZ, node.scaleZ), dequantize4(node.qMaxX, node.originX, node.scaleX),
+                                  dequantize4(node.qMaxY, node.originY, node.scaleY), dequantize4(node.qMaxZ, node.originZ, node.scaleZ),
+                                  ray, t_min, t_max, dist);
+    return mask & ((1 << node.childCount) - 1);
+}
+
+#ifdef WIDE_BVH_AVX2
+inline __m256 dequantize8(const uint8_t *q, float origin, float scale)
+{
+    __m256 f = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(q))));
+    return _mm256_add_ps(_mm256_set1_ps(origin), _mm256_mul_ps(f, _mm256_set1_ps(scale)));
+}
+#endif
+
+template <>
+inline int intersectChildren<8>(const QuantizedWideBVHNode<8> &node, const WideRay &ray, float t_min, float t_max, float *dist)
+{
+#ifdef WIDE_BVH_AVX2
+    int mask = intersectChildren8(dequantize8(node.qMinX, node.originX, node.scaleX), dequantize8(node.qMinY, node.originY, node.scaleY),
+                                  dequantize8(node.qMinZ, node.originZ, node.scaleZ), dequantize8(node.qMaxX, node.originX, node.scaleX),
+                                  dequantize8(node.qMaxY, node.originY, node.scaleY), dequantize8(node.qMaxZ, node.originZ, node.scaleZ),
+                                  ray, t_min, t_max, dist);
+#else
+    int mask = 0;
+    for (int h = 0; h < 8; h += 4)
+    {
+        mask |= intersectChildren4(dequantize4(node.qMinX + h, node.originX, node.scaleX), dequantize4(node.qMinY + h, node.originY, node.scaleY),
+                                   dequantize4(node.qMinZ + h, node.originZ, node.scaleZ), dequantize4(node.qMaxX + h, node.originX, node.scaleX),
+                                   dequantize4(node.qMaxY + h, node.originY, node.scaleY), dequantize4(node.qMaxZ + h, node.originZ, node.scaleZ),
+                                   ray, t_min, t_max, dist + h) << h;
+    }
+#endif
+    return mask & ((1 << node.childCount) - 1);
+}
+#endif
+#endif
+
+// N wide bvh collapsed from a binary one, every node tests up to N children with a single simd slab test.
+// Node is WideBVHNode<N> or QuantizedWideBVHNode<N>, anything with setChildren() and childBounds() works.
+template <int N, typename Node = WideBVHNode<N>>
+class WideBVH
+{
+public:
+    void build(const BVH &binary)
+    {
+        nodes.clear();
+        primIndices = binary.primIndices;
+        if (binary.empty())
+        {
+            return;
+        }
+
+        nodes.emplace_back();
+        if (binary.nodes[0].isLeaf())
+        {
+            const BVHNode &leaf = binary.nodes[0];
+            nodes[0].setChildren(1, &leaf.bounds, &leaf.leftFirst, &leaf.count);
+            return;
+        }
+        collapse(binary, 0, 0);
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    // same as BVH::refit, every child slot is updated from its primitives or from the slots of its child node
+    void refit(const std::vector<AABB> &primBounds, int numThreads)
+    {
+        if (nodes.empty()) return;
+
+        std::vector<uint32_t> topNodes;
+        std::vector<uint32_t> subtrees = {0};
+        while (subtrees.size() < size_t(numThreads) * 8)
+        {
+            std::vector<uint32_t> next;
+            for (uint32_t i : subtrees)
+            {
+                topNodes.push_back(i);
+                for (uint32_t c = 0; c < nodes[i].childCount; c++)
+                {
+                    if (nodes[i].count[c] == 0) next.push_back(nodes[i].child[c]);
+                }
+            }
+            subtrees.swap(next);
+            if (subtrees.empty()) break;
+        }
+
+        std::atomic<size_t> nextSubtree{0};
+        parallelFor(numThreads, [&](int)
+        {
+            size_t i;
+            while ((i = nextSubtree.fetch_add(1)) < subtrees.size())
+            {
+                refitNode(subtrees[i], primBounds, true);
+            }
+        });
+
+        for (auto it = topNodes.rbegin(); it != topNodes.rend(); it++)
+        {
+            refitNode(*it, primBounds, false);
+        }
+    }
+
+    // same contract as BVH::traverse
+    template <bool AnyHit = false, typename Intersect>
+    bool traverse(const Ray &r, float t_min, float &t_max, Intersect &&intersect, TraversalStats *stats = nullptr) const
+    {
+        if (nodes.empty()) return false;
+
+        WideRay ray(r);
+        struct StackEntry { uint32_t node; float dist; };
+        StackEntry stack[BVH::MAX_DEPTH * (N - 1)];
+        int stackPtr = 0;
+        uint32_t nodeIndex = 0;
+        bool hitAnything = false;
+
+        while (true)
+        {
+            const Node &node = nodes[nodeIndex];
+            if (stats) stats->nodeVisits++;
+            alignas(32) float dist[N];
+            int mask = intersectChildren<N>(node, ray, t_min, t_max, dist);
+
+            // leaves are intersected right away, interior children are sorted by distance
+            int order[N];
+            int hitCount = 0;
+            while (mask)
+            {
+                int i = countTrailingZeros(mask);
+                mask &= mask - 1;
+                if (node.count[i] > 0)
+                {
+                    if (stats) stats->primTests += node.count[i];
+                    if (intersectLeaf<AnyHit>(intersect, &primIndices[node.child[i]], node.count[i], t_max))
+                    {
+                        if (AnyHit) return true;
+                        hitAnything = true;
+                    }
+                    continue;
+                }
+                // any hit order doesn't matter, the sort is skipped
+                int j = hitCount++;
+                while (!AnyHit && j > 0 && dist[order[j - 1]] < dist[i])
+                {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = i;
+            }
+
+            // order is far to near, push all but the nearest one
+            for (int k = 0; k < hitCount - 1; k++)
+            {
+                stack[stackPtr++] = {node.child[order[k]], dist[order[k]]};
+            }
+            if (hitCount > 0 && dist[order[hitCount - 1]] <= t_max)
+            {
+                nodeIndex = node.child[order[hitCount - 1]];
+                continue;
+            }
+
+            bool found = false;
+            while (stackPtr > 0)
+            {
+                StackEntry &entry = stack[--stackPtr];
+                if (entry.dist <= t_max)
+                {
+                    nodeIndex = entry.node;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) break;
+        }
+
+        return hitAnything;
+    }
+
+    Array<Node> nodes;
+    Array<uint32_t> primIndices;
+
+private:
+    static int countTrailingZeros(int x)
+    {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, x);
+        return int(index);
+#else
+        return __builtin_ctz(x);
+#endif
+    }
+
+    AABB nodeBounds(uint32_t nodeIndex) const
+    {
+        const Node &node = nodes[nodeIndex];
+        AABB box;
+        for (uint32_t c = 0; c < node.childCount; c++)
+        {
+            box.grow(node.childBounds(c));
+        }
+        return box;
+    }
+
+    void refitNode(uint32_t nodeIndex, const std::vector<AABB> &primBounds, bool recurse)
+    {
+        const Node &node = nodes[nodeIndex];
+        AABB bounds[N];
+        uint32_t index[N], primCount[N];
+        for (uint32_t c = 0; c < node.childCount; c++)
+        {
+            index[c] = node.child[c];
+            primCount[c] = node.count[c];
+            if (node.count[c] > 0)
+            {
+                for (uint32_t p = node.child[c]; p < node.child[c] + node.count[c]; p++)
+                {
+                    bounds[c].grow(primBounds[primIndices[p]]);
+                }
+            }
+            else
+            {
+                if (recurse) refitNode(node.child[c], primBounds, true);
+                bounds[c] = nodeBounds(node.child[c]);
+            }
+        }
+        nodes[nodeIndex].setChildren(node.childCount, bounds, index, primCount);
+    }
+
+    // pulls the grandchildren with the largest surface area up into this node until it has N children
+    void collapse(const BVH &binary, uint32_t binaryIndex, uint32_t wideIndex)
+    {
+        const BVHNode &binaryNode = binary.nodes[binaryIndex];
+        uint32_t children[N];
+        int childCount = 2;
+        children[0] = binaryNode.leftFirst;
+        children[1] = binaryNode.leftFirst + 1;
+
+        while (childCount < N)
+        {
+            int largest = -1;
+            float largestArea = -1;
+            for (int i = 0; i < childCount; i++)
+            {
+                const BVHNode &child = binary.nodes[children[i]];
+                if (!child.isLeaf() && child.bounds.area() > largestArea)
+                {
+                    largest = i;
+                    largestArea = child.bounds.area();
+                }
+            }
+            if (largest < 0) break;
+
+            uint32_t grandChild = binary.nodes[children[largest]].leftFirst;
+            children[largest] = grandChild;
+            children[childCount++] = grandChild + 1;
+        }
+
+        // all children are known before the node is written, quantized nodes need the whole box
+        AABB bounds[N];
+        uint32_t index[N], primCount[N];
+        for (int i = 0; i < childCount; i++)
+        {
+            const BVHNode &child = binary.nodes[children[i]];
+            bounds[i] = child.bounds;
+            if (child.isLeaf())
+            {
+                index[i] = child.leftFirst;
+                primCount[i] = child.count;
+            }
+            else
+            {
+                index[i] = uint32_t(nodes.size());
+                primCount[i] = 0;
+                nodes.emplace_back();
+            }
+        }
+        nodes[wideIndex].setChildren(childCount, bounds, index, primCount);
+
+        for (int i = 0; i < childCount; i++)
+        {
+            if (primCount[i] == 0) collapse(binary, children[i], index[i]);
+        }
+    }
+};
+
+template <int N>
+using QuantizedWideBVH = WideBVH<N, QuantizedWideBVHNode<N>>;
+
+#endif
@@ -11,91 +11,13 @@
 #include "material.h"
 #include "setting.h"
 #include "scene_examples.h"
+#include "light.h"
+#include "renderer.h"
 
-#include <thread>
+#include <algorithm>
 
 #include <glad/glad.h>
 
-col3 rayColor(Ray& r, ShapeList &world, Settings &setting, int depth, ThreadLocal& tl)
-{
-    if (depth <= 0)
-    {
-        return col3{0, 0, 0};
-    }
-
-    HitRecord rec;
-    if (!world.hit(r, 0.0001, INFINITY, rec))
-    {
-        return setting.background;   
-    }
-    Ray scattered;
-    col3 attenuation;
-    col3 emitted = rec.material->emitted(rec.u, rec.v, rec.p);
-    if (!rec.material->scatter(r, rec, attenuation, scattered, tl))
-    {
-        return emitted;
-    }
-    return emitted + attenuation * rayColor(scattered, world, setting, depth - 1, tl);
-
-}
-
-float render(int width, int height, Settings& setting, Texture2D &tex, Camera &cam, ShapeList &world, uint32_t* data)
-{
-    TimeIt timer;
-
-    tex.remove();
-
-    float scale = 1.0f / float(setting.samplesPerPixel);
-
-    std::vector<std::thread> threads;
-
-    for (int n=0; n<setting.numThreads; n++)
-    {
-        auto task = [&data, &setting, &cam, &world, &width, &height, n]()
-        {
-            // Thread local data
-            ThreadLocal tl;
-            tl.init(n);
-
-            int columnsPerThread = width / setting.numThreads;
-
-            // TODO: Switching i and j might be even faster
-            for (int j = 0; j < height; j++)
-            {
-                for (int i = n * columnsPerThread; i <= (n + 1) * columnsPerThread && i < width; i++)
-                {
-                    col3 pixelCol(0, 0, 0);
-                    for (int s=0; s<setting.samplesPerPixel; s++)
-                    {
-                        float u = float(i + tl.randFloat()) / (width - 1);
-                        float v = float(j + tl.randFloat()) / (height - 1);;
-
-                        Ray r = cam.getRay(u, v);
-
-                        pixelCol += rayColor(r, world, setting, setting.maxDepth, tl);
-                    }
-                    float scale = 1.0f / setting.samplesPerPixel;
-                    pixelCol.x = clamp(glm::sqrt(scale * pixelCol.x), 0.0f, 1.0f);
-                    pixelCol.y = clamp(glm::sqrt(scale * pixelCol.y), 0.0f, 1.0f);
-                    pixelCol.z = clamp(glm::sqrt(scale * pixelCol.z), 0.0f, 1.0f);
-
-                    data[j * width + i] = color(pixelCol);
-                }
-            }
-            // std::cout << "Thread " << n << " finished!\n";
-        };
-        threads.emplace_back(task);
-    }
-
-    for (int i=0; i<threads.size(); i++)
-    {
-        threads[i].join();
-    }
-
-    tex.loadData(width, height, data);
-    return timer.now() / 1000;
-}
-
 int main()
 {
     Window window(200, 400, "ray tracing");
@@ -114,8 +36,6 @@ int main()
     uint32_t *data = new uint32_t[width * height];
     static ImVec2 size = {50, 50};
 
-    float time = 0;
-
     point3 from, at;
     Camera cam(from, at, vec3(0, 1, 0), 1 / 1, 90.0f);
     ShapeList world;
@@ -124,6 +44,18 @@ int main()
 
     my_example_scene(world, materials, setting, from, at);
 //     triangle_example(world, materials, setting, from, at);
+//     random_spheres_example(world, materials, setting, from, at);
+//     forest_example(world, materials, setting, from, at);
+//     particles_example(world, materials, setting, from, at);
+//     terrain_example(world, materials, setting, from, at);
+    TimeIt buildTimer;
+    world.build(setting);
+    float buildTime = buildTimer.now() / 1000;
+    LightList lights;
+    lights.build(world, setting.lightTree);
+    // renders in the background once "render" was pressed, starting over whenever the view or a setting changes
+    ProgressiveRenderer renderer;
+    bool rendering = false;
 
     while (!window.shouldClose())
     {
@@ -150,13 +82,15 @@ int main()
 
         ImGui::Begin("Settings");
 
+        bool restart = false;
         if (ImGui::Button("render"))
         {
-            tex.loadData(width, height, data);
-            cam.set(from, at, vec3(0, 1, 0), size.x / size.y, setting.fov);
-            time = render(size.x, size.y, setting, tex, cam, world, data);
+            rendering = true;
+            restart = true;
         }
         ImGui::SameLine();
+        if (ImGui::Button("more samples")) renderer.addPasses(setting.samplesPerPixel);
+        ImGui::SameLine();
         if (ImGui::Button("save"))
         {
             std::cout << "P3\n" << width << ' ' << height << "\n255\n";
@@ -169,13 +103,48 @@ int main()
                 }
             }
         }
-        ImGui::Text("%f ms taken", time);
-        ImGui::DragFloat("fov", &setting.fov);
-        ImGui::DragInt("samples per pixel", &setting.samplesPerPixel);
-        ImGui::DragInt("max depth", &setting.maxDepth);
-        ImGui::DragFloat("epsilon", &setting.EPSILON, 0.0001);
-        ImGui::DragInt("threads", &setting.numThreads, 1, 1, 12);
-        ImGui::DragFloat3("background", (float*)(&setting.background));
+        ImGui::Text("%d samples, %f ms taken%s", renderer.samples(), renderer.elapsedMs(),
+                    renderer.running() ? ", rendering" : renderer.outOfTime() ? ", out of time" : "");
+        restart |= ImGui::DragFloat("time budget ms", &setting.timeBudgetMs, 1.0f, 0.0f, 600000.0f);
+        restart |= ImGui::DragFloat("fov", &setting.fov);
+        restart |= ImGui::DragInt("samples per pixel", &setting.samplesPerPixel);
+        restart |= ImGui::DragInt("max depth", &setting.maxDepth);
+        restart |= ImGui::DragInt("roulette depth", &setting.rouletteDepth, 1, 1, 64);
+        restart |= ImGui::Checkbox("light sampling", &setting.lightSampling);
+        if (ImGui::Checkbox("light tree", &setting.lightTree))
+        {
+            renderer.stop();
+            lights.build(world, setting.lightTree);
+            restart = true;
+        }
+        restart |= ImGui::DragFloat("epsilon", &setting.EPSILON, 0.0001);
+        restart |= ImGui::DragInt("threads", &setting.numThreads, 1, 1, 12);
+        restart |= ImGui::DragInt("tile size", &setting.tileSize, 1, 4, 256);
+        restart |= ImGui::DragFloat3("background", (float*)(&setting.background));
+        bool retone = ImGui::DragFloat("exposure", &setting.exposure, 0.01f, 0.0f, 64.0f);
+        retone |= ImGui::Combo("tonemap", (int*)(&setting.tonemap), "clamp\0reinhard\0aces\0");
+        retone |= ImGui::DragFloat("gamma", &setting.gamma, 0.01f, 1.0f, 4.0f);
+        bool rebuild = ImGui::Combo("accelerator", (int*)(&world.accelerator), "bvh\0grid\0two level grid\0");
+        rebuild |= ImGui::Combo("bvh builder", (int*)(&setting.bvhBuilder), "SAH\0LBVH\0SBVH\0");
+        rebuild |= ImGui::Combo("bvh layout", (int*)(&setting.bvhLayout), "binary\0wide 4\0wide 8\0wide 4 quantized\0wide 8 quantized\0");
+        if (rebuild)
+        {
+            renderer.stop();
+            restart = true;
+            buildTimer.from();
+            world.build(setting);
+            buildTime = buildTimer.now() / 1000;
+        }
+        ImGui::Text("%f ms build", buildTime);
+        restart |= ImGui::Combo("integrator", (int*)(&setting.integrator), "path\0wavefront\0");
+        restart |= ImGui::DragInt("wavefront batch size", &setting.wavefrontBatchSize, 1024, 1024, 1 << 22);
+        static const int packetSizes[] = {1, 4, 8, 16};
+        int packetIndex = int(std::find(packetSizes, packetSizes + 4, setting.packetSize) - packetSizes) % 4;
+        if (ImGui::Combo("ray packets", &packetIndex, "off\0" "4 rays\0" "8 rays\0" "16 rays\0"))
+        {
+            setting.packetSize = packetSizes[packetIndex];
+            restart = true;
+        }
 
         ImGui::NewLine();
 
@@ -190,6 +159,16 @@ int main()
             width = size.x;
             height = size.y;
             data = new uint32_t[width * height];
+            restart = true;
+        }
+        if (rendering && restart)
+        {
+            cam.set(from, at, vec3(0, 1, 0), size.x / size.y, setting.fov);
+            renderer.start(width, height, setting, cam, world, lights);
+        }
+        if (renderer.present(data, width, height, setting, retone))
+        {
+            tex.loadData(width, height, data);
         }
         if (tex.getHandle() != 0)
         {